@@ -0,0 +1,320 @@
+#include "access_log.h"
+#include "metrics.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LOG_BUFS 16        // iovecs per writev
+#define LOG_BUF_SIZE 65536 // formatted lines per iovec
+#define LINE_MAX_LEN (ACCESS_PATH_MAX * 6 + ACCESS_METHOD_MAX * 6 + 256)
+#define IDLE_PAUSE_MS 20   // between rounds that found nothing to write
+
+typedef struct {
+    struct timespec time; // CLOCK_REALTIME when the request was logged
+    unsigned long duration_ns;
+    long bytes;
+    unsigned char addr[16];
+    unsigned short port;
+    unsigned char family; // AF_INET, AF_INET6 or 0 when unknown
+    unsigned char resumed;
+    short status;
+    unsigned char method_len;
+    unsigned short path_len;
+    char method[ACCESS_METHOD_MAX];
+    char path[ACCESS_PATH_MAX];
+} ACCESS_RECORD;
+
+/* A single producer, single consumer ring: the owning thread only moves
+ * head, the writer only moves tail, so neither takes a lock and the
+ * indexes live on cache lines of their own.
+ */
+typedef struct access_ring {
+    alignas(64) atomic_ulong head; // next record the owner fills
+    atomic_ulong dropped;          // only written by the owner
+    alignas(64) atomic_ulong tail; // next record the writer formats
+    struct access_ring *next;
+    alignas(64) ACCESS_RECORD records[];
+} ACCESS_RING;
+
+char *ACCESS_LOG = NULL;
+long ACCESS_LOG_ROTATE = 0;
+int ACCESS_LOG_RING = 1024;
+
+static ACCESS_RING *_Atomic rings; // every thread that logged something
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread ACCESS_RING *ring;
+static unsigned long ring_mask;
+
+/* only touched by the writer thread */
+static const char *log_path;
+static long rotate_size;
+static int log_fd = -1;
+static long log_size;
+static char bufs[LOG_BUFS][LOG_BUF_SIZE];
+
+static atomic_ulong written, rotations, write_errors, no_ring;
+
+static const char hex[] = "0123456789abcdef";
+
+/* registers the calling thread's ring the first time it logs; rings live
+ * as long as the process, like the threads that own them
+ */
+static ACCESS_RING *own_ring(void) {
+    if (ring != NULL)
+        return ring;
+    size_t size = sizeof(ACCESS_RING) +
+                  (ring_mask + 1) * sizeof(ACCESS_RECORD);
+    ACCESS_RING *r = aligned_alloc(alignof(ACCESS_RING),
+                                   (size + 63) / 64 * 64);
+    if (r == NULL)
+        return NULL;
+    atomic_init(&r->head, 0);
+    atomic_init(&r->dropped, 0);
+    atomic_init(&r->tail, 0);
+    pthread_mutex_lock(&rings_lock);
+    r->next = atomic_load(&rings);
+    atomic_store_explicit(&rings, r, memory_order_release);
+    pthread_mutex_unlock(&rings_lock);
+    return ring = r;
+}
+
+static void drop(atomic_ulong *counter) {
+    atomic_store_explicit(
+        counter, atomic_load_explicit(counter, memory_order_relaxed) + 1,
+        memory_order_relaxed);
+    metrics_add(M_ACCESS_LOG_DROPS, 1);
+}
+
+void access_log(const ACCESS_ENTRY *entry) {
+    ACCESS_RING *r = own_ring();
+    if (r == NULL) {
+        drop(&no_ring);
+        return;
+    }
+    unsigned long head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&r->tail, memory_order_acquire) >
+        ring_mask) {
+        drop(&r->dropped);
+        return;
+    }
+
+    ACCESS_RECORD *rec = &r->records[head & ring_mask];
+    clock_gettime(CLOCK_REALTIME_COARSE, &rec->time);
+    rec->duration_ns = entry->duration_ns;
+    rec->bytes = entry->bytes;
+    rec->status = entry->status;
+    rec->resumed = entry->resumed != 0;
+    rec->family = 0;
+    if (entry->peer != NULL && entry->peer->sa_family == AF_INET) {
+        const struct sockaddr_in *in = (const void *)entry->peer;
+        rec->family = AF_INET;
+        memcpy(rec->addr, &in->sin_addr, sizeof(in->sin_addr));
+        rec->port = ntohs(in->sin_port);
+    } else if (entry->peer != NULL && entry->peer->sa_family == AF_INET6) {
+        const struct sockaddr_in6 *in6 = (const void *)entry->peer;
+        rec->family = AF_INET6;
+        memcpy(rec->addr, &in6->sin6_addr, sizeof(in6->sin6_addr));
+        rec->port = ntohs(in6->sin6_port);
+    }
+    rec->method_len = entry->method_len < ACCESS_METHOD_MAX
+                          ? entry->method_len
+                          : ACCESS_METHOD_MAX;
+    memcpy(rec->method, entry->method, rec->method_len);
+    rec->path_len = entry->path_len < ACCESS_PATH_MAX ? entry->path_len
+                                                      : ACCESS_PATH_MAX;
+    memcpy(rec->path, entry->path, rec->path_len);
+
+    atomic_store_explicit(&r->head, head + 1, memory_order_release);
+}
+
+/* a JSON string body: quotes, backslashes and control bytes escaped */
+static char *put_escaped(char *p, const char *s, int len) {
+    for (int i = 0; i < len; i++) {
+        unsigned char c = s[i];
+        if (c == '"' || c == '\\') {
+            *p++ = '\\';
+            *p++ = c;
+        } else if (c < 0x20 || c == 0x7f) {
+            memcpy(p, "\\u00", 4);
+            p[4] = hex[c >> 4];
+            p[5] = hex[c & 15];
+            p += 6;
+        } else {
+            *p++ = c;
+        }
+    }
+    return p;
+}
+
+/* one JSON line, p has room for LINE_MAX_LEN bytes */
+static char *format_record(char *p, const ACCESS_RECORD *rec) {
+    static time_t last_second = -1; // the writer formats every second once
+    static char stamp[32];
+    if (rec->time.tv_sec != last_second) {
+        struct tm tm;
+        gmtime_r(&rec->time.tv_sec, &tm);
+        strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &tm);
+        last_second = rec->time.tv_sec;
+    }
+
+    char client[INET6_ADDRSTRLEN] = "-";
+    if (rec->family != 0)
+        inet_ntop(rec->family, rec->addr, client, sizeof(client));
+
+    p += sprintf(p, "{\"time\":\"%s.%03ldZ\",\"client\":\"%s\",\"port\":%u,"
+                    "\"method\":\"",
+                 stamp, rec->time.tv_nsec / 1000000, client, rec->port);
+    p = put_escaped(p, rec->method, rec->method_len);
+    p += sprintf(p, "\",\"path\":\"");
+    p = put_escaped(p, rec->path, rec->path_len);
+    p += sprintf(p,
+                 "\",\"status\":%d,\"bytes\":%ld,\"duration_us\":%lu,"
+                 "\"resumed\":%s}\n",
+                 rec->status, rec->bytes, rec->duration_ns / 1000,
+                 rec->resumed ? "true" : "false");
+    return p;
+}
+
+static int open_log(void) {
+    log_fd = open(log_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (log_fd < 0) {
+        perror(log_path);
+        return -1;
+    }
+    struct stat st;
+    log_size = fstat(log_fd, &st) == 0 ? st.st_size : 0;
+    return 0;
+}
+
+/* moves the full log to "path.1" and starts a new one */
+static void rotate(void) {
+    char old[PATH_MAX];
+    snprintf(old, sizeof(old), "%s.1", log_path);
+    if (rename(log_path, old) < 0) {
+        perror("access log rotation");
+        return;
+    }
+    close(log_fd);
+    if (open_log() == 0)
+        atomic_fetch_add(&rotations, 1);
+}
+
+static void write_all(struct iovec *iov, int n) {
+    while (n > 0) {
+        ssize_t done = writev(log_fd, iov, n);
+        if (done < 0 && errno == EINTR)
+            continue;
+        if (done < 0) {
+            atomic_fetch_add(&write_errors, 1);
+            return;
+        }
+        log_size += done;
+        while (n > 0 && (size_t)done >= iov->iov_len) {
+            done -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0) {
+            iov->iov_base = (char *)iov->iov_base + done;
+            iov->iov_len -= done;
+        }
+    }
+}
+
+/* Formats what every ring holds into the buffers, as long as they have
+ * room, and writes them with one writev. Returns the number of records.
+ */
+static unsigned long drain(void) {
+    struct iovec iov[LOG_BUFS];
+    int used = 0;
+    char *p = bufs[0];
+    unsigned long count = 0;
+
+    ACCESS_RING *r = atomic_load_explicit(&rings, memory_order_acquire);
+    for (; r != NULL && used < LOG_BUFS; r = r->next) {
+        unsigned long tail =
+            atomic_load_explicit(&r->tail, memory_order_relaxed);
+        unsigned long head =
+            atomic_load_explicit(&r->head, memory_order_acquire);
+        for (; tail != head; tail++, count++) {
+            if (bufs[used] + LOG_BUF_SIZE - p < LINE_MAX_LEN) {
+                iov[used] = (struct iovec){bufs[used], p - bufs[used]};
+                if (++used == LOG_BUFS)
+                    break;
+                p = bufs[used];
+            }
+            p = format_record(p, &r->records[tail & ring_mask]);
+        }
+        /* the records are copied out, the owner may reuse their slots */
+        atomic_store_explicit(&r->tail, tail, memory_order_release);
+    }
+    if (used < LOG_BUFS && p > bufs[used]) {
+        iov[used] = (struct iovec){bufs[used], p - bufs[used]};
+        used++;
+    }
+
+    if (used > 0) {
+        write_all(iov, used);
+        atomic_fetch_add(&written, count);
+        if (rotate_size > 0 && log_size >= rotate_size)
+            rotate();
+    }
+    return count;
+}
+
+static void *writer(void *arg) {
+    (void)arg;
+    struct timespec pause = {0, IDLE_PAUSE_MS * 1000000L};
+    while (1) {
+        if (drain() == 0)
+            nanosleep(&pause, NULL);
+    }
+    return NULL;
+}
+
+int access_log_init(const char *path, long rotate, int ring_size) {
+    unsigned long size = 1;
+    while (size < (unsigned long)(ring_size > 0 ? ring_size : 1))
+        size <<= 1;
+    ring_mask = size - 1;
+    log_path = path;
+    rotate_size = rotate;
+    if (open_log() < 0)
+        return -1;
+
+    pthread_t tid;
+    int err;
+    if ((err = pthread_create(&tid, NULL, writer, NULL))) {
+        fprintf(stderr, "pthread_create: %s\n", strerror(err));
+        close(log_fd);
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
+
+void access_log_stats(FILE *fp) {
+    unsigned long dropped = atomic_load(&no_ring);
+    int threads = 0;
+    for (ACCESS_RING *r = atomic_load(&rings); r != NULL; r = r->next) {
+        dropped += atomic_load(&r->dropped);
+        threads++;
+    }
+    fprintf(fp,
+            "access log: %lu written, %lu dropped, %d rings, %lu "
+            "rotations, %lu write errors\n",
+            atomic_load(&written), dropped, threads, atomic_load(&rotations),
+            atomic_load(&write_errors));
+}
@@ -0,0 +1,41 @@
+#ifndef ACCESS_LOG_H
+#define ACCESS_LOG_H
+
+#include <stdio.h>
+#include <sys/socket.h>
+
+extern char *ACCESS_LOG;
+extern long ACCESS_LOG_ROTATE;
+extern int ACCESS_LOG_RING;
+
+#define ACCESS_PATH_MAX 256   // longer request targets are cut
+#define ACCESS_METHOD_MAX 16
+
+/* One request as the worker saw it. The strings are not NUL-terminated,
+ * they are copied into the record and cut to fit.
+ */
+typedef struct {
+    const struct sockaddr *peer; // NULL when unknown
+    const char *method;
+    int method_len;
+    const char *path;
+    int path_len;
+    int status;
+    long bytes; // of the response body
+    unsigned long duration_ns;
+    int resumed; // the TLS session was resumed
+} ACCESS_ENTRY;
+
+/* Opens the log and starts the thread that writes it. Every thread that
+ * logs gets a ring of ring_size records, the log is renamed to "path.1"
+ * once it grew past rotate bytes (0 never rotates).
+ */
+int access_log_init(const char *path, long rotate, int ring_size);
+
+/* copies the entry into the calling thread's ring, never blocks: when the
+ * ring is full the entry is dropped and counted
+ */
+void access_log(const ACCESS_ENTRY *entry);
+void access_log_stats(FILE *fp);
+
+#endif
@@ -0,0 +1,36 @@
+#include "alloc_count.h"
+
+#include <stddef.h>
+#include <string.h>
+
+static __thread unsigned long allocations;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size) {
+    allocations++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size) {
+    allocations++;
+    return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+    allocations++;
+    return __real_realloc(ptr, size);
+}
+
+/* libc's strdup allocates internally where --wrap does not reach */
+char *__wrap_strdup(const char *str) {
+    size_t len = strlen(str) + 1;
+    char *copy = __wrap_malloc(len);
+    if (copy != NULL)
+        memcpy(copy, str, len);
+    return copy;
+}
+
+unsigned long alloc_count(void) { return allocations; }
@@ -0,0 +1,11 @@
+#ifndef ALLOC_COUNT_H
+#define ALLOC_COUNT_H
+
+/* The number of heap allocations the calling thread made through malloc,
+ * calloc, realloc and strdup in the server's own code. The Makefile links
+ * with --wrap for those symbols, allocations made inside OpenSSL or libc
+ * are not counted.
+ */
+unsigned long alloc_count(void);
+
+#endif
@@ -0,0 +1,109 @@
+#include "arena.h"
+
+#include <stdalign.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_ALIGN alignof(max_align_t)
+
+static ARENA_BLOCK *block_new(size_t size) {
+    ARENA_BLOCK *block = malloc(sizeof(ARENA_BLOCK) + size);
+    if (block == NULL)
+        return NULL;
+    block->next = NULL;
+    block->size = size;
+    block->used = 0;
+    return block;
+}
+
+int arena_init(ARENA *arena, size_t size) {
+    arena->first = arena->current = block_new(size);
+    return arena->first == NULL ? -1 : 0;
+}
+
+void *arena_alloc(ARENA *arena, size_t size) {
+    ARENA_BLOCK *block = arena->current;
+    size_t start = (block->used + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+    if (start + size > block->size) {
+        size_t block_size = arena->first->size;
+        if (size > block_size)
+            block_size = size;
+        if ((block = block_new(block_size)) == NULL)
+            return NULL;
+        arena->current->next = block;
+        arena->current = block;
+        start = 0;
+    }
+
+    block->used = start + size;
+    return block->data + start;
+}
+
+/* frees the extra blocks and makes the first one available again */
+void arena_reset(ARENA *arena) {
+    ARENA_BLOCK *block = arena->first->next;
+    while (block != NULL) {
+        ARENA_BLOCK *next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->first->next = NULL;
+    arena->first->used = 0;
+    arena->current = arena->first;
+}
+
+void arena_destroy(ARENA *arena) {
+    arena_reset(arena);
+    free(arena->first);
+    arena->first = arena->current = NULL;
+}
+
+void strbuf_init(STRBUF *sb, ARENA *arena, size_t cap) {
+    sb->arena = arena;
+    sb->len = 0;
+    sb->data = arena_alloc(arena, cap);
+    sb->cap = sb->data != NULL ? cap : 0;
+    sb->failed = sb->data == NULL;
+}
+
+void strbuf_append(STRBUF *sb, const char *data, size_t len) {
+    if (sb->failed)
+        return;
+
+    if (sb->len + len > sb->cap) {
+        size_t cap = sb->cap * 2;
+        while (cap < sb->len + len)
+            cap *= 2;
+        char *grown = arena_alloc(sb->arena, cap);
+        if (grown == NULL) {
+            sb->failed = 1;
+            return;
+        }
+        memcpy(grown, sb->data, sb->len);
+        sb->data = grown;
+        sb->cap = cap;
+    }
+
+    memcpy(sb->data + sb->len, data, len);
+    sb->len += len;
+}
+
+void strbuf_puts(STRBUF *sb, const char *str) {
+    strbuf_append(sb, str, strlen(str));
+}
+
+void strbuf_putl(STRBUF *sb, long value) {
+    char digits[24];
+    int i = sizeof(digits);
+    unsigned long v = value < 0 ? -(unsigned long)value : (unsigned long)value;
+
+    do {
+        digits[--i] = '0' + v % 10;
+        v /= 10;
+    } while (v > 0);
+    if (value < 0)
+        digits[--i] = '-';
+
+    strbuf_append(sb, digits + i, sizeof(digits) - i);
+}
@@ -0,0 +1,43 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+/* A bump allocator that is reset once a request has been answered. The
+ * first block lives as long as the connection, requests that need more
+ * get extra blocks which are freed again by the reset.
+ */
+typedef struct arena_block {
+    struct arena_block *next;
+    size_t size;
+    size_t used;
+    char data[];
+} ARENA_BLOCK;
+
+typedef struct {
+    ARENA_BLOCK *first;
+    ARENA_BLOCK *current;
+} ARENA;
+
+/* A string that grows inside an arena and keeps track of its length, so
+ * appending never has to look for the end of what was written before.
+ */
+typedef struct {
+    ARENA *arena;
+    char *data;
+    size_t len;
+    size_t cap;
+    int failed; // set once an append could not get memory
+} STRBUF;
+
+int arena_init(ARENA *arena, size_t size);
+void *arena_alloc(ARENA *arena, size_t size);
+void arena_reset(ARENA *arena);
+void arena_destroy(ARENA *arena);
+
+void strbuf_init(STRBUF *sb, ARENA *arena, size_t cap);
+void strbuf_append(STRBUF *sb, const char *data, size_t len);
+void strbuf_puts(STRBUF *sb, const char *str);
+void strbuf_putl(STRBUF *sb, long value);
+
+#endif
@@ -0,0 +1,374 @@
+/* TLS load generator for the benchmark suite: every thread keeps one
+ * connection (or opens a new one per request) and sends the same request
+ * until the time is up. Prints one JSON line with the request rate and the
+ * latency percentiles.
+ */
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RESPONSE_BUF 65536
+#define MAX_SESSIONS 8 // tickets kept per thread
+
+static const char *host = "127.0.0.1";
+static int port = 4433;
+static int concurrency = 1;
+static double seconds = 5;
+static const char *method = "GET";
+static const char *path = "/";
+static long body_size = 0;
+static int keep_alive = 1;
+static int resume = 0;
+static const char *scenario = "custom";
+
+static SSL_CTX *ctx;
+static unsigned long deadline;
+static char *post_body;
+
+typedef struct {
+    int id;
+    unsigned long *latencies; // ns, one per request
+    long count;
+    long cap;
+    long errors;
+    long resumed; // connections that resumed a session
+    SSL_SESSION *sessions[MAX_SESSIONS]; // unused tickets, newest last
+    int nsessions;
+} THREAD;
+
+static unsigned long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/* Keeps the tickets the server sent to the thread that owns the
+ * connection. Under TLS 1.3 they only arrive after the handshake, with the
+ * first response, and each one is good for a single resumption, so every
+ * connection takes its own and the oldest are dropped when there are too
+ * many.
+ */
+static int new_session(SSL *ssl, SSL_SESSION *session) {
+    THREAD *t = SSL_get_app_data(ssl);
+    if (t->nsessions == MAX_SESSIONS) {
+        SSL_SESSION_free(t->sessions[0]);
+        memmove(t->sessions, t->sessions + 1,
+                (MAX_SESSIONS - 1) * sizeof(SSL_SESSION *));
+        t->nsessions--;
+    }
+    t->sessions[t->nsessions++] = session;
+    return 1; // the reference is ours now
+}
+
+static SSL *connect_tls(THREAD *t) {
+    struct sockaddr_in addr = {.sin_family = AF_INET,
+                               .sin_port = htons(port)};
+    inet_pton(AF_INET, host, &addr.sin_addr);
+
+    int s = socket(AF_INET, SOCK_STREAM, 0);
+    int on = 1;
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    if (s < 0 || connect(s, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        if (s >= 0)
+            close(s);
+        return NULL;
+    }
+    SSL *ssl = SSL_new(ctx);
+    SSL_set_fd(ssl, s);
+    SSL_set_app_data(ssl, t);
+    if (resume && t->nsessions > 0) {
+        SSL_SESSION *session = t->sessions[--t->nsessions];
+        SSL_set_session(ssl, session);
+        SSL_SESSION_free(session);
+    }
+    if (SSL_connect(ssl) <= 0) {
+        SSL_free(ssl);
+        close(s);
+        return NULL;
+    }
+    if (SSL_session_reused(ssl))
+        t->resumed++;
+    return ssl;
+}
+
+static void disconnect(SSL *ssl) {
+    int s = SSL_get_fd(ssl);
+    SSL_shutdown(ssl);
+    SSL_free(ssl);
+    close(s);
+}
+
+static int write_all(SSL *ssl, const char *data, long len) {
+    while (len > 0) {
+        int n = SSL_write(ssl, data, len > 1 << 20 ? 1 << 20 : len);
+        if (n <= 0)
+            return -1;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* reads one response, returns its status code or -1 */
+static int read_response(SSL *ssl, char *buf, int is_head) {
+    int len = 0;
+    char *end = NULL;
+    while (end == NULL) {
+        if (len == RESPONSE_BUF - 1)
+            return -1;
+        int n = SSL_read(ssl, buf + len, RESPONSE_BUF - 1 - len);
+        if (n <= 0)
+            return -1;
+        len += n;
+        buf[len] = '\0';
+        end = strstr(buf, "\r\n\r\n");
+    }
+    int status = atoi(buf + 9);
+    long length = 0;
+    for (char *p = strstr(buf, "\r\n"); p != NULL && p < end;
+         p = strstr(p + 2, "\r\n"))
+        if (strncasecmp(p + 2, "Content-Length:", 15) == 0)
+            length = atol(p + 17);
+    if (is_head || status == 304 || status == 204)
+        length = 0;
+
+    /* whatever followed the headers is part of the body */
+    long left = length - (len - (end + 4 - buf));
+    while (left > 0) {
+        int n = SSL_read(ssl, buf, left < RESPONSE_BUF ? left : RESPONSE_BUF);
+        if (n <= 0)
+            return -1;
+        left -= n;
+    }
+    return status;
+}
+
+static int request(SSL *ssl, char *buf, const char *m, const char *target,
+                   long size) {
+    char head[1024];
+    int n = snprintf(head, sizeof(head),
+                     "%s %s HTTP/1.1\r\nHost: %s\r\nConnection: %s\r\n", m,
+                     target, host, keep_alive ? "keep-alive" : "close");
+    if (size > 0)
+        n += snprintf(head + n, sizeof(head) - n, "Content-Length: %ld\r\n",
+                      size);
+    n += snprintf(head + n, sizeof(head) - n, "\r\n");
+    if (write_all(ssl, head, n) < 0 ||
+        (size > 0 && write_all(ssl, post_body, size) < 0))
+        return -1;
+    return read_response(ssl, buf, strcmp(m, "HEAD") == 0);
+}
+
+static void record(THREAD *t, unsigned long ns) {
+    if (t->count == t->cap) {
+        t->cap = t->cap ? t->cap * 2 : 4096;
+        t->latencies = realloc(t->latencies, t->cap * sizeof(*t->latencies));
+        if (t->latencies == NULL) {
+            perror("latencies");
+            exit(EXIT_FAILURE);
+        }
+    }
+    t->latencies[t->count++] = ns;
+}
+
+static void *run(void *arg) {
+    THREAD *t = (THREAD *)arg;
+    char *buf = malloc(RESPONSE_BUF);
+    char target[512];
+    SSL *ssl = NULL;
+    int is_post = strcmp(method, "POST") == 0;
+    int is_delete = strcmp(method, "DELETE") == 0;
+
+    /* uploads and deletions work on a file of their own per thread */
+    if (is_post || is_delete)
+        snprintf(target, sizeof(target), "%s/bench-%d", path, t->id);
+    else
+        snprintf(target, sizeof(target), "%s", path);
+
+    while (now_ns() < deadline) {
+        /* the handshake is part of the latency without keep-alive */
+        unsigned long start = now_ns();
+        if (ssl == NULL && (ssl = connect_tls(t)) == NULL) {
+            t->errors++;
+            continue;
+        }
+        /* every DELETE needs a file, the upload is not timed */
+        if (is_delete) {
+            if (request(ssl, buf, "POST", target, 16) != 201) {
+                t->errors++;
+                disconnect(ssl);
+                ssl = NULL;
+                continue;
+            }
+            if (!keep_alive) {
+                disconnect(ssl);
+                start = now_ns();
+                if ((ssl = connect_tls(t)) == NULL) {
+                    t->errors++;
+                    continue;
+                }
+            } else {
+                start = now_ns();
+            }
+        }
+
+        int status = request(ssl, buf, method, target, is_post ? body_size : 0);
+        if (status < 0) {
+            t->errors++;
+            disconnect(ssl);
+            ssl = NULL;
+            continue;
+        }
+        record(t, now_ns() - start);
+        if (status >= 400)
+            t->errors++;
+        if (!keep_alive) {
+            disconnect(ssl);
+            ssl = NULL;
+        }
+    }
+    if (ssl != NULL)
+        disconnect(ssl);
+    free(buf);
+    return NULL;
+}
+
+static int compare(const void *a, const void *b) {
+    unsigned long x = *(const unsigned long *)a;
+    unsigned long y = *(const unsigned long *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile(const unsigned long *sorted, long n, double p) {
+    if (n == 0)
+        return 0;
+    long i = (long)(p * n);
+    if (i >= n)
+        i = n - 1;
+    return sorted[i] / 1000.0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [-H host] [-p port] [-c concurrency] [-d seconds]\n"
+            "          [-m method] [-u path] [-s post bytes] [-k 0|1]\n"
+            "          [-r 0|1 resume sessions] [-n scenario name]\n",
+            prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "H:p:c:d:m:u:s:k:r:n:")) != -1) {
+        switch (opt) {
+        case 'H':
+            host = optarg;
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'c':
+            concurrency = atoi(optarg);
+            break;
+        case 'd':
+            seconds = atof(optarg);
+            break;
+        case 'm':
+            method = optarg;
+            break;
+        case 'u':
+            path = optarg;
+            break;
+        case 's':
+            body_size = atol(optarg);
+            break;
+        case 'k':
+            keep_alive = atoi(optarg);
+            break;
+        case 'r':
+            resume = atoi(optarg);
+            break;
+        case 'n':
+            scenario = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (concurrency < 1 || seconds <= 0)
+        usage(argv[0]);
+
+    ctx = SSL_CTX_new(TLS_client_method());
+    if (ctx == NULL) {
+        ERR_print_errors_fp(stderr);
+        return EXIT_FAILURE;
+    }
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, NULL);
+    if (resume) {
+        SSL_CTX_set_session_cache_mode(
+            ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+        SSL_CTX_sess_set_new_cb(ctx, new_session);
+    } else {
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+    }
+
+    long post_size = body_size > 16 ? body_size : 16;
+    post_body = malloc(post_size);
+    THREAD *threads = calloc(concurrency, sizeof(THREAD));
+    pthread_t *tids = calloc(concurrency, sizeof(pthread_t));
+    if (post_body == NULL || threads == NULL || tids == NULL) {
+        perror("loadgen");
+        return EXIT_FAILURE;
+    }
+    memset(post_body, 'x', post_size);
+
+    unsigned long start = now_ns();
+    deadline = start + (unsigned long)(seconds * 1e9);
+    for (int i = 0; i < concurrency; i++) {
+        threads[i].id = i;
+        pthread_create(&tids[i], NULL, run, &threads[i]);
+    }
+
+    long total = 0, errors = 0, resumed = 0;
+    for (int i = 0; i < concurrency; i++) {
+        pthread_join(tids[i], NULL);
+        total += threads[i].count;
+        errors += threads[i].errors;
+        resumed += threads[i].resumed;
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+
+    unsigned long *all = malloc((total ? total : 1) * sizeof(*all));
+    if (all == NULL) {
+        perror("latencies");
+        return EXIT_FAILURE;
+    }
+    long n = 0;
+    for (int i = 0; i < concurrency; i++) {
+        memcpy(all + n, threads[i].latencies,
+               threads[i].count * sizeof(*all));
+        n += threads[i].count;
+    }
+    qsort(all, n, sizeof(*all), compare);
+
+    printf("{\"scenario\":\"%s\",\"method\":\"%s\",\"path\":\"%s\","
+           "\"keep_alive\":%d,\"resume\":%d,\"concurrency\":%d,"
+           "\"seconds\":%.3f,\"requests\":%ld,\"errors\":%ld,"
+           "\"resumed\":%ld,\"rps\":%.1f,\"p50_us\":%.1f,\"p99_us\":%.1f,"
+           "\"p999_us\":%.1f}\n",
+           scenario, method, path, keep_alive, resume, concurrency, elapsed,
+           total, errors, resumed, total / elapsed, percentile(all, n, 0.50),
+           percentile(all, n, 0.99), percentile(all, n, 0.999));
+    return EXIT_SUCCESS;
+}
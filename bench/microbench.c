@@ -0,0 +1,274 @@
+/* Drives the request hot path in-process, without sockets or TLS: the
+ * parser, the handlers on cached files and the response header assembly.
+ * Prints one JSON line per benchmark with the time, cycles and heap
+ * allocations per request.
+ */
+#define _GNU_SOURCE // mkdtemp
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "../alloc_count.h"
+#include "../compress_cache.h"
+#include "../file_cache.h"
+#include "../meta_cache.h"
+#include "../mime.h"
+#include "../path_lock.h"
+#include "../request_handler.h"
+
+/* the settings tls_server.c would read from config.txt */
+char *HOME;
+int CONN_ENGINE = ENGINE_THREADS;
+int KTLS = 0;
+int IO_BUF_SIZE = 16384;
+int MAX_REQUEST_SIZE = 8192;
+int FLUSH_THRESHOLD = 16384;
+int DURABLE_POST = 0;
+long COMPRESS_MIN_SIZE = 1024;
+char *COMPRESS_TYPES = "text/plain,text/html";
+int GZIP_STATIC = 1;
+int HANDSHAKE_TIMEOUT = 0;
+int HEADER_TIMEOUT = 0;
+int BODY_TIMEOUT = 0;
+int KEEPALIVE_TIMEOUT = 0;
+int SEND_TIMEOUT = 0;
+
+void dispatch_connection(CONN *conn) { (void)conn; }
+int try_dispatch_connection(CONN *conn) { (void)conn; return 1; }
+
+/* what clients send: a bare tool request, browser requests with the usual
+ * header load, conditional and range requests and a miss
+ */
+static const char *corpus[] = {
+    "GET /index.html HTTP/1.1\r\nHost: localhost:4433\r\n"
+    "User-Agent: curl/7.88.1\r\nAccept: */*\r\n\r\n",
+
+    "GET /index.html HTTP/1.1\r\nHost: example.com\r\n"
+    "Connection: keep-alive\r\nCache-Control: max-age=0\r\n"
+    "sec-ch-ua: \"Chromium\";v=\"118\", \"Not=A?Brand\";v=\"99\"\r\n"
+    "sec-ch-ua-mobile: ?0\r\nsec-ch-ua-platform: \"Linux\"\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 "
+    "(KHTML, like Gecko) Chrome/118.0.0.0 Safari/537.36\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,"
+    "image/avif,image/webp,*/*;q=0.8\r\n"
+    "Sec-Fetch-Site: none\r\nSec-Fetch-Mode: navigate\r\n"
+    "Sec-Fetch-User: ?1\r\nSec-Fetch-Dest: document\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Accept-Language: en-US,en;q=0.9\r\n\r\n",
+
+    "GET /images/photo.jpeg HTTP/1.1\r\nHost: example.com\r\n"
+    "Connection: keep-alive\r\nAccept: image/avif,image/webp,*/*\r\n"
+    "Referer: https://example.com/index.html\r\n"
+    "If-None-Match: \"5f3a-1c8\"\r\n"
+    "If-Modified-Since: Sun, 06 Nov 1994 08:49:37 GMT\r\n\r\n",
+
+    "GET /docs/readme.txt HTTP/1.1\r\nHost: example.com\r\n"
+    "Connection: keep-alive\r\nRange: bytes=0-99\r\n\r\n",
+
+    "HEAD /index.html HTTP/1.1\r\nHost: example.com\r\n"
+    "Connection: keep-alive\r\n\r\n",
+
+    "GET /missing.html HTTP/1.1\r\nHost: example.com\r\n\r\n",
+};
+
+/* parsed but not handled, they write to the filesystem */
+static const char *upload_corpus[] = {
+    "POST /uploads/data.txt HTTP/1.1\r\nHost: example.com\r\n"
+    "Content-Type: text/plain\r\nContent-Length: 11\r\n\r\nhello world",
+
+    "DELETE /uploads/data.txt HTTP/1.1\r\nHost: example.com\r\n"
+    "Connection: keep-alive\r\n\r\n",
+};
+
+#define NCORPUS (int)(sizeof(corpus) / sizeof(corpus[0]))
+#define NUPLOAD (int)(sizeof(upload_corpus) / sizeof(upload_corpus[0]))
+
+static HTTP_REQUEST parsed[NCORPUS];
+static ARENA arena;
+
+static unsigned long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static unsigned long long cycles(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+/* keeps the compiler from dropping results */
+static volatile unsigned long sink;
+
+static void bench_parse(int i) {
+    HTTP_REQUEST req;
+    http_request_reset(&req);
+    sink += http_parse(&req, corpus[i], strlen(corpus[i]));
+}
+
+static void bench_parse_upload(int i) {
+    HTTP_REQUEST req;
+    const char *buf = upload_corpus[i % NUPLOAD];
+    http_request_reset(&req);
+    sink += http_parse(&req, buf, strlen(buf));
+}
+
+static void bench_content_type(int i) {
+    sink += (unsigned long)content_type(&parsed[i]);
+}
+
+static void bench_handler(int i) {
+    RESPONSE res;
+    run_handler(&parsed[i], &arena, NULL, &res);
+    sink += res.content_length;
+    file_body_release(&res.body);
+    arena_reset(&arena);
+}
+
+/* the headers of a 200 for a cached file, without running the handler */
+static RESPONSE fixed_response;
+
+static void bench_generate_headers(int i) {
+    STRBUF headers;
+    strbuf_init(&headers, &arena, 256);
+    generate_headers(&headers, 1, fixed_response.content_length, GET, 200,
+                     &parsed[i], &fixed_response.body);
+    sink += headers.len;
+    arena_reset(&arena);
+}
+
+static void bench_response_head(int i) {
+    STRBUF headers;
+    strbuf_init(&headers, &arena, 256);
+    response_head(&headers, &fixed_response, 1, &parsed[i]);
+    sink += headers.len;
+    arena_reset(&arena);
+}
+
+/* what a worker does for a buffered request, minus the TLS write */
+static void bench_request(int i) {
+    HTTP_REQUEST req;
+    RESPONSE res;
+    STRBUF headers;
+    http_request_reset(&req);
+    http_parse(&req, corpus[i], strlen(corpus[i]));
+    run_handler(&req, &arena, NULL, &res);
+    strbuf_init(&headers, &arena, 256);
+    response_head(&headers, &res, req.keep_alive, &req);
+    sink += headers.len;
+    file_body_release(&res.body);
+    arena_reset(&arena);
+}
+
+static void run(const char *name, void (*fn)(int), long iterations) {
+    int n = NCORPUS;
+    for (long i = 0; i < iterations / 10; i++) // warm up caches
+        fn(i % n);
+
+    unsigned long allocs = alloc_count();
+    unsigned long start = now_ns();
+    unsigned long long c0 = cycles();
+    for (long i = 0; i < iterations; i++)
+        fn(i % n);
+    unsigned long long c1 = cycles();
+    unsigned long elapsed = now_ns() - start;
+    allocs = alloc_count() - allocs;
+
+    printf("{\"bench\":\"%s\",\"iterations\":%ld,\"ns_per_request\":%.1f,"
+           "\"cycles_per_request\":%.1f,\"allocs_per_request\":%.3f}\n",
+           name, iterations, (double)elapsed / iterations,
+           (double)(c1 - c0) / iterations, (double)allocs / iterations);
+}
+
+static int write_file(const char *dir, const char *name, size_t size) {
+    char path[512];
+    snprintf(path, sizeof(path), "%s%s", dir, name);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return -1;
+    char buf[4096];
+    memset(buf, 'a', sizeof(buf));
+    for (size_t left = size; left > 0;) {
+        size_t n = left < sizeof(buf) ? left : sizeof(buf);
+        if (write(fd, buf, n) != (ssize_t)n) {
+            close(fd);
+            return -1;
+        }
+        left -= n;
+    }
+    return close(fd);
+}
+
+static void remove_home(void) {
+    char cmd[600];
+    snprintf(cmd, sizeof(cmd), "rm -rf '%s'", HOME);
+    if (system(cmd) != 0)
+        fprintf(stderr, "could not remove %s\n", HOME);
+}
+
+int main(int argc, char **argv) {
+    long iterations = argc > 1 ? atol(argv[1]) : 1000000;
+    if (iterations < 1)
+        iterations = 1;
+
+    /* the files the corpus asks for, served from the caches after the
+     * warm-up like on a busy server
+     */
+    static char home[] = "/tmp/microbench.XXXXXX";
+    if ((HOME = mkdtemp(home)) == NULL) {
+        perror("mkdtemp");
+        return EXIT_FAILURE;
+    }
+    char dir[512];
+    snprintf(dir, sizeof(dir), "%s/images", HOME);
+    mkdir(dir, 0755);
+    snprintf(dir, sizeof(dir), "%s/docs", HOME);
+    mkdir(dir, 0755);
+    if (write_file(HOME, "/index.html", 4096) < 0 ||
+        write_file(HOME, "/images/photo.jpeg", 65536) < 0 ||
+        write_file(HOME, "/docs/readme.txt", 800) < 0) {
+        perror("corpus files");
+        remove_home();
+        return EXIT_FAILURE;
+    }
+
+    if (mime_init(NULL) < 0 ||
+        file_cache_init(64L * 1024 * 1024, 1024L * 1024) < 0 ||
+        meta_cache_init(HOME, 1024) < 0 ||
+        compress_cache_init(16L * 1024 * 1024, 1024L * 1024) < 0 ||
+        path_lock_init(64) < 0 || arena_init(&arena, CONN_ARENA_SIZE) < 0) {
+        remove_home();
+        return EXIT_FAILURE;
+    }
+
+    for (int i = 0; i < NCORPUS; i++) {
+        http_request_reset(&parsed[i]);
+        http_parse(&parsed[i], corpus[i], strlen(corpus[i]));
+    }
+    RESPONSE res;
+    run_handler(&parsed[0], &arena, NULL, &res);
+    fixed_response = res;
+
+    run("http_parse", bench_parse, iterations);
+    run("http_parse_upload", bench_parse_upload, iterations);
+    run("content_type", bench_content_type, iterations);
+    run("run_handler", bench_handler, iterations);
+    run("generate_headers", bench_generate_headers, iterations);
+    run("response_head", bench_response_head, iterations);
+    run("request", bench_request, iterations);
+
+    file_body_release(&fixed_response.body);
+    remove_home();
+    return EXIT_SUCCESS;
+}
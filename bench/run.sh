@@ -0,0 +1,71 @@
+#!/bin/sh
+# Starts the server on loopback with its own HOME and config and runs the
+# load generator over every scenario and concurrency level. Results are
+# JSON lines on stdout, one per run, so builds and config.txt settings can
+# be compared with any JSON tool.
+#
+#   BENCH_PORT         port the server listens on (4443)
+#   BENCH_SECONDS      duration of every run (5)
+#   BENCH_CONCURRENCY  client threads, one run per value ("1 16 64")
+#   BENCH_CONFIG       extra config.txt lines, e.g. "CONN_ENGINE=uring KTLS=1"
+set -e
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+PORT=${BENCH_PORT:-4443}
+SECONDS_PER_RUN=${BENCH_SECONDS:-5}
+CONCURRENCY=${BENCH_CONCURRENCY:-"1 16 64"}
+LOADGEN="$ROOT/bench/loadgen"
+
+DIR=$(mktemp -d)
+SERVER_PID=
+cleanup() {
+    [ -n "$SERVER_PID" ] && kill "$SERVER_PID" 2>/dev/null || true
+    rm -rf "$DIR"
+}
+trap cleanup EXIT INT TERM
+
+# the server reads config.txt, cert.pem and key.pem from its directory
+mkdir -p "$DIR/home/bench"
+cp "$ROOT/cert.pem" "$ROOT/key.pem" "$DIR/"
+{
+    grep -v '^PORT=\|^HOME=' "$ROOT/config.txt"
+    echo "PORT=$PORT"
+    echo "HOME=$DIR/home"
+    for setting in $BENCH_CONFIG; do
+        echo "$setting"
+    done
+} >"$DIR/config.txt"
+
+head -c 1024 /dev/urandom >"$DIR/home/small.bin"
+head -c 1048576 /dev/urandom >"$DIR/home/large.bin"
+
+(cd "$DIR" && exec "$ROOT/tls_server.out" >/dev/null 2>"$DIR/server.log") &
+SERVER_PID=$!
+
+# wait for the listener
+tries=0
+until "$LOADGEN" -p "$PORT" -c 1 -d 0.1 -u /small.bin -n probe >/dev/null 2>&1; do
+    tries=$((tries + 1))
+    if [ $tries -ge 50 ] || ! kill -0 "$SERVER_PID" 2>/dev/null; then
+        echo "server did not start:" >&2
+        cat "$DIR/server.log" >&2
+        exit 1
+    fi
+    sleep 0.1
+done
+
+run() {
+    name=$1
+    shift
+    for c in $CONCURRENCY; do
+        "$LOADGEN" -p "$PORT" -c "$c" -d "$SECONDS_PER_RUN" -n "$name" "$@"
+    done
+}
+
+run handshake -k 0 -m GET -u /small.bin
+run handshake_resumed -k 0 -r 1 -m GET -u /small.bin
+run get_small -m GET -u /small.bin
+run get_large -m GET -u /large.bin
+run head -m HEAD -u /large.bin
+run post_upload -m POST -u /bench -s 65536
+run delete -m DELETE -u /bench
@@ -0,0 +1,186 @@
+#include "clock_cache.h"
+#include "metrics.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static CLOCK_NODE **bucket_of(CLOCK_CACHE *cache, CLOCK_SHARD *shard,
+                              uint64_t hash) {
+    return &shard->buckets[(hash / cache->nshards) % cache->nbuckets];
+}
+
+void clock_node_init(CLOCK_NODE *node, uint64_t hash, char *path,
+                     size_t cost) {
+    node->hash = hash;
+    node->path = path;
+    node->cost = cost;
+    atomic_init(&node->refs, 1);
+    atomic_init(&node->referenced, 1);
+}
+
+void clock_node_release(CLOCK_CACHE *cache, CLOCK_NODE *node) {
+    if (atomic_fetch_sub(&node->refs, 1) == 1)
+        cache->destroy(node);
+}
+
+/* removes an entry from its shard, the shard's write lock must be held */
+void clock_cache_unlink(CLOCK_CACHE *cache, CLOCK_SHARD *shard,
+                        CLOCK_NODE *node) {
+    CLOCK_NODE **link = bucket_of(cache, shard, node->hash);
+    while (*link != node)
+        link = &(*link)->next;
+    *link = node->next;
+
+    if (node->clock_next == node) {
+        shard->hand = NULL;
+    } else {
+        node->clock_prev->clock_next = node->clock_next;
+        node->clock_next->clock_prev = node->clock_prev;
+        if (shard->hand == node)
+            shard->hand = node->clock_next;
+    }
+
+    shard->used -= node->cost;
+    atomic_fetch_sub(&cache->entries, 1);
+    clock_node_release(cache, node);
+}
+
+/* CLOCK eviction: entries hit since the hand last passed get a second
+ * chance, the first one that was not is evicted
+ */
+static void evict(CLOCK_CACHE *cache, CLOCK_SHARD *shard) {
+    while (shard->used > cache->budget && shard->hand != NULL) {
+        CLOCK_NODE *victim = shard->hand;
+        if (atomic_exchange(&victim->referenced, 0)) {
+            shard->hand = victim->clock_next;
+            continue;
+        }
+        clock_cache_unlink(cache, shard, victim);
+        atomic_fetch_add(&cache->evictions, 1);
+    }
+}
+
+CLOCK_NODE *clock_cache_lookup(CLOCK_CACHE *cache, CLOCK_SHARD *shard,
+                               uint64_t hash, const char *path) {
+    CLOCK_NODE *node = *bucket_of(cache, shard, hash);
+    while (node != NULL &&
+           (node->hash != hash || strcmp(node->path, path) != 0))
+        node = node->next;
+    return node;
+}
+
+/* links a new entry in and takes the table's reference, the shard's write
+ * lock must be held
+ */
+void clock_cache_insert(CLOCK_CACHE *cache, CLOCK_SHARD *shard,
+                        CLOCK_NODE *node) {
+    CLOCK_NODE **bucket = bucket_of(cache, shard, node->hash);
+    node->next = *bucket;
+    *bucket = node;
+
+    /* new entries go right behind the hand, the furthest from it */
+    if (shard->hand == NULL) {
+        node->clock_prev = node->clock_next = node;
+        shard->hand = node;
+    } else {
+        node->clock_next = shard->hand;
+        node->clock_prev = shard->hand->clock_prev;
+        shard->hand->clock_prev->clock_next = node;
+        shard->hand->clock_prev = node;
+    }
+
+    atomic_fetch_add(&node->refs, 1);
+    shard->used += node->cost;
+    atomic_fetch_add(&cache->entries, 1);
+    atomic_fetch_add(&cache->inserts, 1);
+    evict(cache, shard);
+}
+
+/* returns a referenced entry for path, or NULL on a miss */
+CLOCK_NODE *clock_cache_get(CLOCK_CACHE *cache, CLOCK_SHARD *shard,
+                            uint64_t hash, const char *path) {
+    pthread_rwlock_rdlock(&shard->lock);
+    CLOCK_NODE *node = clock_cache_lookup(cache, shard, hash, path);
+    if (node != NULL)
+        clock_node_hit(node);
+    pthread_rwlock_unlock(&shard->lock);
+
+    atomic_fetch_add(node != NULL ? &cache->hits : &cache->misses, 1);
+    return node;
+}
+
+void clock_cache_invalidate(CLOCK_CACHE *cache, CLOCK_SHARD *shard,
+                            uint64_t hash, const char *path) {
+    pthread_rwlock_wrlock(&shard->lock);
+    atomic_fetch_add(&shard->generation, 1);
+    CLOCK_NODE *node = clock_cache_lookup(cache, shard, hash, path);
+    if (node != NULL) {
+        clock_cache_unlink(cache, shard, node);
+        atomic_fetch_add(&cache->invalidations, 1);
+    }
+    pthread_rwlock_unlock(&shard->lock);
+}
+
+/* drops every entry, used when a whole directory moved or inotify lost
+ * events
+ */
+void clock_cache_clear(CLOCK_CACHE *cache) {
+    for (int i = 0; cache->shards != NULL && i < cache->nshards; i++) {
+        CLOCK_SHARD *shard = &cache->shards[i];
+        pthread_rwlock_wrlock(&shard->lock);
+        atomic_fetch_add(&shard->generation, 1);
+        while (shard->hand != NULL) {
+            clock_cache_unlink(cache, shard, shard->hand);
+            atomic_fetch_add(&cache->invalidations, 1);
+        }
+        pthread_rwlock_unlock(&shard->lock);
+    }
+}
+
+size_t clock_cache_used(CLOCK_CACHE *cache) {
+    size_t used = 0;
+    for (int i = 0; cache->shards != NULL && i < cache->nshards; i++) {
+        pthread_rwlock_rdlock(&cache->shards[i].lock);
+        used += cache->shards[i].used;
+        pthread_rwlock_unlock(&cache->shards[i].lock);
+    }
+    return used;
+}
+
+int clock_cache_init(CLOCK_CACHE *cache, int nshards, int nbuckets,
+                     size_t budget, void (*destroy)(CLOCK_NODE *node)) {
+    cache->shards = calloc(nshards, sizeof(CLOCK_SHARD));
+    CLOCK_NODE **buckets = calloc((size_t)nshards * nbuckets,
+                                  sizeof(CLOCK_NODE *));
+    if (cache->shards == NULL || buckets == NULL) {
+        perror("cache shards");
+        free(cache->shards);
+        free(buckets);
+        cache->shards = NULL;
+        return -1;
+    }
+    for (int i = 0; i < nshards; i++) {
+        pthread_rwlock_init(&cache->shards[i].lock, NULL);
+        cache->shards[i].buckets = buckets + (size_t)i * nbuckets;
+        atomic_init(&cache->shards[i].generation, 0);
+    }
+    cache->nshards = nshards;
+    cache->nbuckets = nbuckets;
+    cache->budget = budget;
+    cache->destroy = destroy;
+    return 0;
+}
+
+/* exports the counters on /metrics, labels names the cache */
+void clock_cache_register_metrics(CLOCK_CACHE *cache, const char *labels) {
+    metrics_register("https_cache_hits_total", "counter",
+                     "Cache lookups that found an entry.", labels,
+                     metrics_read_atomic, &cache->hits);
+    metrics_register("https_cache_misses_total", "counter",
+                     "Cache lookups that found none.", labels,
+                     metrics_read_atomic, &cache->misses);
+    metrics_register("https_cache_evictions_total", "counter",
+                     "Entries evicted to stay within the budget.", labels,
+                     metrics_read_atomic, &cache->evictions);
+}
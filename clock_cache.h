@@ -0,0 +1,88 @@
+#ifndef CLOCK_CACHE_H
+#define CLOCK_CACHE_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* The part of a cache entry the table manages, the first member of every
+ * entry. Entries are reference counted: the table holds one reference and
+ * every reader holds one until it is done, so an entry can be evicted
+ * while it is still in use.
+ */
+typedef struct clock_node {
+    struct clock_node *next; // hash chain
+    struct clock_node *clock_prev;
+    struct clock_node *clock_next;
+    uint64_t hash;
+    atomic_int refs;
+    atomic_int referenced; // CLOCK bit, set on every hit
+    char *path;
+    size_t cost; // what the entry counts against its shard's budget
+} CLOCK_NODE;
+
+/* Every shard is an independent hash table with its own lock and CLOCK
+ * ring, so a hit only takes the read lock of the shard the key hashes to.
+ */
+typedef struct {
+    pthread_rwlock_t lock;
+    CLOCK_NODE **buckets;
+    CLOCK_NODE *hand; // CLOCK hand, NULL while the shard is empty
+    size_t used;      // cost of the entries
+    /* bumped by every invalidation, an entry built while one raced with
+     * it is not inserted because it may describe the old file
+     */
+    atomic_uint generation;
+} CLOCK_SHARD;
+
+/* A sharded table with CLOCK eviction, shared by the content, metadata
+ * and compressed variant caches. Each shard keeps its entries' cost under
+ * budget; what cost means (bytes, entries) is up to the cache.
+ */
+typedef struct {
+    CLOCK_SHARD *shards;
+    int nshards;
+    int nbuckets;
+    size_t budget;                     // per shard
+    void (*destroy)(CLOCK_NODE *node); // frees the entry node is part of
+    atomic_ulong hits, misses, inserts, evictions, invalidations;
+    atomic_long entries;
+} CLOCK_CACHE;
+
+int clock_cache_init(CLOCK_CACHE *cache, int nshards, int nbuckets,
+                     size_t budget, void (*destroy)(CLOCK_NODE *node));
+void clock_node_init(CLOCK_NODE *node, uint64_t hash, char *path,
+                     size_t cost);
+
+static inline CLOCK_SHARD *clock_shard_of(CLOCK_CACHE *cache,
+                                          uint64_t hash) {
+    return &cache->shards[hash % cache->nshards];
+}
+
+/* a reader's reference for an entry it found, which also marks it used */
+static inline void clock_node_hit(CLOCK_NODE *node) {
+    atomic_fetch_add(&node->refs, 1);
+    atomic_store(&node->referenced, 1);
+}
+
+void clock_node_release(CLOCK_CACHE *cache, CLOCK_NODE *node);
+
+/* with the shard's lock held */
+CLOCK_NODE *clock_cache_lookup(CLOCK_CACHE *cache, CLOCK_SHARD *shard,
+                               uint64_t hash, const char *path);
+/* with the shard's write lock held */
+void clock_cache_insert(CLOCK_CACHE *cache, CLOCK_SHARD *shard,
+                        CLOCK_NODE *node);
+void clock_cache_unlink(CLOCK_CACHE *cache, CLOCK_SHARD *shard,
+                        CLOCK_NODE *node);
+
+CLOCK_NODE *clock_cache_get(CLOCK_CACHE *cache, CLOCK_SHARD *shard,
+                            uint64_t hash, const char *path);
+void clock_cache_invalidate(CLOCK_CACHE *cache, CLOCK_SHARD *shard,
+                            uint64_t hash, const char *path);
+void clock_cache_clear(CLOCK_CACHE *cache);
+size_t clock_cache_used(CLOCK_CACHE *cache);
+void clock_cache_register_metrics(CLOCK_CACHE *cache, const char *labels);
+
+#endif
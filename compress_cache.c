@@ -0,0 +1,239 @@
+#include "compress_cache.h"
+#include "hash.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#define COMPRESS_BUCKETS 64
+
+/* what an entry counts against the budget, so that the markers for
+ * files that do not compress are bounded too
+ */
+#define entry_cost(entry) ((entry)->size + sizeof(COMPRESS_ENTRY))
+
+static atomic_int enabled = 0;
+static size_t max_file_size;
+
+static atomic_ulong compressions, incompressible;
+static atomic_ulong bytes_in, bytes_out;
+
+static void destroy(CLOCK_NODE *node) {
+    COMPRESS_ENTRY *entry = (COMPRESS_ENTRY *)node;
+    free(entry->data);
+    free(atomic_load(&entry->head));
+    free(node->path);
+    free(entry);
+}
+
+/* same layout as the content cache, bounded by the compressed bytes */
+static CLOCK_CACHE cache = {.destroy = destroy};
+
+static uint64_t hash_key(const char *path, enum encodings encoding) {
+    return fnv1a_byte(hash_path(path), encoding);
+}
+
+/* all encodings of a path share a shard, so invalidation visits one */
+static CLOCK_SHARD *shard_of(const char *path) {
+    return clock_shard_of(&cache, hash_path(path));
+}
+
+void compress_cache_release(COMPRESS_ENTRY *entry) {
+    clock_node_release(&cache, &entry->node);
+}
+
+/* Returns a referenced entry for the version of path described by source,
+ * or NULL on a miss. Entries made from another version never match, so
+ * the cache cannot serve a stale variant even without invalidation.
+ */
+COMPRESS_ENTRY *compress_cache_get(const char *path,
+                                   enum encodings encoding,
+                                   const VALIDATORS *source) {
+    if (!enabled)
+        return NULL;
+
+    uint64_t hash = hash_key(path, encoding);
+    CLOCK_SHARD *shard = shard_of(path);
+
+    pthread_rwlock_rdlock(&shard->lock);
+    COMPRESS_ENTRY *entry =
+        (COMPRESS_ENTRY *)clock_cache_lookup(&cache, shard, hash, path);
+    if (entry != NULL && strcmp(entry->source_etag, source->etag) != 0)
+        entry = NULL;
+    if (entry != NULL)
+        clock_node_hit(&entry->node);
+    pthread_rwlock_unlock(&shard->lock);
+
+    atomic_fetch_add(entry != NULL ? &cache.hits : &cache.misses, 1);
+    return entry;
+}
+
+/* gzip (windowBits 31) or zlib-wrapped deflate (15) into a new buffer */
+static char *compress_data(const char *data, size_t size,
+                           enum encodings encoding, size_t *out_size) {
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    int bits = encoding == ENC_GZIP ? 31 : 15;
+    if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, bits, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK)
+        return NULL;
+
+    size_t bound = deflateBound(&zs, size);
+    char *out = malloc(bound);
+    if (out == NULL) {
+        deflateEnd(&zs);
+        return NULL;
+    }
+
+    zs.next_in = (Bytef *)data;
+    zs.avail_in = size;
+    zs.next_out = (Bytef *)out;
+    zs.avail_out = bound;
+    int ret = deflate(&zs, Z_FINISH);
+    *out_size = zs.total_out;
+    deflateEnd(&zs);
+    if (ret != Z_STREAM_END) {
+        free(out);
+        return NULL;
+    }
+    return out;
+}
+
+/* the variant's tag is the source's with the encoding appended, known
+ * without compressing anything
+ */
+void compress_validators(VALIDATORS *variant, const VALIDATORS *source,
+                         enum encodings encoding) {
+    const char *suffix = encoding == ENC_GZIP ? "-gzip\"" : "-deflate\"";
+    size_t len = strlen(source->etag) - 1; // without the closing quote
+
+    *variant = *source;
+    if (len + strlen(suffix) < sizeof(variant->etag))
+        strcpy(variant->etag + len, suffix);
+}
+
+/* Compresses a file, from data when it is already in memory or read from
+ * fd otherwise, and inserts the result. Returns a referenced entry, or
+ * NULL when the cache is disabled, the file is larger than max_file or it
+ * could not be read.
+ */
+COMPRESS_ENTRY *compress_cache_load(const char *path,
+                                    enum encodings encoding,
+                                    const VALIDATORS *source,
+                                    const char *data, int fd, size_t size) {
+    if (!enabled || size > max_file_size)
+        return NULL;
+
+    char *buf = NULL;
+    if (data == NULL) {
+        if ((buf = malloc(size ? size : 1)) == NULL)
+            return NULL;
+        size_t done = 0;
+        while (done < size) {
+            ssize_t bytes = pread(fd, buf + done, size - done, done);
+            if (bytes <= 0) {
+                if (bytes < 0 && errno == EINTR)
+                    continue;
+                free(buf);
+                return NULL;
+            }
+            done += bytes;
+        }
+        data = buf;
+    }
+
+    COMPRESS_ENTRY *entry = calloc(1, sizeof(COMPRESS_ENTRY));
+    char *copy = entry != NULL ? strdup(path) : NULL;
+    if (copy == NULL) {
+        free(entry);
+        free(buf);
+        return NULL;
+    }
+    entry->encoding = encoding;
+    strcpy(entry->source_etag, source->etag);
+    compress_validators(&entry->validators, source, encoding);
+
+    entry->data = compress_data(data, size, encoding, &entry->size);
+    free(buf);
+    atomic_fetch_add(&compressions, 1);
+    if (entry->data != NULL && entry->size >= size) {
+        free(entry->data);
+        entry->data = NULL;
+    }
+    if (entry->data == NULL) {
+        entry->size = 0;
+        atomic_fetch_add(&incompressible, 1);
+    } else {
+        atomic_fetch_add(&bytes_in, size);
+        atomic_fetch_add(&bytes_out, entry->size);
+    }
+    clock_node_init(&entry->node, hash_key(path, encoding), copy,
+                    entry_cost(entry));
+    if (entry->node.cost > cache.budget)
+        return entry; // served once, not kept
+
+    CLOCK_SHARD *shard = shard_of(path);
+    pthread_rwlock_wrlock(&shard->lock);
+    CLOCK_NODE *old =
+        clock_cache_lookup(&cache, shard, entry->node.hash, path);
+    if (old != NULL)
+        clock_cache_unlink(&cache, shard, old); // made from an older version
+    clock_cache_insert(&cache, shard, &entry->node);
+    pthread_rwlock_unlock(&shard->lock);
+
+    return entry;
+}
+
+/* drops every encoding of path; a change to "x.gz" drops those of "x",
+ * which may now be served from the precompressed file
+ */
+void compress_cache_invalidate(const char *path) {
+    if (!enabled || path == NULL)
+        return;
+
+    char source[4096];
+    size_t len = strlen(path);
+    if (len > 3 && len < sizeof(source) &&
+        strcmp(path + len - 3, ".gz") == 0) {
+        memcpy(source, path, len - 3);
+        source[len - 3] = '\0';
+        compress_cache_invalidate(source);
+    }
+
+    CLOCK_SHARD *shard = shard_of(path);
+    for (int encoding = ENC_GZIP; encoding <= ENC_DEFLATE; encoding++)
+        clock_cache_invalidate(&cache, shard, hash_key(path, encoding), path);
+}
+
+void compress_cache_invalidate_all(void) { clock_cache_clear(&cache); }
+
+/* Sets up the cache with a byte budget for compressed data (0 disables
+ * compression on the fly). Larger files than max_file are sent as they
+ * are.
+ */
+int compress_cache_init(size_t budget, size_t max_file) {
+    if (budget == 0)
+        return 0;
+    if (clock_cache_init(&cache, COMPRESS_SHARDS, COMPRESS_BUCKETS,
+                         budget / COMPRESS_SHARDS, destroy) < 0)
+        return -1;
+
+    clock_cache_register_metrics(&cache, "cache=\"compress\"");
+    max_file_size = max_file;
+    enabled = 1;
+    return 0;
+}
+
+void compress_cache_stats(FILE *fp) {
+    fprintf(fp,
+            "compression: entries %ld, bytes %zu/%zu, hits %lu, misses %lu, "
+            "compressions %lu (%lu -> %lu bytes), incompressible %lu, "
+            "evictions %lu\n",
+            atomic_load(&cache.entries), clock_cache_used(&cache),
+            cache.budget * COMPRESS_SHARDS, atomic_load(&cache.hits),
+            atomic_load(&cache.misses), atomic_load(&compressions),
+            atomic_load(&bytes_in), atomic_load(&bytes_out),
+            atomic_load(&incompressible), atomic_load(&cache.evictions));
+}
@@ -0,0 +1,45 @@
+#ifndef COMPRESS_CACHE_H
+#define COMPRESS_CACHE_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#include "clock_cache.h"
+#include "header_block.h"
+#include "validators.h"
+
+#define COMPRESS_SHARDS 16
+
+enum encodings { ENC_IDENTITY, ENC_GZIP, ENC_DEFLATE };
+
+/* The gzip or deflate encoding of one version of a file. An entry whose
+ * data is NULL records that the file did not get smaller, so it is not
+ * compressed again. Reference counted like the content cache.
+ */
+typedef struct compress_entry {
+    CLOCK_NODE node; // keyed by path and encoding, cost is entry_cost()
+    enum encodings encoding;
+    char source_etag[sizeof(((VALIDATORS *)0)->etag)];
+    VALIDATORS validators; // of the encoded variant
+    size_t size;
+    char *data;
+    HEADER_BLOCK *_Atomic head; // NULL until the first GET sent it
+} COMPRESS_ENTRY;
+
+int compress_cache_init(size_t budget, size_t max_file);
+COMPRESS_ENTRY *compress_cache_get(const char *path,
+                                   enum encodings encoding,
+                                   const VALIDATORS *source);
+COMPRESS_ENTRY *compress_cache_load(const char *path,
+                                    enum encodings encoding,
+                                    const VALIDATORS *source,
+                                    const char *data, int fd, size_t size);
+void compress_cache_release(COMPRESS_ENTRY *entry);
+void compress_validators(VALIDATORS *variant, const VALIDATORS *source,
+                         enum encodings encoding);
+void compress_cache_invalidate(const char *path);
+void compress_cache_invalidate_all(void);
+void compress_cache_stats(FILE *fp);
+
+#endif
@@ -0,0 +1,281 @@
+#define _GNU_SOURCE
+
+#include "event_loop.h"
+#include "http2.h"
+#include "metrics.h"
+#include "tls_session.h"
+#include "uring_loop.h"
+
+#include <errno.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/* mark the listener and the queue's eventfd in epoll_event.data.ptr */
+static char listener_tag;
+static char wake_tag;
+
+/* Connections with a complete request that found every worker ring full,
+ * oldest first. They stay un-armed and the listener is paused, so new
+ * requests wait in the kernel, until a worker frees a slot.
+ */
+static __thread CONN *held, *held_tail;
+
+static int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0)
+        return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/* Client sockets are registered with EPOLLONESHOT, so exactly one thread
+ * owns a connection at any time: the event loop while it is handshaking or
+ * reading, a worker while the request is being served. The deadline of a
+ * connection is armed before it is handed back, never after.
+ */
+static void rearm(CONN *conn, int want) {
+    if (conn->io != NULL) {
+        uring_loop_wait(conn, want);
+        return;
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLONESHOT;
+    ev.events |= (want == SSL_ERROR_WANT_WRITE) ? EPOLLOUT : EPOLLIN;
+    ev.data.ptr = conn;
+
+    if (epoll_ctl(conn->epfd, EPOLL_CTL_MOD, conn->socket, &ev) < 0) {
+        perror("epoll_ctl");
+        cleanup_noexit(conn);
+    }
+}
+
+static void listen_for(SHARD *shard, int epfd, int events) {
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = &listener_tag;
+    if (epoll_ctl(epfd, EPOLL_CTL_MOD, shard->sock, &ev) < 0)
+        perror("epoll_ctl");
+}
+
+/* gives a connection to the workers, or holds it back while they are busy */
+static void hand_over(CONN *conn) {
+    conn->state = CONN_PROCESSING;
+    if (held == NULL && try_dispatch_connection(conn))
+        return;
+
+    if (held == NULL)
+        listen_for(conn->shard, conn->epfd, 0);
+    conn->held = NULL;
+    if (held_tail != NULL)
+        held_tail->held = conn;
+    else
+        held = conn;
+    held_tail = conn;
+}
+
+/* queues the held connections in order once the workers made room */
+static void release_held(void) {
+    while (held != NULL) {
+        CONN *conn = held;
+        SHARD *shard = conn->shard;
+        int epfd = conn->epfd;
+        CONN *next = conn->held;
+        if (!try_dispatch_connection(conn))
+            return;
+        held = next;
+        if (held == NULL) {
+            held_tail = NULL;
+            listen_for(shard, epfd, EPOLLIN);
+        }
+    }
+}
+
+/* advances a connection as far as it can go without blocking */
+static void drive(CONN *conn) {
+    int ret, want;
+
+    if (conn->state == CONN_HANDSHAKE) {
+        ret = SSL_accept(conn->ssl);
+        if (ret <= 0) {
+            want = SSL_get_error(conn->ssl, ret);
+            if (want == SSL_ERROR_WANT_READ || want == SSL_ERROR_WANT_WRITE) {
+                rearm(conn, want);
+                return;
+            }
+            ERR_print_errors_fp(stderr);
+            metrics_add(M_HANDSHAKE_FAILURES, 1);
+            cleanup_noexit(conn);
+            return;
+        }
+        metrics_observe(H_HANDSHAKE, metrics_now() - conn->accepted_at);
+        tls_session_handshake_done(conn->ssl);
+        conn->state = CONN_READING;
+        conn_deadline(conn, PHASE_IDLE);
+    }
+
+    /* HTTP/2 frames are read by the worker that serves the connection */
+    if (conn->h2 != NULL || http2_negotiated(conn->ssl)) {
+        hand_over(conn);
+        return;
+    }
+
+    ret = read_request(conn, &want);
+    if (ret == 0) {
+        rearm(conn, want);
+        return;
+    }
+    if (ret < 0) {
+        cleanup_noexit(conn);
+        return;
+    }
+
+    /* a complete request is buffered, let a worker serve it */
+    conn_deadline_cancel(conn);
+    hand_over(conn);
+}
+
+static void accept_clients(int epfd, SHARD *shard) {
+    while (1) {
+        struct sockaddr_storage addr;
+        socklen_t len = sizeof(addr);
+
+        int client = accept4(shard->sock, (struct sockaddr *)&addr, &len,
+                             SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                perror("Unable to accept");
+            return;
+        }
+
+        SSL *ssl = SSL_new(shard->ctx);
+        CONN *conn =
+            ssl != NULL
+                ? conn_new(shard, client, ssl, (struct sockaddr *)&addr, len)
+                : NULL;
+        if (conn == NULL) {
+            perror("connection");
+            SSL_free(ssl);
+            close(client);
+            continue;
+        }
+        SSL_set_fd(ssl, client);
+        atomic_fetch_add(&shard->accepted, 1);
+        metrics_add(M_ACCEPTS, 1);
+        conn->epfd = epfd;
+        conn_deadline(conn, PHASE_HANDSHAKE);
+
+        /* the handshake starts once the ClientHello arrives */
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLONESHOT;
+        ev.data.ptr = conn;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, client, &ev) < 0) {
+            perror("epoll_ctl");
+            cleanup_noexit(conn);
+        }
+    }
+}
+
+/* Called by a worker once it has answered a keep-alive request. Data that
+ * is already buffered inside OpenSSL does not trigger epoll, so try to read
+ * the next request right away. Returns 1 if a complete request is ready for
+ * the calling worker, otherwise the connection has been handed back to the
+ * event loop (or closed) and must not be touched anymore.
+ */
+int event_loop_resume(CONN *conn) {
+    int want;
+
+    conn->state = CONN_READING;
+
+    int ret = read_request(conn, &want);
+    if (ret == 0) {
+        rearm(conn, want);
+        return 0;
+    }
+    if (ret < 0) {
+        cleanup_noexit(conn);
+        return 0;
+    }
+
+    conn->state = CONN_PROCESSING;
+    return 1;
+}
+
+/* hands an HTTP/2 connection back once its worker ran out of frames */
+void event_loop_wait(CONN *conn, int want) {
+    conn->state = CONN_READING;
+    rearm(conn, want);
+}
+
+int event_loop_run(SHARD *shard) {
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0) {
+        perror("epoll_create1");
+        return -1;
+    }
+
+    if (set_nonblocking(shard->sock) < 0) {
+        perror("fcntl");
+        close(epfd);
+        return -1;
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = &listener_tag;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, shard->sock, &ev) < 0) {
+        perror("epoll_ctl");
+        close(epfd);
+        return -1;
+    }
+
+    /* workers write it when they take from a full queue */
+    int efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    ev.events = EPOLLIN;
+    ev.data.ptr = &wake_tag;
+    if (efd < 0 || epoll_ctl(epfd, EPOLL_CTL_ADD, efd, &ev) < 0) {
+        perror("eventfd");
+        if (efd >= 0)
+            close(efd);
+        close(epfd);
+        return -1;
+    }
+    shard->queue.wake_fd = efd;
+
+    struct epoll_event events[MAX_EVENTS];
+    while (1) {
+        int n = epoll_wait(epfd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == &listener_tag) {
+                accept_clients(epfd, shard);
+            } else if (events[i].data.ptr == &wake_tag) {
+                uint64_t count;
+                if (read(efd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+                    perror("eventfd");
+                release_held();
+            } else {
+                drive((CONN *)events[i].data.ptr);
+            }
+        }
+    }
+
+    shard->queue.wake_fd = -1;
+    close(efd);
+    close(epfd);
+    return -1;
+}
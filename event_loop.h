@@ -0,0 +1,12 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include "request_handler.h"
+
+#define MAX_EVENTS 64
+
+int event_loop_run(SHARD *shard);
+int event_loop_resume(CONN *conn);
+void event_loop_wait(CONN *conn, int want);
+
+#endif
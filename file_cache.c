@@ -0,0 +1,128 @@
+#include "file_cache.h"
+
+#include "fs_watch.h"
+#include "hash.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define CACHE_BUCKETS 256
+
+static atomic_int enabled = 0;
+static size_t max_file_size;
+
+static void destroy(CLOCK_NODE *node) {
+    CACHE_ENTRY *entry = (CACHE_ENTRY *)node;
+    free(entry->data);
+    free(atomic_load(&entry->head));
+    free(node->path);
+    free(entry);
+}
+
+static CLOCK_CACHE cache = {.destroy = destroy};
+
+void file_cache_release(CACHE_ENTRY *entry) {
+    clock_node_release(&cache, &entry->node);
+}
+
+/* returns a referenced entry for path, or NULL on a miss */
+CACHE_ENTRY *file_cache_get(const char *path) {
+    if (!enabled || path == NULL)
+        return NULL;
+
+    uint64_t hash = hash_path(path);
+    return (CACHE_ENTRY *)clock_cache_get(
+        &cache, clock_shard_of(&cache, hash), hash, path);
+}
+
+/* Reads an open file into a new entry and inserts it, returns a referenced
+ * entry or NULL when the file is not cacheable (too large, unusual path or
+ * a read error) and has to be served from disk.
+ */
+CACHE_ENTRY *file_cache_load(const char *path, int fd, size_t size,
+                             const VALIDATORS *validators) {
+    if (!enabled || size > max_file_size || size > cache.budget ||
+        !fs_watch_covers(path))
+        return NULL;
+
+    uint64_t hash = hash_path(path);
+    CLOCK_SHARD *shard = clock_shard_of(&cache, hash);
+    unsigned int generation = atomic_load(&shard->generation);
+
+    CACHE_ENTRY *entry = calloc(1, sizeof(CACHE_ENTRY));
+    if (entry == NULL)
+        return NULL;
+    clock_node_init(&entry->node, hash, strdup(path), size);
+    entry->size = size;
+    entry->validators = *validators;
+    entry->data = malloc(size ? size : 1);
+    if (entry->node.path == NULL || entry->data == NULL) {
+        file_cache_release(entry);
+        return NULL;
+    }
+
+    size_t done = 0;
+    while (done < size) {
+        ssize_t bytes = pread(fd, entry->data + done, size - done, done);
+        if (bytes <= 0) {
+            if (bytes < 0 && errno == EINTR)
+                continue;
+            file_cache_release(entry);
+            return NULL;
+        }
+        done += bytes;
+    }
+
+    pthread_rwlock_wrlock(&shard->lock);
+    if (atomic_load(&shard->generation) == generation &&
+        clock_cache_lookup(&cache, shard, hash, path) == NULL)
+        clock_cache_insert(&cache, shard, &entry->node);
+    pthread_rwlock_unlock(&shard->lock);
+
+    return entry;
+}
+
+void file_cache_invalidate(const char *path) {
+    if (!enabled || path == NULL)
+        return;
+
+    uint64_t hash = hash_path(path);
+    clock_cache_invalidate(&cache, clock_shard_of(&cache, hash), hash, path);
+}
+
+/* used when a whole directory moved or inotify lost events */
+void file_cache_invalidate_all(void) { clock_cache_clear(&cache); }
+
+/* without invalidation events the cache could serve stale files */
+void file_cache_disable(void) {
+    enabled = 0;
+    file_cache_invalidate_all();
+}
+
+/* Sets up the cache with a byte budget (0 disables it). Files larger than
+ * max_file are never cached and always streamed from disk.
+ */
+int file_cache_init(size_t budget, size_t max_file) {
+    if (budget == 0)
+        return 0;
+    if (clock_cache_init(&cache, CACHE_SHARDS, CACHE_BUCKETS,
+                         budget / CACHE_SHARDS, destroy) < 0)
+        return -1;
+
+    clock_cache_register_metrics(&cache, "cache=\"file\"");
+    max_file_size = max_file;
+    enabled = 1;
+    return 0;
+}
+
+void file_cache_stats(FILE *fp) {
+    fprintf(fp,
+            "cache: entries %ld, bytes %zu/%zu, hits %lu, misses %lu, "
+            "inserts %lu, evictions %lu, invalidations %lu\n",
+            atomic_load(&cache.entries), clock_cache_used(&cache),
+            cache.budget * CACHE_SHARDS, atomic_load(&cache.hits),
+            atomic_load(&cache.misses), atomic_load(&cache.inserts),
+            atomic_load(&cache.evictions), atomic_load(&cache.invalidations));
+}
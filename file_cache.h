@@ -0,0 +1,36 @@
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#include "clock_cache.h"
+#include "header_block.h"
+#include "validators.h"
+
+#define CACHE_SHARDS 64
+
+/* An immutable copy of a file's content. Readers hold a reference until
+ * they have sent the data, so an entry can be evicted while it is still
+ * being served.
+ */
+typedef struct cache_entry {
+    CLOCK_NODE node; // cost is the size
+    size_t size;
+    VALIDATORS validators; // of the version that was read
+    char *data;
+    HEADER_BLOCK *_Atomic head; // NULL until the first GET sent it
+} CACHE_ENTRY;
+
+int file_cache_init(size_t budget, size_t max_file);
+CACHE_ENTRY *file_cache_get(const char *path);
+CACHE_ENTRY *file_cache_load(const char *path, int fd, size_t size,
+                             const VALIDATORS *validators);
+void file_cache_release(CACHE_ENTRY *entry);
+void file_cache_invalidate(const char *path);
+void file_cache_invalidate_all(void);
+void file_cache_disable(void);
+void file_cache_stats(FILE *fp);
+
+#endif
@@ -0,0 +1,224 @@
+#include "fs_watch.h"
+#include "compress_cache.h"
+#include "file_cache.h"
+#include "meta_cache.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define WATCH_MASK                                                             \
+    (IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB | IN_CREATE | IN_DELETE |          \
+     IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+typedef struct {
+    int wd;
+    char *path;
+} WATCH;
+
+static const char *home_dir = "";
+
+/* directories watched by inotify, only touched by the watcher thread once
+ * it has been started
+ */
+static int inotify_fd = -1;
+static WATCH *watches = NULL;
+static int nwatches = 0;
+
+/* inotify reports paths as HOME/dir/name, so only paths spelled that way
+ * can be cached, anything with empty, . or .. segments is served from disk
+ */
+int fs_watch_covers(const char *path) {
+    size_t len = strlen(home_dir);
+    if (strncmp(path, home_dir, len) != 0 || path[len] != '/')
+        return 0;
+
+    for (const char *p = path + len; *p; p++) {
+        if (*p != '/')
+            continue;
+        if (p[1] == '/' || p[1] == '\0')
+            return 0;
+        if (p[1] == '.' && (p[2] == '/' || p[2] == '\0'))
+            return 0;
+        if (p[1] == '.' && p[2] == '.' && (p[3] == '/' || p[3] == '\0'))
+            return 0;
+    }
+    return 1;
+}
+
+/* drops everything the caches know about a path, called for inotify events
+ * and directly by the handlers that modify files
+ */
+void fs_invalidate(const char *path) {
+    file_cache_invalidate(path);
+    meta_cache_invalidate(path);
+    compress_cache_invalidate(path);
+}
+
+/* used when a whole directory moved or inotify lost events */
+void fs_invalidate_all(void) {
+    file_cache_invalidate_all();
+    meta_cache_invalidate_all();
+    compress_cache_invalidate_all();
+}
+
+static char *join_path(const char *dir, const char *name) {
+    char *path = malloc(strlen(dir) + 1 + strlen(name) + 1);
+    if (path != NULL)
+        sprintf(path, "%s/%s", dir, name);
+    return path;
+}
+
+static const char *watch_path(int wd) {
+    for (int i = 0; i < nwatches; i++)
+        if (watches[i].wd == wd)
+            return watches[i].path;
+    return NULL;
+}
+
+static void forget_watch(int wd) {
+    for (int i = 0; i < nwatches; i++) {
+        if (watches[i].wd == wd) {
+            free(watches[i].path);
+            watches[i] = watches[--nwatches];
+            return;
+        }
+    }
+}
+
+/* inotify is not recursive, so every directory below HOME gets a watch */
+static void watch_tree(const char *dir) {
+    int wd = inotify_add_watch(inotify_fd, dir, WATCH_MASK);
+    if (wd < 0) {
+        perror("inotify_add_watch");
+        return;
+    }
+
+    if (watch_path(wd) == NULL) {
+        WATCH *grown = realloc(watches, sizeof(WATCH) * (nwatches + 1));
+        char *copy = strdup(dir);
+        if (grown == NULL || copy == NULL) {
+            if (grown != NULL)
+                watches = grown;
+            free(copy);
+            return;
+        }
+        watches = grown;
+        watches[nwatches].wd = wd;
+        watches[nwatches].path = copy;
+        nwatches++;
+    }
+
+    DIR *dp = opendir(dir);
+    if (dp == NULL)
+        return;
+
+    struct dirent *de;
+    while ((de = readdir(dp)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+
+        char *path = join_path(dir, de->d_name);
+        if (path == NULL)
+            continue;
+
+        struct stat st;
+        if (de->d_type == DT_DIR ||
+            (de->d_type == DT_UNKNOWN && stat(path, &st) == 0 &&
+             S_ISDIR(st.st_mode)))
+            watch_tree(path);
+        free(path);
+    }
+    closedir(dp);
+}
+
+static void handle_event(const struct inotify_event *event) {
+    if (event->mask & IN_Q_OVERFLOW) {
+        fs_invalidate_all();
+        return;
+    }
+    if (event->mask & IN_IGNORED) {
+        forget_watch(event->wd);
+        return;
+    }
+    if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+        fs_invalidate_all();
+        return;
+    }
+
+    const char *dir = watch_path(event->wd);
+    if (dir == NULL || event->len == 0)
+        return;
+
+    char *path = join_path(dir, event->name);
+    if (path == NULL) {
+        fs_invalidate_all();
+        return;
+    }
+
+    if (event->mask & IN_ISDIR) {
+        if (event->mask & (IN_CREATE | IN_MOVED_TO))
+            watch_tree(path);
+        /* every file below a renamed directory changed its path */
+        if (event->mask & (IN_MOVED_FROM | IN_MOVED_TO))
+            fs_invalidate_all();
+    } else {
+        fs_invalidate(path);
+    }
+    free(path);
+}
+
+static void *watcher(void *arg) {
+    (void)arg;
+    char buffer[4096]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    while (1) {
+        ssize_t len = read(inotify_fd, buffer, sizeof(buffer));
+        if (len <= 0) {
+            if (len < 0 && errno == EINTR)
+                continue;
+            perror("inotify read");
+            break;
+        }
+
+        for (char *p = buffer; p < buffer + len;) {
+            const struct inotify_event *event = (struct inotify_event *)p;
+            handle_event(event);
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+
+    /* without invalidation events the caches could serve stale files */
+    file_cache_disable();
+    meta_cache_disable();
+    return NULL;
+}
+
+/* starts the inotify watcher on the home directory and everything below */
+int fs_watch_init(const char *home) {
+    home_dir = home;
+
+    inotify_fd = inotify_init1(IN_CLOEXEC);
+    if (inotify_fd < 0) {
+        perror("inotify_init1");
+        return -1;
+    }
+    watch_tree(home);
+
+    pthread_t tid;
+    int err;
+    if ((err = pthread_create(&tid, NULL, watcher, NULL))) {
+        fprintf(stderr, "pthread_create: %s\n", strerror(err));
+        return -1;
+    }
+    pthread_detach(tid);
+
+    return 0;
+}
@@ -0,0 +1,9 @@
+#ifndef FS_WATCH_H
+#define FS_WATCH_H
+
+int fs_watch_init(const char *home);
+int fs_watch_covers(const char *path);
+void fs_invalidate(const char *path);
+void fs_invalidate_all(void);
+
+#endif
@@ -0,0 +1,133 @@
+#include "group_commit.h"
+#include "metrics.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* a worker waiting for its file to reach the disk */
+typedef struct sync_request {
+    struct sync_request *next;
+    int fd;
+    dev_t dev;
+    ino_t ino;
+    int is_dir; // synced once per batch, however many uploads wait on it
+    int done;
+    int result;
+    unsigned long queued; // metrics_now() when the request was queued
+} SYNC_REQUEST;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pending_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+static SYNC_REQUEST *pending;
+
+/* batch sizes and latencies go to the H_COMMIT_* histograms */
+static atomic_ulong batches, requests, file_syncs, dir_syncs, failures;
+
+/* the result of syncing one descriptor of the batch */
+static int sync_one(SYNC_REQUEST *req) {
+    int ret = req->is_dir ? fsync(req->fd) : fdatasync(req->fd);
+    atomic_fetch_add(req->is_dir ? &dir_syncs : &file_syncs, 1);
+    if (ret < 0) {
+        perror(req->is_dir ? "fsync" : "fdatasync");
+        atomic_fetch_add(&failures, 1);
+    }
+    return ret;
+}
+
+/* Takes every request queued since the last round and syncs their
+ * descriptors: the data of every file, then every directory once however
+ * many uploads renamed into it. Requests that arrive meanwhile queue up
+ * for the next round.
+ */
+static void *flusher(void *arg) {
+    (void)arg;
+    while (1) {
+        pthread_mutex_lock(&lock);
+        while (pending == NULL)
+            pthread_cond_wait(&pending_cond, &lock);
+        SYNC_REQUEST *batch = pending;
+        pending = NULL;
+        pthread_mutex_unlock(&lock);
+
+        unsigned long size = 0;
+        for (SYNC_REQUEST *req = batch; req != NULL; req = req->next) {
+            size++;
+            if (!req->is_dir)
+                req->result = sync_one(req);
+        }
+        for (SYNC_REQUEST *req = batch; req != NULL; req = req->next) {
+            if (!req->is_dir)
+                continue;
+            SYNC_REQUEST *first = batch;
+            while (first != req &&
+                   !(first->is_dir && first->dev == req->dev &&
+                     first->ino == req->ino))
+                first = first->next;
+            req->result = first == req ? sync_one(req) : first->result;
+        }
+        atomic_fetch_add(&batches, 1);
+        metrics_observe(H_COMMIT_BATCH, size);
+
+        unsigned long now = metrics_now();
+        pthread_mutex_lock(&lock);
+        for (SYNC_REQUEST *req = batch; req != NULL; req = req->next) {
+            metrics_observe(H_COMMIT_LATENCY, now - req->queued);
+            req->done = 1;
+        }
+        pthread_cond_broadcast(&done_cond);
+        pthread_mutex_unlock(&lock);
+    }
+    return NULL;
+}
+
+/* Blocks until everything written through fd so far is on disk: the data
+ * of a file, the entries of a directory. Uploads waiting at the same time
+ * share the round and the sync of a common directory.
+ */
+int group_commit_sync(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+        return -1;
+
+    SYNC_REQUEST req = {.fd = fd,
+                        .dev = st.st_dev,
+                        .ino = st.st_ino,
+                        .is_dir = S_ISDIR(st.st_mode)};
+    req.queued = metrics_now();
+    atomic_fetch_add(&requests, 1);
+
+    pthread_mutex_lock(&lock);
+    req.next = pending;
+    pending = &req;
+    pthread_cond_signal(&pending_cond);
+    while (!req.done)
+        pthread_cond_wait(&done_cond, &lock);
+    pthread_mutex_unlock(&lock);
+
+    return req.result;
+}
+
+int group_commit_init(void) {
+    pthread_t tid;
+    int err;
+    if ((err = pthread_create(&tid, NULL, flusher, NULL))) {
+        fprintf(stderr, "pthread_create: %s\n", strerror(err));
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
+
+void group_commit_stats(FILE *fp) {
+    fprintf(fp,
+            "group commit: requests %lu, batches %lu, fdatasync %lu, "
+            "directory fsync %lu, failures %lu\n",
+            atomic_load(&requests), atomic_load(&batches),
+            atomic_load(&file_syncs), atomic_load(&dir_syncs),
+            atomic_load(&failures));
+}
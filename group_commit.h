@@ -0,0 +1,10 @@
+#ifndef GROUP_COMMIT_H
+#define GROUP_COMMIT_H
+
+#include <stdio.h>
+
+int group_commit_init(void);
+int group_commit_sync(int fd);
+void group_commit_stats(FILE *fp);
+
+#endif
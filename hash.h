@@ -0,0 +1,23 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stdint.h>
+
+/* 64-bit FNV-1a, what the caches, the path locks and the MIME table hash
+ * their keys with
+ */
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+static inline uint64_t fnv1a_byte(uint64_t hash, unsigned char c) {
+    return (hash ^ c) * FNV_PRIME;
+}
+
+static inline uint64_t hash_path(const char *path) {
+    uint64_t hash = FNV_OFFSET;
+    while (*path)
+        hash = fnv1a_byte(hash, *path++);
+    return hash;
+}
+
+#endif
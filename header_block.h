@@ -0,0 +1,21 @@
+#ifndef HEADER_BLOCK_H
+#define HEADER_BLOCK_H
+
+#include <stddef.h>
+
+/* The status line and header lines of a 200 for the whole of one cached
+ * file version, everything but the Connection line and the blank line
+ * that ends the block. Built by the first GET that sends the entry and
+ * then shared read-only, freed with the entry. type, encoding and vary
+ * are what it was built for, a response that differs in one of them
+ * formats its headers itself.
+ */
+typedef struct {
+    const char *type;
+    const char *encoding; // NULL for identity
+    int vary;
+    size_t len;
+    char data[];
+} HEADER_BLOCK;
+
+#endif
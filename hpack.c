@@ -0,0 +1,465 @@
+#include "hpack.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#define STATIC_ENTRIES 61
+#define HUFFMAN_EOS 256
+#define HUFFMAN_MAX_LEN 30
+#define MAX_INTEGER (1 << 28) // no length or index gets anywhere near
+
+/* RFC 7541 Appendix A */
+static const struct {
+    const char *name;
+    const char *value;
+} static_table[STATIC_ENTRIES] = {
+    {":authority", ""}, {":method", "GET"}, {":method", "POST"}, {":path", "/"},
+    {":path", "/index.html"}, {":scheme", "http"}, {":scheme", "https"},
+    {":status", "200"}, {":status", "204"}, {":status", "206"},
+    {":status", "304"}, {":status", "400"}, {":status", "404"},
+    {":status", "500"}, {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"}, {"accept-language", ""},
+    {"accept-ranges", ""}, {"accept", ""}, {"access-control-allow-origin", ""},
+    {"age", ""}, {"allow", ""}, {"authorization", ""}, {"cache-control", ""},
+    {"content-disposition", ""}, {"content-encoding", ""},
+    {"content-language", ""}, {"content-length", ""}, {"content-location", ""},
+    {"content-range", ""}, {"content-type", ""}, {"cookie", ""}, {"date", ""},
+    {"etag", ""}, {"expect", ""}, {"expires", ""}, {"from", ""}, {"host", ""},
+    {"if-match", ""}, {"if-modified-since", ""}, {"if-none-match", ""},
+    {"if-range", ""}, {"if-unmodified-since", ""}, {"last-modified", ""},
+    {"link", ""}, {"location", ""}, {"max-forwards", ""},
+    {"proxy-authenticate", ""}, {"proxy-authorization", ""}, {"range", ""},
+    {"referer", ""}, {"refresh", ""}, {"retry-after", ""}, {"server", ""},
+    {"set-cookie", ""}, {"strict-transport-security", ""},
+    {"transfer-encoding", ""}, {"user-agent", ""}, {"vary", ""}, {"via", ""},
+    {"www-authenticate", ""},
+};
+
+/* RFC 7541 Appendix B: code and length in bits of every octet, then EOS */
+static const struct {
+    uint32_t code;
+    uint8_t len;
+} huffman[HUFFMAN_EOS + 1] = {
+    {0x1ff8, 13}, {0x7fffd8, 23}, {0xfffffe2, 28}, {0xfffffe3, 28},
+    {0xfffffe4, 28}, {0xfffffe5, 28}, {0xfffffe6, 28}, {0xfffffe7, 28},
+    {0xfffffe8, 28}, {0xffffea, 24}, {0x3ffffffc, 30}, {0xfffffe9, 28},
+    {0xfffffea, 28}, {0x3ffffffd, 30}, {0xfffffeb, 28}, {0xfffffec, 28},
+    {0xfffffed, 28}, {0xfffffee, 28}, {0xfffffef, 28}, {0xffffff0, 28},
+    {0xffffff1, 28}, {0xffffff2, 28}, {0x3ffffffe, 30}, {0xffffff3, 28},
+    {0xffffff4, 28}, {0xffffff5, 28}, {0xffffff6, 28}, {0xffffff7, 28},
+    {0xffffff8, 28}, {0xffffff9, 28}, {0xffffffa, 28}, {0xffffffb, 28},
+    {0x14, 6}, {0x3f8, 10}, {0x3f9, 10}, {0xffa, 12}, {0x1ff9, 13}, {0x15, 6},
+    {0xf8, 8}, {0x7fa, 11}, {0x3fa, 10}, {0x3fb, 10}, {0xf9, 8}, {0x7fb, 11},
+    {0xfa, 8}, {0x16, 6}, {0x17, 6}, {0x18, 6}, {0x0, 5}, {0x1, 5}, {0x2, 5},
+    {0x19, 6}, {0x1a, 6}, {0x1b, 6}, {0x1c, 6}, {0x1d, 6}, {0x1e, 6}, {0x1f, 6},
+    {0x5c, 7}, {0xfb, 8}, {0x7ffc, 15}, {0x20, 6}, {0xffb, 12}, {0x3fc, 10},
+    {0x1ffa, 13}, {0x21, 6}, {0x5d, 7}, {0x5e, 7}, {0x5f, 7}, {0x60, 7},
+    {0x61, 7}, {0x62, 7}, {0x63, 7}, {0x64, 7}, {0x65, 7}, {0x66, 7}, {0x67, 7},
+    {0x68, 7}, {0x69, 7}, {0x6a, 7}, {0x6b, 7}, {0x6c, 7}, {0x6d, 7}, {0x6e, 7},
+    {0x6f, 7}, {0x70, 7}, {0x71, 7}, {0x72, 7}, {0xfc, 8}, {0x73, 7}, {0xfd, 8},
+    {0x1ffb, 13}, {0x7fff0, 19}, {0x1ffc, 13}, {0x3ffc, 14}, {0x22, 6},
+    {0x7ffd, 15}, {0x3, 5}, {0x23, 6}, {0x4, 5}, {0x24, 6}, {0x5, 5}, {0x25, 6},
+    {0x26, 6}, {0x27, 6}, {0x6, 5}, {0x74, 7}, {0x75, 7}, {0x28, 6}, {0x29, 6},
+    {0x2a, 6}, {0x7, 5}, {0x2b, 6}, {0x76, 7}, {0x2c, 6}, {0x8, 5}, {0x9, 5},
+    {0x2d, 6}, {0x77, 7}, {0x78, 7}, {0x79, 7}, {0x7a, 7}, {0x7b, 7},
+    {0x7ffe, 15}, {0x7fc, 11}, {0x3ffd, 14}, {0x1ffd, 13}, {0xffffffc, 28},
+    {0xfffe6, 20}, {0x3fffd2, 22}, {0xfffe7, 20}, {0xfffe8, 20}, {0x3fffd3, 22},
+    {0x3fffd4, 22}, {0x3fffd5, 22}, {0x7fffd9, 23}, {0x3fffd6, 22},
+    {0x7fffda, 23}, {0x7fffdb, 23}, {0x7fffdc, 23}, {0x7fffdd, 23},
+    {0x7fffde, 23}, {0xffffeb, 24}, {0x7fffdf, 23}, {0xffffec, 24},
+    {0xffffed, 24}, {0x3fffd7, 22}, {0x7fffe0, 23}, {0xffffee, 24},
+    {0x7fffe1, 23}, {0x7fffe2, 23}, {0x7fffe3, 23}, {0x7fffe4, 23},
+    {0x1fffdc, 21}, {0x3fffd8, 22}, {0x7fffe5, 23}, {0x3fffd9, 22},
+    {0x7fffe6, 23}, {0x7fffe7, 23}, {0xffffef, 24}, {0x3fffda, 22},
+    {0x1fffdd, 21}, {0xfffe9, 20}, {0x3fffdb, 22}, {0x3fffdc, 22},
+    {0x7fffe8, 23}, {0x7fffe9, 23}, {0x1fffde, 21}, {0x7fffea, 23},
+    {0x3fffdd, 22}, {0x3fffde, 22}, {0xfffff0, 24}, {0x1fffdf, 21},
+    {0x3fffdf, 22}, {0x7fffeb, 23}, {0x7fffec, 23}, {0x1fffe0, 21},
+    {0x1fffe1, 21}, {0x3fffe0, 22}, {0x1fffe2, 21}, {0x7fffed, 23},
+    {0x3fffe1, 22}, {0x7fffee, 23}, {0x7fffef, 23}, {0xfffea, 20},
+    {0x3fffe2, 22}, {0x3fffe3, 22}, {0x3fffe4, 22}, {0x7ffff0, 23},
+    {0x3fffe5, 22}, {0x3fffe6, 22}, {0x7ffff1, 23}, {0x3ffffe0, 26},
+    {0x3ffffe1, 26}, {0xfffeb, 20}, {0x7fff1, 19}, {0x3fffe7, 22},
+    {0x7ffff2, 23}, {0x3fffe8, 22}, {0x1ffffec, 25}, {0x3ffffe2, 26},
+    {0x3ffffe3, 26}, {0x3ffffe4, 26}, {0x7ffffde, 27}, {0x7ffffdf, 27},
+    {0x3ffffe5, 26}, {0xfffff1, 24}, {0x1ffffed, 25}, {0x7fff2, 19},
+    {0x1fffe3, 21}, {0x3ffffe6, 26}, {0x7ffffe0, 27}, {0x7ffffe1, 27},
+    {0x3ffffe7, 26}, {0x7ffffe2, 27}, {0xfffff2, 24}, {0x1fffe4, 21},
+    {0x1fffe5, 21}, {0x3ffffe8, 26}, {0x3ffffe9, 26}, {0xffffffd, 28},
+    {0x7ffffe3, 27}, {0x7ffffe4, 27}, {0x7ffffe5, 27}, {0xfffec, 20},
+    {0xfffff3, 24}, {0xfffed, 20}, {0x1fffe6, 21}, {0x3fffe9, 22},
+    {0x1fffe7, 21}, {0x1fffe8, 21}, {0x7ffff3, 23}, {0x3fffea, 22},
+    {0x3fffeb, 22}, {0x1ffffee, 25}, {0x1ffffef, 25}, {0xfffff4, 24},
+    {0xfffff5, 24}, {0x3ffffea, 26}, {0x7ffff4, 23}, {0x3ffffeb, 26},
+    {0x7ffffe6, 27}, {0x3ffffec, 26}, {0x3ffffed, 26}, {0x7ffffe7, 27},
+    {0x7ffffe8, 27}, {0x7ffffe9, 27}, {0x7ffffea, 27}, {0x7ffffeb, 27},
+    {0xffffffe, 28}, {0x7ffffec, 27}, {0x7ffffed, 27}, {0x7ffffee, 27},
+    {0x7ffffef, 27}, {0x7fffff0, 27}, {0x3ffffee, 26}, {0x3fffffff, 30},
+};
+
+/* The code is canonical: the codes of one length are consecutive and in
+ * symbol order. Decoding only needs the first code of every length and the
+ * symbols sorted by length, set up once by hpack_init().
+ */
+static uint32_t first_code[HUFFMAN_MAX_LEN + 1];
+static int first_symbol[HUFFMAN_MAX_LEN + 1];
+static int code_count[HUFFMAN_MAX_LEN + 1];
+static uint16_t symbols[HUFFMAN_EOS + 1];
+
+void hpack_init(void) {
+    int n = 0;
+    for (int len = 1; len <= HUFFMAN_MAX_LEN; len++) {
+        first_symbol[len] = n;
+        code_count[len] = 0;
+        for (int sym = 0; sym <= HUFFMAN_EOS; sym++) {
+            if (huffman[sym].len != len)
+                continue;
+            if (code_count[len]++ == 0)
+                first_code[len] = huffman[sym].code;
+            symbols[n++] = sym;
+        }
+    }
+}
+
+static int huffman_decode(const unsigned char *in, size_t len, char *out,
+                          size_t out_size) {
+    uint32_t code = 0;
+    int bits = 0;
+    size_t n = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        for (int b = 7; b >= 0; b--) {
+            code = code << 1 | ((in[i] >> b) & 1);
+            if (++bits > HUFFMAN_MAX_LEN)
+                return -1;
+            uint32_t k = code - first_code[bits];
+            if (code_count[bits] == 0 || code < first_code[bits] ||
+                k >= (uint32_t)code_count[bits])
+                continue;
+
+            int sym = symbols[first_symbol[bits] + k];
+            if (sym == HUFFMAN_EOS || n == out_size)
+                return -1;
+            out[n++] = sym;
+            code = 0;
+            bits = 0;
+        }
+    }
+    /* padding is the most significant bits of EOS, all ones */
+    if (bits > 7 || code != (1u << bits) - 1)
+        return -1;
+    return n;
+}
+
+static size_t huffman_length(const char *str, size_t len) {
+    size_t bits = 0;
+    for (size_t i = 0; i < len; i++)
+        bits += huffman[(unsigned char)str[i]].len;
+    return (bits + 7) / 8;
+}
+
+static void huffman_encode(STRBUF *out, const char *str, size_t len) {
+    unsigned char buf[64];
+    size_t n = 0;
+    uint64_t acc = 0;
+    int bits = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = str[i];
+        acc = acc << huffman[c].len | huffman[c].code;
+        bits += huffman[c].len;
+        while (bits >= 8) {
+            bits -= 8;
+            buf[n++] = acc >> bits;
+            if (n == sizeof(buf)) {
+                strbuf_append(out, (char *)buf, n);
+                n = 0;
+            }
+        }
+    }
+    if (bits > 0)
+        buf[n++] = (acc << (8 - bits)) | (0xff >> bits);
+    strbuf_append(out, (char *)buf, n);
+}
+
+/* an integer with an N-bit prefix, first holds the bits above the prefix */
+static void put_integer(STRBUF *out, unsigned char first, int prefix,
+                        size_t value) {
+    unsigned char buf[8];
+    size_t max = (1u << prefix) - 1;
+    int n = 0;
+
+    if (value < max) {
+        buf[n++] = first | value;
+    } else {
+        buf[n++] = first | max;
+        for (value -= max; value >= 128; value >>= 7)
+            buf[n++] = (value & 0x7f) | 0x80;
+        buf[n++] = value;
+    }
+    strbuf_append(out, (char *)buf, n);
+}
+
+static int get_integer(const unsigned char **p, const unsigned char *end,
+                       int prefix, size_t *value) {
+    if (*p == end)
+        return -1;
+    size_t max = (1u << prefix) - 1;
+    size_t v = *(*p)++ & max;
+    if (v < max) {
+        *value = v;
+        return 0;
+    }
+    for (int shift = 0; *p < end; shift += 7) {
+        unsigned char b = *(*p)++;
+        v += (size_t)(b & 0x7f) << shift;
+        if (v >= MAX_INTEGER)
+            return -1;
+        if (!(b & 0x80)) {
+            *value = v;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* a string literal, Huffman coded when that is shorter */
+static void put_string(STRBUF *out, const char *str, size_t len) {
+    size_t coded = huffman_length(str, len);
+    if (coded < len) {
+        put_integer(out, 0x80, 7, coded);
+        huffman_encode(out, str, len);
+    } else {
+        put_integer(out, 0, 7, len);
+        strbuf_append(out, str, len);
+    }
+}
+
+/* Points *str at a string literal: into the block when it is sent as is,
+ * into scratch when it had to be Huffman decoded.
+ */
+static int get_string(const unsigned char **p, const unsigned char *end,
+                      char **scratch, char *scratch_end, const char **str,
+                      int *len) {
+    if (*p == end)
+        return -1;
+    int coded = **p & 0x80;
+    size_t n;
+    if (get_integer(p, end, 7, &n) < 0 || n > (size_t)(end - *p))
+        return -1;
+
+    if (!coded) {
+        *str = (const char *)*p;
+        *len = n;
+    } else {
+        int decoded = huffman_decode(*p, n, *scratch, scratch_end - *scratch);
+        if (decoded < 0)
+            return -1;
+        *str = *scratch;
+        *len = decoded;
+        *scratch += decoded;
+    }
+    *p += n;
+    return 0;
+}
+
+void hpack_table_init(HPACK_TABLE *table) {
+    table->count = 0;
+    table->used = 0;
+    table->size = 0;
+    table->max_size = HPACK_TABLE_SIZE;
+    table->size_update = 0;
+}
+
+static void evict_oldest(HPACK_TABLE *table) {
+    int n = table->entries[0].name_len + table->entries[0].value_len;
+    memmove(table->data, table->data + n, table->used - n);
+    memmove(table->entries, table->entries + 1,
+            (table->count - 1) * sizeof(table->entries[0]));
+    table->count--;
+    table->used -= n;
+    table->size -= n + HPACK_ENTRY_OVERHEAD;
+    for (int i = 0; i < table->count; i++)
+        table->entries[i].off -= n;
+}
+
+static void shrink(HPACK_TABLE *table, size_t max_size) {
+    while (table->count > 0 && table->size > max_size)
+        evict_oldest(table);
+}
+
+/* an entry larger than the whole table just empties it */
+static void add_entry(HPACK_TABLE *table, const char *name, int name_len,
+                      const char *value, int value_len) {
+    size_t size = name_len + value_len + HPACK_ENTRY_OVERHEAD;
+    shrink(table, size <= table->max_size ? table->max_size - size : 0);
+    if (size > table->max_size)
+        return;
+
+    char *p = table->data + table->used;
+    memcpy(p, name, name_len);
+    memcpy(p + name_len, value, value_len);
+    table->entries[table->count].off = table->used;
+    table->entries[table->count].name_len = name_len;
+    table->entries[table->count].value_len = value_len;
+    table->count++;
+    table->used += name_len + value_len;
+    table->size += size;
+}
+
+/* looks up an index of the combined address space, static entries first */
+static int get_entry(const HPACK_TABLE *table, size_t index,
+                     const char **name, int *name_len, const char **value,
+                     int *value_len) {
+    if (index == 0)
+        return -1;
+    if (index <= STATIC_ENTRIES) {
+        *name = static_table[index - 1].name;
+        *name_len = strlen(*name);
+        *value = static_table[index - 1].value;
+        *value_len = strlen(*value);
+        return 0;
+    }
+    index -= STATIC_ENTRIES + 1;
+    if (index >= (size_t)table->count)
+        return -1;
+    int i = table->count - 1 - index; // the newest entry comes first
+    *name = table->data + table->entries[i].off;
+    *name_len = table->entries[i].name_len;
+    *value = *name + *name_len;
+    *value_len = table->entries[i].value_len;
+    return 0;
+}
+
+/* Decodes a complete header block and calls emit for every field in
+ * order. Returns -1 on a COMPRESSION_ERROR, after which the table is out
+ * of sync with the peer and the connection has to go.
+ */
+int hpack_decode(HPACK_TABLE *table, const unsigned char *in, size_t len,
+                 char *scratch, size_t scratch_size, HPACK_EMIT emit,
+                 void *ctx) {
+    const unsigned char *p = in, *end = in + len;
+    char *scratch_end = scratch + scratch_size;
+    int fields = 0;
+
+    while (p < end) {
+        const char *name, *value;
+        int name_len, value_len;
+        char *spare = scratch; // strings of the previous field are done
+        size_t index;
+
+        if (*p & 0x80) { // indexed field
+            if (get_integer(&p, end, 7, &index) < 0 ||
+                get_entry(table, index, &name, &name_len, &value,
+                          &value_len) < 0)
+                return -1;
+            emit(ctx, name, name_len, value, value_len);
+            fields++;
+            continue;
+        }
+        if ((*p & 0xe0) == 0x20) { // dynamic table size update
+            if (fields > 0 || get_integer(&p, end, 5, &index) < 0 ||
+                index > HPACK_TABLE_SIZE)
+                return -1;
+            table->max_size = index;
+            shrink(table, index);
+            continue;
+        }
+
+        /* literal, with incremental indexing or without */
+        int indexing = (*p & 0xc0) == 0x40;
+        if (get_integer(&p, end, indexing ? 6 : 4, &index) < 0)
+            return -1;
+        if (index == 0) {
+            if (get_string(&p, end, &spare, scratch_end, &name, &name_len) < 0)
+                return -1;
+        } else {
+            if (get_entry(table, index, &name, &name_len, &value,
+                          &value_len) < 0)
+                return -1;
+            /* adding the field may evict the entry its name came from */
+            if (indexing && index > STATIC_ENTRIES) {
+                if (name_len > scratch_end - spare)
+                    return -1;
+                memcpy(spare, name, name_len);
+                name = spare;
+                spare += name_len;
+            }
+        }
+        if (get_string(&p, end, &spare, scratch_end, &value, &value_len) < 0)
+            return -1;
+
+        if (indexing)
+            add_entry(table, name, name_len, value, value_len);
+        emit(ctx, name, name_len, value, value_len);
+        fields++;
+    }
+    return 0;
+}
+
+/* the peer's SETTINGS_HEADER_TABLE_SIZE, announced in the next block */
+void hpack_set_max_size(HPACK_TABLE *table, size_t max_size) {
+    if (max_size > HPACK_TABLE_SIZE)
+        max_size = HPACK_TABLE_SIZE;
+    if (max_size == table->max_size)
+        return;
+    table->max_size = max_size;
+    shrink(table, max_size);
+    table->size_update = 1;
+}
+
+/* starts a header block */
+void hpack_begin(HPACK_TABLE *table, STRBUF *out) {
+    if (table->size_update) {
+        put_integer(out, 0x20, 5, table->max_size);
+        table->size_update = 0;
+    }
+}
+
+/* Appends a field to a header block: as an index when the table has it
+ * already, otherwise as a literal that is added to the dynamic table when
+ * index is set. Fields that change with every response are better not
+ * indexed, they would only push the others out.
+ */
+void hpack_encode(HPACK_TABLE *table, STRBUF *out, const char *name,
+                  size_t name_len, const char *value, size_t value_len,
+                  int index) {
+    size_t name_index = 0;
+
+    for (int i = 0; i < STATIC_ENTRIES; i++) {
+        if (strlen(static_table[i].name) != name_len ||
+            memcmp(static_table[i].name, name, name_len) != 0)
+            continue;
+        if (strlen(static_table[i].value) == value_len &&
+            memcmp(static_table[i].value, value, value_len) == 0) {
+            put_integer(out, 0x80, 7, i + 1);
+            return;
+        }
+        if (name_index == 0)
+            name_index = i + 1;
+    }
+    for (int i = table->count - 1; i >= 0; i--) {
+        const char *entry = table->data + table->entries[i].off;
+        if ((size_t)table->entries[i].name_len != name_len ||
+            memcmp(entry, name, name_len) != 0)
+            continue;
+        size_t dynamic = STATIC_ENTRIES + table->count - i;
+        if ((size_t)table->entries[i].value_len == value_len &&
+            memcmp(entry + name_len, value, value_len) == 0) {
+            put_integer(out, 0x80, 7, dynamic);
+            return;
+        }
+        if (name_index == 0)
+            name_index = dynamic;
+    }
+
+    if (index)
+        put_integer(out, 0x40, 6, name_index);
+    else
+        put_integer(out, 0, 4, name_index);
+    if (name_index == 0)
+        put_string(out, name, name_len);
+    put_string(out, value, value_len);
+    if (index)
+        add_entry(table, name, name_len, value, value_len);
+}
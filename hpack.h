@@ -0,0 +1,46 @@
+#ifndef HPACK_H
+#define HPACK_H
+
+#include <stddef.h>
+
+#include "arena.h"
+
+#define HPACK_TABLE_SIZE 4096 // SETTINGS_HEADER_TABLE_SIZE, the default
+#define HPACK_ENTRY_OVERHEAD 32
+
+/* The dynamic table of one direction of a connection (RFC 7541 2.3.2).
+ * Names and values are stored back to back, oldest first, so evicting
+ * moves the rest down; at 4KB that is cheaper than managing a ring.
+ */
+typedef struct {
+    char data[HPACK_TABLE_SIZE];
+    struct {
+        int off;
+        int name_len;
+        int value_len;
+    } entries[HPACK_TABLE_SIZE / HPACK_ENTRY_OVERHEAD];
+    int count;
+    int used;        // bytes of data in use
+    size_t size;     // name + value + 32 for every entry
+    size_t max_size;
+    int size_update; // the encoder has to announce a new max_size
+} HPACK_TABLE;
+
+/* called for every decoded field, name and value are only valid until it
+ * returns and are not NUL terminated
+ */
+typedef void (*HPACK_EMIT)(void *ctx, const char *name, int name_len,
+                           const char *value, int value_len);
+
+void hpack_init(void);
+void hpack_table_init(HPACK_TABLE *table);
+int hpack_decode(HPACK_TABLE *table, const unsigned char *in, size_t len,
+                 char *scratch, size_t scratch_size, HPACK_EMIT emit,
+                 void *ctx);
+void hpack_set_max_size(HPACK_TABLE *table, size_t max_size);
+void hpack_begin(HPACK_TABLE *table, STRBUF *out);
+void hpack_encode(HPACK_TABLE *table, STRBUF *out, const char *name,
+                  size_t name_len, const char *value, size_t value_len,
+                  int index);
+
+#endif
@@ -0,0 +1,1223 @@
+#include "http2.h"
+#include "access_log.h"
+#include "event_loop.h"
+#include "hpack.h"
+#include "metrics.h"
+#include "request_impls.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define PREFACE_LEN (sizeof(PREFACE) - 1)
+#define FRAME_HEADER 9
+#define MAX_FRAME 16384 // SETTINGS_MAX_FRAME_SIZE, both ways
+#define DEFAULT_WINDOW 65535
+#define MAX_WINDOW 0x7fffffffL
+
+enum frame_types {
+    FRAME_DATA = 0,
+    FRAME_HEADERS = 1,
+    FRAME_PRIORITY = 2,
+    FRAME_RST_STREAM = 3,
+    FRAME_SETTINGS = 4,
+    FRAME_PUSH_PROMISE = 5,
+    FRAME_PING = 6,
+    FRAME_GOAWAY = 7,
+    FRAME_WINDOW_UPDATE = 8,
+    FRAME_CONTINUATION = 9
+};
+
+#define FLAG_END_STREAM 0x1
+#define FLAG_ACK 0x1
+#define FLAG_END_HEADERS 0x4
+#define FLAG_PADDED 0x8
+#define FLAG_PRIORITY 0x20
+
+enum h2_errors {
+    H2_NO_ERROR = 0,
+    H2_PROTOCOL_ERROR = 1,
+    H2_INTERNAL_ERROR = 2,
+    H2_FLOW_CONTROL_ERROR = 3,
+    H2_STREAM_CLOSED = 5,
+    H2_FRAME_SIZE_ERROR = 6,
+    H2_REFUSED_STREAM = 7,
+    H2_COMPRESSION_ERROR = 9,
+    H2_ENHANCE_YOUR_CALM = 11
+};
+
+enum h2_settings {
+    SETTINGS_HEADER_TABLE_SIZE = 1,
+    SETTINGS_ENABLE_PUSH = 2,
+    SETTINGS_MAX_CONCURRENT_STREAMS = 3,
+    SETTINGS_INITIAL_WINDOW_SIZE = 4,
+    SETTINGS_MAX_FRAME_SIZE = 5,
+    SETTINGS_MAX_HEADER_LIST_SIZE = 6
+};
+
+/* a piece of a response body, from memory or read from a file */
+typedef struct {
+    const char *data; // NULL when the piece comes from fd
+    int fd;
+    off_t offset;
+    off_t length;
+} SEGMENT;
+
+typedef struct h2_stream {
+    struct h2_session *session;
+    int id;         // 0 while the slot is free
+    int ready;      // the request is complete, its handler has not run
+    int handling;   // its handler is running, the slot has to stay
+    int reset;      // RST_STREAM was sent or received
+    int end_stream; // the peer sent END_STREAM
+    int malformed;
+    int body_open;  // a POST whose handler still wants the body
+    int responding; // headers are out, segments are still to be sent
+    int has_response;
+    ARENA arena; // the request text and everything the handler allocates
+    int arena_ready;
+    HTTP_REQUEST parsed;
+    char *data; // body bytes the handler has not read yet
+    int data_len;
+    int data_cap;
+    int handed_out; // bytes the handler holds since its last read
+    long received;
+    long recv_window;
+    long send_window;
+    RESPONSE res;
+    SEGMENT *segs;
+    int nsegs;
+    int seg;
+    off_t seg_done;
+} H2_STREAM;
+
+typedef struct h2_session {
+    CONN *conn;
+    HPACK_TABLE decoder;
+    HPACK_TABLE encoder;
+    unsigned char *in; // frames read but not processed yet
+    int in_len;
+    int preface_done;
+    int settings_seen;
+    char *block; // a header block waiting for its CONTINUATION frames
+    int block_len;
+    int block_stream;
+    int block_end_stream;
+    char *scratch; // Huffman decoded strings of a header block
+    int last_stream;
+    int goaway; // the peer is going away, no new streams
+    int error;  // sent in GOAWAY when set, -1 otherwise
+    int failed; // reading or writing failed, the connection is gone
+    int want;
+    long send_window;
+    long recv_window;
+    long peer_window; // the peer's SETTINGS_INITIAL_WINDOW_SIZE
+    H2_STREAM *streams;
+} H2_SESSION;
+
+/* collects the fields of a request header block */
+typedef struct {
+    ARENA *arena;
+    STRBUF fields;
+    char *pseudo[4]; // :method, :scheme, :authority, :path
+    int pseudo_len[4];
+    int regular; // pseudo fields are only allowed before this is set
+    int malformed;
+} BUILDER;
+
+static const char *pseudo_names[4] = {":method", ":scheme", ":authority",
+                                      ":path"};
+
+int HTTP2 = 1;
+int H2_MAX_STREAMS = 100;
+int H2_WINDOW = DEFAULT_WINDOW;
+
+static atomic_ulong h2_connections;
+static atomic_ulong h2_streams;
+static atomic_ulong h2_refused;
+static atomic_ulong h2_resets_sent;
+static atomic_ulong h2_resets_received;
+static atomic_ulong h2_goaways;
+
+static const unsigned char alpn_protos[] = "\x02h2\x08http/1.1";
+
+static uint32_t get32(const unsigned char *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 |
+           p[3];
+}
+
+static void put32(unsigned char *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+/* prefers h2 and falls back to http/1.1, a client that offers neither
+ * still gets HTTP/1.1 without ALPN
+ */
+static int alpn_select(SSL *ssl, const unsigned char **out,
+                       unsigned char *outlen, const unsigned char *in,
+                       unsigned int inlen, void *arg) {
+    (void)ssl;
+    (void)arg;
+    const unsigned char *protos = alpn_protos;
+    unsigned int len = sizeof(alpn_protos) - 1;
+    if (!HTTP2) {
+        protos += 3;
+        len -= 3;
+    }
+    if (SSL_select_next_proto((unsigned char **)out, outlen, protos, len, in,
+                              inlen) != OPENSSL_NPN_NEGOTIATED)
+        return SSL_TLSEXT_ERR_NOACK;
+    return SSL_TLSEXT_ERR_OK;
+}
+
+int http2_configure(SSL_CTX *ctx) {
+    hpack_init();
+    SSL_CTX_set_alpn_select_cb(ctx, alpn_select, NULL);
+    return 0;
+}
+
+int http2_negotiated(SSL *ssl) {
+    const unsigned char *proto;
+    unsigned int len;
+    SSL_get0_alpn_selected(ssl, &proto, &len);
+    return HTTP2 && len == 2 && memcmp(proto, "h2", 2) == 0;
+}
+
+/* Frames are assembled in one buffer per worker and queued as a whole, so
+ * a frame header never ends up in a TLS record of its own.
+ */
+static __thread unsigned char *frame_buf = NULL;
+
+static unsigned char *frame_payload(void) {
+    if (frame_buf == NULL &&
+        (frame_buf = malloc(FRAME_HEADER + MAX_FRAME)) == NULL) {
+        perror("frame_buf");
+        return NULL;
+    }
+    return frame_buf + FRAME_HEADER;
+}
+
+static int send_frame(H2_SESSION *s, int type, int flags, int id,
+                      const void *payload, int len) {
+    unsigned char *p = frame_payload();
+    if (p == NULL) {
+        s->failed = 1;
+        return -1;
+    }
+    if (len > 0 && payload != p)
+        memcpy(p, payload, len);
+
+    unsigned char *f = frame_buf;
+    f[0] = len >> 16;
+    f[1] = len >> 8;
+    f[2] = len;
+    f[3] = type;
+    f[4] = flags;
+    put32(f + 5, id);
+    if (queue_response(s->conn, f, FRAME_HEADER + len) < 0) {
+        s->failed = 1;
+        return -1;
+    }
+    return 0;
+}
+
+/* a connection error: GOAWAY is sent on the way out */
+static int conn_error(H2_SESSION *s, int code) {
+    if (s->error < 0)
+        s->error = code;
+    return -1;
+}
+
+static int send_window_update(H2_SESSION *s, int id, long increment) {
+    unsigned char p[4];
+    put32(p, increment);
+    return send_frame(s, FRAME_WINDOW_UPDATE, 0, id, p, 4);
+}
+
+static H2_STREAM *find_stream(H2_SESSION *s, int id) {
+    for (int i = 0; i < H2_MAX_STREAMS; i++)
+        if (s->streams[i].id == id)
+            return &s->streams[i];
+    return NULL;
+}
+
+static int open_streams(H2_SESSION *s) {
+    int n = 0;
+    for (int i = 0; i < H2_MAX_STREAMS; i++)
+        n += s->streams[i].id != 0;
+    return n;
+}
+
+/* frees the slot, unless its handler is still running */
+static void close_stream(H2_STREAM *st) {
+    if (st->handling)
+        return;
+    if (st->has_response)
+        file_body_release(&st->res.body);
+    if (st->arena_ready)
+        arena_reset(&st->arena);
+    free(st->data);
+
+    H2_SESSION *s = st->session;
+    ARENA arena = st->arena;
+    int arena_ready = st->arena_ready;
+    memset(st, 0, sizeof(*st));
+    st->session = s;
+    st->arena = arena;
+    st->arena_ready = arena_ready;
+}
+
+static int reset_id(H2_SESSION *s, int id, int code) {
+    unsigned char p[4];
+    put32(p, code);
+    atomic_fetch_add(&h2_resets_sent, 1);
+    return send_frame(s, FRAME_RST_STREAM, 0, id, p, 4);
+}
+
+/* a stream error: only this stream is closed */
+static int reset_stream(H2_STREAM *st, int code) {
+    st->reset = 1;
+    int ret = reset_id(st->session, st->id, code);
+    close_stream(st);
+    return ret;
+}
+
+/* gives the peer back the window of body bytes we are done with */
+static int ack_data(H2_STREAM *st, long n) {
+    st->recv_window += n;
+    if (n == 0 || st->end_stream || st->reset)
+        return 0;
+    return send_window_update(st->session, st->id, n);
+}
+
+static void emit_field(void *arg, const char *name, int name_len,
+                       const char *value, int value_len) {
+    BUILDER *b = (BUILDER *)arg;
+
+    if (name_len > 0 && name[0] == ':') {
+        int i;
+        for (i = 0; i < 4; i++)
+            if ((size_t)name_len == strlen(pseudo_names[i]) &&
+                memcmp(name, pseudo_names[i], name_len) == 0)
+                break;
+        if (i == 4 || b->regular || b->pseudo[i] != NULL ||
+            (b->pseudo[i] = arena_alloc(b->arena, value_len + 1)) == NULL) {
+            b->malformed = 1;
+            return;
+        }
+        /* spliced into the request line, so they may neither end it nor
+         * add a field of their own (RFC 9113 8.2.1, 8.3.1)
+         */
+        for (int j = 0; j < value_len; j++)
+            if (value[j] == '\r' || value[j] == '\n' || value[j] == '\0' ||
+                (value[j] == ' ' && (i == 0 || i == 3)))
+                b->malformed = 1;
+        memcpy(b->pseudo[i], value, value_len);
+        b->pseudo[i][value_len] = '\0';
+        b->pseudo_len[i] = value_len;
+        return;
+    }
+    b->regular = 1;
+
+    /* the fields become lines of an HTTP/1.1 request, nothing in them may
+     * end a line early (RFC 9113 8.2.1)
+     */
+    for (int i = 0; i < name_len; i++)
+        if ((name[i] >= 'A' && name[i] <= 'Z') || name[i] == ':' ||
+            name[i] == '\r' || name[i] == '\n' || name[i] == '\0' ||
+            name[i] == ' ')
+            b->malformed = 1;
+    for (int i = 0; i < value_len; i++)
+        if (value[i] == '\r' || value[i] == '\n' || value[i] == '\0')
+            b->malformed = 1;
+
+    /* connection-specific fields have no meaning in HTTP/2 */
+    static const char *forbidden[] = {"connection", "keep-alive",
+                                      "proxy-connection", "transfer-encoding",
+                                      "upgrade"};
+    for (size_t i = 0; i < sizeof(forbidden) / sizeof(forbidden[0]); i++)
+        if ((size_t)name_len == strlen(forbidden[i]) &&
+            memcmp(name, forbidden[i], name_len) == 0)
+            b->malformed = 1;
+    if (name_len == 2 && memcmp(name, "te", 2) == 0 &&
+        (value_len != 8 || memcmp(value, "trailers", 8) != 0))
+        b->malformed = 1;
+    if (b->malformed)
+        return;
+
+    strbuf_append(&b->fields, name, name_len);
+    strbuf_puts(&b->fields, ": ");
+    strbuf_append(&b->fields, value, value_len);
+    strbuf_puts(&b->fields, "\r\n");
+}
+
+static void discard_field(void *arg, const char *name, int name_len,
+                          const char *value, int value_len) {
+    (void)arg;
+    (void)name;
+    (void)name_len;
+    (void)value;
+    (void)value_len;
+}
+
+/* Turns the decoded fields into the HTTP/1.1 request the handlers know
+ * and parses it, so both protocols share the parser and the handlers.
+ */
+static void build_request(H2_STREAM *st, BUILDER *b) {
+    if (b->malformed || b->fields.failed || b->pseudo[0] == NULL ||
+        b->pseudo[1] == NULL || b->pseudo[3] == NULL ||
+        b->pseudo[3][0] != '/') {
+        st->malformed = 1;
+        return;
+    }
+
+    STRBUF text;
+    strbuf_init(&text, &st->arena, b->fields.len + 128);
+    strbuf_append(&text, b->pseudo[0], b->pseudo_len[0]);
+    strbuf_puts(&text, " ");
+    strbuf_append(&text, b->pseudo[3], b->pseudo_len[3]);
+    strbuf_puts(&text, " HTTP/1.1\r\n");
+    if (b->pseudo[2] != NULL) {
+        strbuf_puts(&text, "host: ");
+        strbuf_append(&text, b->pseudo[2], b->pseudo_len[2]);
+        strbuf_puts(&text, "\r\n");
+    }
+    strbuf_append(&text, b->fields.data, b->fields.len);
+    strbuf_append(&text, "\r\n", 3); // keeps the text NUL terminated
+    if (text.failed) {
+        st->malformed = 1;
+        return;
+    }
+
+    http_request_reset(&st->parsed);
+    http_parse(&st->parsed, text.data, text.len - 1);
+    st->body_open = st->parsed.method == POST;
+}
+
+/* a complete header block: a new request, or trailers of an open one */
+static int header_block_done(H2_SESSION *s) {
+    int id = s->block_stream;
+    int end_stream = s->block_end_stream;
+    const unsigned char *block = (const unsigned char *)s->block;
+    size_t scratch_size = 2 * (size_t)MAX_REQUEST_SIZE;
+    s->block_stream = 0;
+
+    H2_STREAM *st = find_stream(s, id);
+    if (st != NULL) {
+        if (hpack_decode(&s->decoder, block, s->block_len, s->scratch,
+                         scratch_size, discard_field, NULL) < 0)
+            return conn_error(s, H2_COMPRESSION_ERROR);
+        if (!end_stream)
+            return reset_stream(st, H2_PROTOCOL_ERROR);
+        st->end_stream = 1;
+        return 0;
+    }
+
+    /* the block has to be decoded either way, the table depends on it */
+    s->last_stream = id;
+    for (int i = 0; i < H2_MAX_STREAMS && !s->goaway; i++) {
+        if (s->streams[i].id == 0) {
+            st = &s->streams[i];
+            break;
+        }
+    }
+    if (st != NULL && !st->arena_ready) {
+        if (arena_init(&st->arena, CONN_ARENA_SIZE) < 0)
+            st = NULL;
+        else
+            st->arena_ready = 1;
+    }
+    if (st == NULL) {
+        if (hpack_decode(&s->decoder, block, s->block_len, s->scratch,
+                         scratch_size, discard_field, NULL) < 0)
+            return conn_error(s, H2_COMPRESSION_ERROR);
+        atomic_fetch_add(&h2_refused, 1);
+        return reset_id(s, id, H2_REFUSED_STREAM);
+    }
+
+    st->id = id;
+    st->end_stream = end_stream;
+    st->recv_window = H2_WINDOW;
+    st->send_window = s->peer_window;
+    BUILDER b = {.arena = &st->arena};
+    strbuf_init(&b.fields, &st->arena, 256);
+    if (hpack_decode(&s->decoder, block, s->block_len, s->scratch,
+                     scratch_size, emit_field, &b) < 0)
+        return conn_error(s, H2_COMPRESSION_ERROR);
+    build_request(st, &b);
+    st->ready = 1;
+    atomic_fetch_add(&h2_streams, 1);
+    return 0;
+}
+
+static int append_block(H2_SESSION *s, const unsigned char *p, int len,
+                        int flags) {
+    /* a block we cannot hold cannot be decoded, and skipping it would put
+     * the HPACK table out of sync with the peer
+     */
+    if (s->block_len + len > MAX_REQUEST_SIZE)
+        return conn_error(s, H2_ENHANCE_YOUR_CALM);
+    memcpy(s->block + s->block_len, p, len);
+    s->block_len += len;
+    if (flags & FLAG_END_HEADERS)
+        return header_block_done(s);
+    return 0;
+}
+
+/* strips the padding of DATA and HEADERS, -1 when it is too long */
+static int unpad(const unsigned char **p, int *len, int flags) {
+    if (!(flags & FLAG_PADDED))
+        return 0;
+    if (*len < 1)
+        return -1;
+    int pad = **p;
+    (*p)++;
+    (*len)--;
+    if (pad > *len)
+        return -1;
+    *len -= pad;
+    return 0;
+}
+
+static int on_headers(H2_SESSION *s, int flags, int id,
+                      const unsigned char *p, int len) {
+    if (id == 0 || id % 2 == 0)
+        return conn_error(s, H2_PROTOCOL_ERROR);
+    if (unpad(&p, &len, flags) < 0)
+        return conn_error(s, H2_PROTOCOL_ERROR);
+    if (flags & FLAG_PRIORITY) {
+        if (len < 5)
+            return conn_error(s, H2_FRAME_SIZE_ERROR);
+        p += 5;
+        len -= 5;
+    }
+
+    H2_STREAM *st = find_stream(s, id);
+    if (st == NULL && id <= s->last_stream)
+        return conn_error(s, H2_STREAM_CLOSED);
+    /* its block is not decoded, which leaves no way to keep the table */
+    if (st != NULL && st->end_stream)
+        return conn_error(s, H2_STREAM_CLOSED);
+
+    s->block_stream = id;
+    s->block_end_stream = flags & FLAG_END_STREAM;
+    s->block_len = 0;
+    return append_block(s, p, len, flags);
+}
+
+static int on_data(H2_SESSION *s, int flags, int id, const unsigned char *p,
+                   int len) {
+    if (id == 0)
+        return conn_error(s, H2_PROTOCOL_ERROR);
+
+    /* padding counts against the windows as well */
+    long full = len;
+    if (unpad(&p, &len, flags) < 0)
+        return conn_error(s, H2_PROTOCOL_ERROR);
+
+    /* body bytes are bounded by the stream windows, so the connection
+     * window is given back as soon as the data is in
+     */
+    long target = (long)H2_WINDOW * H2_MAX_STREAMS;
+    if (target > MAX_WINDOW)
+        target = MAX_WINDOW;
+    if ((s->recv_window -= full) < 0)
+        return conn_error(s, H2_FLOW_CONTROL_ERROR);
+    if (s->recv_window <= target / 2) {
+        if (send_window_update(s, 0, target - s->recv_window) < 0)
+            return -1;
+        s->recv_window = target;
+    }
+
+    H2_STREAM *st = find_stream(s, id);
+    if (st == NULL) {
+        if (id > s->last_stream)
+            return conn_error(s, H2_PROTOCOL_ERROR);
+        return reset_id(s, id, H2_STREAM_CLOSED);
+    }
+    if (st->end_stream)
+        return reset_stream(st, H2_STREAM_CLOSED);
+    if ((st->recv_window -= full) < 0)
+        return reset_stream(st, H2_FLOW_CONTROL_ERROR);
+    st->received += len;
+    if (flags & FLAG_END_STREAM)
+        st->end_stream = 1;
+
+    if (!st->body_open)
+        return ack_data(st, full);
+
+    if (st->data_len + len > st->data_cap) {
+        int cap = st->data_cap ? st->data_cap : 16384;
+        while (cap < st->data_len + len)
+            cap *= 2;
+        char *data = realloc(st->data, cap);
+        if (data == NULL) {
+            perror("h2 body");
+            return reset_stream(st, H2_INTERNAL_ERROR);
+        }
+        st->data = data;
+        st->data_cap = cap;
+    }
+    memcpy(st->data + st->data_len, p, len);
+    st->data_len += len;
+    return ack_data(st, full - len);
+}
+
+static int on_settings(H2_SESSION *s, int flags, int id,
+                       const unsigned char *p, int len) {
+    if (id != 0)
+        return conn_error(s, H2_PROTOCOL_ERROR);
+    if (flags & FLAG_ACK)
+        return len == 0 ? 0 : conn_error(s, H2_FRAME_SIZE_ERROR);
+    if (len % 6 != 0)
+        return conn_error(s, H2_FRAME_SIZE_ERROR);
+
+    for (int i = 0; i < len; i += 6) {
+        int key = p[i] << 8 | p[i + 1];
+        uint32_t value = get32(p + i + 2);
+
+        switch (key) {
+        case SETTINGS_HEADER_TABLE_SIZE:
+            hpack_set_max_size(&s->encoder, value);
+            break;
+        case SETTINGS_ENABLE_PUSH:
+            if (value > 1)
+                return conn_error(s, H2_PROTOCOL_ERROR);
+            break;
+        case SETTINGS_INITIAL_WINDOW_SIZE: {
+            if (value > MAX_WINDOW)
+                return conn_error(s, H2_FLOW_CONTROL_ERROR);
+            /* open streams move by the difference (RFC 9113 6.9.2) */
+            long delta = (long)value - s->peer_window;
+            for (int j = 0; j < H2_MAX_STREAMS; j++) {
+                H2_STREAM *st = &s->streams[j];
+                if (st->id == 0)
+                    continue;
+                if ((st->send_window += delta) > MAX_WINDOW)
+                    return conn_error(s, H2_FLOW_CONTROL_ERROR);
+            }
+            s->peer_window = value;
+            break;
+        }
+        case SETTINGS_MAX_FRAME_SIZE:
+            /* frames we send never exceed the default anyway */
+            if (value < MAX_FRAME || value > 0xffffff)
+                return conn_error(s, H2_PROTOCOL_ERROR);
+            break;
+        }
+    }
+    s->settings_seen = 1;
+    return send_frame(s, FRAME_SETTINGS, FLAG_ACK, 0, NULL, 0);
+}
+
+static int on_window_update(H2_SESSION *s, int id, const unsigned char *p,
+                            int len) {
+    if (len != 4)
+        return conn_error(s, H2_FRAME_SIZE_ERROR);
+    long increment = get32(p) & 0x7fffffff;
+
+    if (id == 0) {
+        if (increment == 0)
+            return conn_error(s, H2_PROTOCOL_ERROR);
+        if ((s->send_window += increment) > MAX_WINDOW)
+            return conn_error(s, H2_FLOW_CONTROL_ERROR);
+        return 0;
+    }
+    H2_STREAM *st = find_stream(s, id);
+    if (st == NULL)
+        return id > s->last_stream ? conn_error(s, H2_PROTOCOL_ERROR) : 0;
+    if (increment == 0)
+        return reset_stream(st, H2_PROTOCOL_ERROR);
+    if ((st->send_window += increment) > MAX_WINDOW)
+        return reset_stream(st, H2_FLOW_CONTROL_ERROR);
+    return 0;
+}
+
+static int on_rst_stream(H2_SESSION *s, int id, int len) {
+    if (len != 4)
+        return conn_error(s, H2_FRAME_SIZE_ERROR);
+    if (id == 0)
+        return conn_error(s, H2_PROTOCOL_ERROR);
+    H2_STREAM *st = find_stream(s, id);
+    if (st == NULL)
+        return id > s->last_stream ? conn_error(s, H2_PROTOCOL_ERROR) : 0;
+    atomic_fetch_add(&h2_resets_received, 1);
+    st->reset = 1;
+    close_stream(st);
+    return 0;
+}
+
+static int process_frame(H2_SESSION *s, int type, int flags, int id,
+                         const unsigned char *p, int len) {
+    /* a header block is not interleaved with anything */
+    if (s->block_stream != 0 &&
+        (type != FRAME_CONTINUATION || id != s->block_stream))
+        return conn_error(s, H2_PROTOCOL_ERROR);
+
+    switch (type) {
+    case FRAME_DATA:
+        return on_data(s, flags, id, p, len);
+    case FRAME_HEADERS:
+        return on_headers(s, flags, id, p, len);
+    case FRAME_CONTINUATION:
+        if (s->block_stream == 0)
+            return conn_error(s, H2_PROTOCOL_ERROR);
+        return append_block(s, p, len, flags);
+    case FRAME_PRIORITY:
+        /* responses go out round-robin, priorities are not used */
+        if (id == 0)
+            return conn_error(s, H2_PROTOCOL_ERROR);
+        if (len != 5)
+            return reset_id(s, id, H2_FRAME_SIZE_ERROR);
+        return 0;
+    case FRAME_RST_STREAM:
+        return on_rst_stream(s, id, len);
+    case FRAME_SETTINGS:
+        return on_settings(s, flags, id, p, len);
+    case FRAME_PUSH_PROMISE:
+        return conn_error(s, H2_PROTOCOL_ERROR);
+    case FRAME_PING:
+        if (id != 0)
+            return conn_error(s, H2_PROTOCOL_ERROR);
+        if (len != 8)
+            return conn_error(s, H2_FRAME_SIZE_ERROR);
+        if (flags & FLAG_ACK)
+            return 0;
+        return send_frame(s, FRAME_PING, FLAG_ACK, 0, p, 8);
+    case FRAME_GOAWAY:
+        if (id != 0)
+            return conn_error(s, H2_PROTOCOL_ERROR);
+        s->goaway = 1;
+        return 0;
+    case FRAME_WINDOW_UPDATE:
+        return on_window_update(s, id, p, len);
+    }
+    return 0; // unknown frame types are ignored
+}
+
+/* processes every complete frame in the input buffer */
+static int process_input(H2_SESSION *s) {
+    int pos = 0;
+
+    if (!s->preface_done) {
+        if (s->in_len < (int)PREFACE_LEN)
+            return 0;
+        if (memcmp(s->in, PREFACE, PREFACE_LEN) != 0)
+            return conn_error(s, H2_PROTOCOL_ERROR);
+        s->preface_done = 1;
+        pos = PREFACE_LEN;
+    }
+
+    while (s->in_len - pos >= FRAME_HEADER) {
+        const unsigned char *f = s->in + pos;
+        int len = f[0] << 16 | f[1] << 8 | f[2];
+        if (len > MAX_FRAME)
+            return conn_error(s, H2_FRAME_SIZE_ERROR);
+        if (s->in_len - pos < FRAME_HEADER + len)
+            break;
+
+        /* the client preface ends with a SETTINGS frame */
+        if (!s->settings_seen && (f[3] != FRAME_SETTINGS || (f[4] & FLAG_ACK)))
+            return conn_error(s, H2_PROTOCOL_ERROR);
+        if (process_frame(s, f[3], f[4], get32(f + 5) & 0x7fffffff,
+                          f + FRAME_HEADER, len) < 0)
+            return -1;
+        if (s->error >= 0 || s->failed)
+            return -1;
+        pos += FRAME_HEADER + len;
+    }
+
+    s->in_len -= pos;
+    memmove(s->in, s->in + pos, s->in_len);
+    return 0;
+}
+
+/* Reads more frames into the input buffer. Returns 1 when something was
+ * read, 0 when a non-blocking socket has nothing (s->want says what to wait
+ * for) and -1 once the connection is gone. With block set it waits instead.
+ */
+static int read_input(H2_SESSION *s, int block) {
+    CONN *conn = s->conn;
+    int room = PREFACE_LEN + FRAME_HEADER + MAX_FRAME - s->in_len;
+
+    while (1) {
+        int bytes = SSL_read(conn->ssl, s->in + s->in_len, room);
+        if (bytes > 0) {
+            metrics_add(M_BYTES_IN, bytes);
+            s->in_len += bytes;
+            return 1;
+        }
+        int err = SSL_get_error(conn->ssl, bytes);
+        if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE) {
+            s->failed = 1;
+            return -1;
+        }
+        if (!block) {
+            s->want = err;
+            return 0;
+        }
+        if (ssl_wait(conn, bytes) < 0) {
+            s->failed = 1;
+            return -1;
+        }
+    }
+}
+
+/* whether frames can be read without waiting for the peer */
+static int input_ready(CONN *conn) {
+    struct pollfd pfd = {conn->socket, POLLIN, 0};
+    return SSL_has_pending(conn->ssl) || poll(&pfd, 1, 0) > 0;
+}
+
+/* BODY_READER callback: hands the POST handler whatever DATA has arrived
+ * for its stream, reading frames of the whole connection while it waits
+ */
+static long read_stream_body(void *arg, const char **data) {
+    H2_STREAM *st = (H2_STREAM *)arg;
+    H2_SESSION *s = st->session;
+
+    if (st->handed_out > 0) {
+        int n = st->handed_out;
+        st->handed_out = 0;
+        st->data_len = 0;
+        if (ack_data(st, n) < 0)
+            return -1;
+    }
+    while (st->data_len == 0 && !st->end_stream && !st->reset) {
+        if (flush_responses(s->conn) < 0) {
+            s->failed = 1;
+            return -1;
+        }
+        conn_deadline(s->conn, PHASE_BODY);
+        if (read_input(s, 1) < 0 || process_input(s) < 0)
+            return -1;
+        conn_deadline(s->conn, PHASE_SEND);
+    }
+    if (st->reset)
+        return -1;
+    if (st->data_len == 0) {
+        /* a body that does not match its Content-Length is malformed */
+        if (st->parsed.content_length >= 0 &&
+            st->received != st->parsed.content_length)
+            return -1;
+        return 0;
+    }
+    *data = st->data;
+    st->handed_out = st->data_len;
+    return st->data_len;
+}
+
+static void add_segment(H2_STREAM *st, const char *data, int fd,
+                        off_t offset, off_t length) {
+    if (length > 0)
+        st->segs[st->nsegs++] = (SEGMENT){data, fd, offset, length};
+}
+
+/* lays out the body the same way serve_request() sends it for HTTP/1.1 */
+static int setup_segments(H2_STREAM *st) {
+    RESPONSE *res = &st->res;
+    FILE_BODY *body = &res->body;
+    int max = res->parts != NULL ? 2 * body->nranges + 2 : 2;
+
+    if ((st->segs = arena_alloc(&st->arena, sizeof(SEGMENT) * max)) == NULL)
+        return -1;
+    st->nsegs = 0;
+    st->seg = 0;
+    st->seg_done = 0;
+
+    if (res->content != NULL)
+        add_segment(st, res->content, -1, 0, res->content_length);
+    else if (body->cached != NULL && res->parts == NULL)
+        add_segment(st, body->cached->data + body->offset, -1, 0,
+                    body->length);
+    else if (body->variant != NULL)
+        add_segment(st, body->variant->data, -1, 0, body->length);
+
+    if (res->parts != NULL) {
+        for (int i = 0; i <= body->nranges; i++) {
+            add_segment(st, res->parts[i].data, -1, 0, res->parts[i].len);
+            if (i == body->nranges)
+                break;
+            BYTE_RANGE *range = &body->ranges[i];
+            if (body->cached != NULL)
+                add_segment(st, body->cached->data + range->start, -1, 0,
+                            range->length);
+            else
+                add_segment(st, NULL, body->fd, range->start, range->length);
+        }
+    } else if (body->fd >= 0) {
+        add_segment(st, NULL, body->fd, body->offset, body->length);
+    }
+    return 0;
+}
+
+/* once the response is complete the stream is done, a peer that is still
+ * sending is told to stop
+ */
+static int finish_stream(H2_STREAM *st) {
+    if (!st->end_stream)
+        return reset_stream(st, H2_NO_ERROR);
+    close_stream(st);
+    return 0;
+}
+
+/* fields whose values differ between responses, indexing them would only
+ * push the others out of the dynamic table
+ */
+static int volatile_field(const char *name, size_t len) {
+    static const char *names[] = {"content-length", "etag", "last-modified",
+                                  "content-range"};
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+        if (len == strlen(names[i]) && memcmp(name, names[i], len) == 0)
+            return 1;
+    return 0;
+}
+
+/* Encodes the response header block: the header lines generate_headers()
+ * writes for HTTP/1.1 are turned into fields, minus Connection.
+ */
+static int send_headers(H2_SESSION *s, H2_STREAM *st) {
+    RESPONSE *res = &st->res;
+    STRBUF lines, block;
+    strbuf_init(&lines, &st->arena, 256);
+    strbuf_init(&block, &st->arena, 128);
+    generate_headers(&lines, 1, res->content_length, res->rt, res->found,
+                     &st->parsed, &res->body);
+
+    hpack_begin(&s->encoder, &block);
+    hpack_encode(&s->encoder, &block, ":status", 7, res->status, 3, 1);
+    hpack_encode(&s->encoder, &block, "server", 6, "our_server.com", 14, 1);
+
+    char *line = lines.data;
+    char *end = lines.data + (lines.failed ? 0 : lines.len);
+    while (line < end) {
+        char *eol = memchr(line, '\r', end - line);
+        char *colon = memchr(line, ':', eol - line);
+        if (eol == NULL || colon == NULL)
+            break;
+        char name[64];
+        size_t name_len = colon - line;
+        if (name_len < sizeof(name)) {
+            for (size_t i = 0; i < name_len; i++)
+                name[i] = tolower((unsigned char)line[i]);
+            const char *value = colon + 2;
+            if (!(name_len == 10 && memcmp(name, "connection", 10) == 0))
+                hpack_encode(&s->encoder, &block, name, name_len, value,
+                             eol - value, !volatile_field(name, name_len));
+        }
+        line = eol + 2;
+    }
+    /* the encoder table has moved on already, the block has to go out */
+    if (lines.failed || block.failed)
+        return conn_error(s, H2_INTERNAL_ERROR);
+
+    int end_stream = st->nsegs == 0 ? FLAG_END_STREAM : 0;
+    size_t off = 0;
+    do {
+        size_t len = block.len - off < MAX_FRAME ? block.len - off : MAX_FRAME;
+        int last = off + len == block.len;
+        int type = off == 0 ? FRAME_HEADERS : FRAME_CONTINUATION;
+        int flags = (last ? FLAG_END_HEADERS : 0) |
+                    (type == FRAME_HEADERS ? end_stream : 0);
+        if (send_frame(s, type, flags, st->id, block.data + off, len) < 0)
+            return -1;
+        off += len;
+    } while (off < block.len);
+
+    if (end_stream)
+        return finish_stream(st);
+    st->responding = 1;
+    return 0;
+}
+
+/* answers a request that did not reach a handler */
+static void error_response(H2_STREAM *st, int found, const char *status,
+                          const char *content) {
+    RESPONSE *res = &st->res;
+    res->rt = NONE;
+    res->found = found;
+    strcpy(res->status, status);
+    res->content = content;
+    res->content_length = strlen(content);
+    res->body = (FILE_BODY){.fd = -1};
+    res->parts = NULL;
+}
+
+/* runs the handler of a complete request and queues the response headers,
+ * the body follows in send_round()
+ */
+static int serve_stream(H2_SESSION *s, H2_STREAM *st) {
+    RESPONSE *res = &st->res;
+    BODY_READER reader = {read_stream_body, st};
+
+    st->ready = 0;
+    if (st->malformed)
+        return reset_stream(st, H2_PROTOCOL_ERROR);
+
+    unsigned long start = metrics_now();
+    if (s->conn->served++ > 0)
+        metrics_add(M_KEEPALIVE_REUSE, 1);
+    metrics_request(st->parsed.method);
+
+    st->handling = 1;
+    int ret = 0;
+    if (st->parsed.result != PARSE_DONE)
+        error_response(st, 400, RESPONSE_BAD_REQUEST, "Bad request!");
+    else if (st->parsed.method == NONE)
+        error_response(st, 501, "501 Not Implemented",
+                       "Method not implemented!");
+    else
+        ret = run_handler(&st->parsed, &st->arena, &reader, res);
+    st->handling = 0;
+    st->has_response = ret == 0;
+
+    /* whatever of the body the handler left unread is dropped */
+    if (st->body_open) {
+        st->body_open = 0;
+        int n = st->data_len; // includes what the handler was handed last
+        st->handed_out = 0;
+        st->data_len = 0;
+        if (ack_data(st, n) < 0)
+            return -1;
+    }
+
+    if (s->error >= 0 || s->failed)
+        return -1;
+    if (st->reset) {
+        close_stream(st);
+        return 0;
+    }
+    if (ret < 0 || setup_segments(st) < 0)
+        return reset_stream(st, H2_INTERNAL_ERROR);
+    metrics_status(atoi(res->status));
+    /* logged first, a response without a body closes the stream */
+    unsigned long elapsed = metrics_now() - start;
+    if (ACCESS_LOG != NULL)
+        log_request(s->conn, &st->parsed, atoi(res->status),
+                    res->rt == HEAD || res->found == 304
+                        ? 0
+                        : res->content_length,
+                    elapsed);
+    ret = send_headers(s, st);
+    metrics_observe(H_REQUEST, metrics_now() - start);
+    return ret;
+}
+
+static int run_ready(H2_SESSION *s) {
+    int found = 1;
+    while (found) {
+        found = 0;
+        for (int i = 0; i < H2_MAX_STREAMS; i++) {
+            H2_STREAM *st = &s->streams[i];
+            if (st->id == 0 || !st->ready)
+                continue;
+            found = 1;
+            if (serve_stream(s, st) < 0)
+                return -1;
+        }
+    }
+    return 0;
+}
+
+/* Sends at most one DATA frame for every stream with a body to send, so
+ * concurrent responses share the connection. Returns 1 when some stream
+ * could send more right away, 0 when all are done or out of window.
+ */
+static int send_round(H2_SESSION *s) {
+    int more = 0;
+
+    for (int i = 0; i < H2_MAX_STREAMS && s->send_window > 0; i++) {
+        H2_STREAM *st = &s->streams[i];
+        if (st->id == 0 || !st->responding || st->send_window <= 0)
+            continue;
+
+        SEGMENT *seg = &st->segs[st->seg];
+        off_t left = seg->length - st->seg_done;
+        long n = MAX_FRAME;
+        if (n > left)
+            n = left;
+        if (n > st->send_window)
+            n = st->send_window;
+        if (n > s->send_window)
+            n = s->send_window;
+
+        unsigned char *p = frame_payload();
+        if (p == NULL) {
+            s->failed = 1;
+            return -1;
+        }
+        if (seg->data != NULL) {
+            memcpy(p, seg->data + st->seg_done, n);
+        } else {
+            ssize_t bytes;
+            off_t offset = seg->offset + st->seg_done;
+            while ((bytes = pread(seg->fd, p, n, offset)) < 0 &&
+                   errno == EINTR)
+                ;
+            if (bytes <= 0) {
+                perror("file read");
+                if (reset_stream(st, H2_INTERNAL_ERROR) < 0)
+                    return -1;
+                continue;
+            }
+            n = bytes;
+        }
+
+        st->seg_done += n;
+        if (st->seg_done == seg->length) {
+            st->seg++;
+            st->seg_done = 0;
+        }
+        int last = st->seg == st->nsegs;
+        if (send_frame(s, FRAME_DATA, last ? FLAG_END_STREAM : 0, st->id, p,
+                       n) < 0)
+            return -1;
+        st->send_window -= n;
+        s->send_window -= n;
+
+        if (last) {
+            if (finish_stream(st) < 0)
+                return -1;
+        } else if (st->send_window > 0) {
+            more = 1;
+        }
+    }
+    return s->send_window > 0 ? more : 0;
+}
+
+static H2_SESSION *session_new(CONN *conn) {
+    H2_SESSION *s = calloc(1, sizeof(H2_SESSION));
+    if (s == NULL)
+        return NULL;
+    s->streams = calloc(H2_MAX_STREAMS, sizeof(H2_STREAM));
+    s->in = malloc(PREFACE_LEN + FRAME_HEADER + MAX_FRAME);
+    s->block = malloc(MAX_REQUEST_SIZE);
+    s->scratch = malloc(2 * (size_t)MAX_REQUEST_SIZE);
+    conn->h2 = s;
+    if (s->streams == NULL || s->in == NULL || s->block == NULL ||
+        s->scratch == NULL)
+        return NULL;
+
+    for (int i = 0; i < H2_MAX_STREAMS; i++)
+        s->streams[i].session = s;
+    s->conn = conn;
+    hpack_table_init(&s->decoder);
+    hpack_table_init(&s->encoder);
+    s->error = -1;
+    s->send_window = DEFAULT_WINDOW;
+    s->recv_window = DEFAULT_WINDOW;
+    s->peer_window = DEFAULT_WINDOW;
+    atomic_fetch_add(&h2_connections, 1);
+
+    /* the server preface, sent without waiting for the client's */
+    unsigned char settings[18];
+    int settings_values[3][2] = {
+        {SETTINGS_MAX_CONCURRENT_STREAMS, H2_MAX_STREAMS},
+        {SETTINGS_INITIAL_WINDOW_SIZE, H2_WINDOW},
+        {SETTINGS_MAX_HEADER_LIST_SIZE, MAX_REQUEST_SIZE}};
+    for (int i = 0; i < 3; i++) {
+        settings[i * 6] = settings_values[i][0] >> 8;
+        settings[i * 6 + 1] = settings_values[i][0];
+        put32(settings + i * 6 + 2, settings_values[i][1]);
+    }
+    if (send_frame(s, FRAME_SETTINGS, 0, 0, settings, sizeof(settings)) < 0)
+        return NULL;
+
+    long target = (long)H2_WINDOW * H2_MAX_STREAMS;
+    if (target > MAX_WINDOW)
+        target = MAX_WINDOW;
+    if (target > s->recv_window) {
+        if (send_window_update(s, 0, target - s->recv_window) < 0)
+            return NULL;
+        s->recv_window = target;
+    }
+    return s;
+}
+
+/* Serves an HTTP/2 connection: frames are read and processed, complete
+ * requests run through the same handlers as HTTP/1.1 and the response
+ * bodies are interleaved under flow control. Returns 1 when the event
+ * loop got the connection back to wait for more frames, 0 when it has
+ * to be closed.
+ */
+int http2_serve(CONN *conn) {
+    H2_SESSION *s = conn->h2;
+    if (s == NULL && (s = session_new(conn)) == NULL) {
+        perror("h2 session");
+        flush_responses(conn);
+        return 0;
+    }
+
+    while (1) {
+        if (process_input(s) < 0 || run_ready(s) < 0)
+            break;
+        int more = send_round(s);
+        if (more < 0)
+            break;
+        if (s->goaway && open_streams(s) == 0)
+            break;
+        if (more && !input_ready(conn))
+            continue;
+
+        if (flush_responses(conn) < 0)
+            return 0;
+        /* streams still waiting for data or window, or none at all */
+        conn_deadline(conn, open_streams(s) > 0 ? PHASE_BODY : PHASE_IDLE);
+        int ret = read_input(s, CONN_ENGINE == ENGINE_THREADS);
+        if (ret < 0)
+            break;
+        if (ret == 0 && !more) {
+            event_loop_wait(conn, s->want);
+            return 1;
+        }
+        conn_deadline(conn, PHASE_SEND);
+    }
+
+    if (s->error >= 0 && !s->failed) {
+        unsigned char p[8];
+        put32(p, s->last_stream);
+        put32(p + 4, s->error);
+        atomic_fetch_add(&h2_goaways, 1);
+        send_frame(s, FRAME_GOAWAY, 0, 0, p, 8);
+    }
+    flush_responses(conn);
+    return 0;
+}
+
+void http2_free(CONN *conn) {
+    H2_SESSION *s = conn->h2;
+    if (s == NULL)
+        return;
+    if (s->streams != NULL) {
+        for (int i = 0; i < H2_MAX_STREAMS; i++) {
+            H2_STREAM *st = &s->streams[i];
+            st->handling = 0;
+            close_stream(st);
+            if (st->arena_ready)
+                arena_destroy(&st->arena);
+        }
+    }
+    free(s->streams);
+    free(s->in);
+    free(s->block);
+    free(s->scratch);
+    free(s);
+    conn->h2 = NULL;
+}
+
+void http2_stats(FILE *fp) {
+    fprintf(fp,
+            "http2: %lu connections, %lu streams (%lu refused), "
+            "resets %lu sent %lu received, %lu GOAWAY errors\n",
+            atomic_load(&h2_connections), atomic_load(&h2_streams),
+            atomic_load(&h2_refused), atomic_load(&h2_resets_sent),
+            atomic_load(&h2_resets_received), atomic_load(&h2_goaways));
+}
@@ -0,0 +1,19 @@
+#ifndef HTTP2_H
+#define HTTP2_H
+
+#include <openssl/ssl.h>
+#include <stdio.h>
+
+#include "request_handler.h"
+
+extern int HTTP2;
+extern int H2_MAX_STREAMS;
+extern int H2_WINDOW;
+
+int http2_configure(SSL_CTX *ctx);
+int http2_negotiated(SSL *ssl);
+int http2_serve(CONN *conn);
+void http2_free(CONN *conn);
+void http2_stats(FILE *fp);
+
+#endif
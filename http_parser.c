@@ -0,0 +1,389 @@
+#define _GNU_SOURCE // strptime, timegm
+#include "http_parser.h"
+
+#include <ctype.h>
+#include <string.h>
+#include <strings.h>
+
+/* characters allowed in methods and header names (RFC 9110 tchar) */
+static int is_tchar(unsigned char c) {
+    return isalnum(c) || (c != 0 && strchr("!#$%&'*+-.^_`|~", c) != NULL);
+}
+
+void http_request_reset(HTTP_REQUEST *req) {
+    memset(req, 0, sizeof(*req));
+    req->state = PS_METHOD;
+    req->result = PARSE_INCOMPLETE;
+    req->method = NONE;
+    req->content_length = -1;
+}
+
+/* case-insensitive comparison of a token with a string */
+int span_equals(const char *buf, const SPAN *span, const char *str) {
+    return (size_t)span->len == strlen(str) &&
+           strncasecmp(buf + span->off, str, span->len) == 0;
+}
+
+/* looks for token in a comma separated header value, e.g. Connection */
+int span_contains_token(const char *buf, const SPAN *span,
+                        const char *token) {
+    size_t len = strlen(token);
+    const char *p = buf + span->off;
+    const char *end = p + span->len;
+
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+            p++;
+        const char *item = p;
+        while (p < end && *p != ',')
+            p++;
+        const char *item_end = p;
+        while (item_end > item &&
+               (item_end[-1] == ' ' || item_end[-1] == '\t'))
+            item_end--;
+        if ((size_t)(item_end - item) == len &&
+            strncasecmp(item, token, len) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+const SPAN *http_header(const HTTP_REQUEST *req, const char *name) {
+    for (int i = 0; i < req->nheaders; i++)
+        if (span_equals(req->buf, &req->headers[i].name, name))
+            return &req->headers[i].value;
+    return NULL;
+}
+
+static enum request_types method_of(const char *buf, const SPAN *method) {
+    /* methods are case-sensitive */
+    const char *m = buf + method->off;
+    if (method->len == 3 && strncmp(m, "GET", 3) == 0)
+        return GET;
+    if (method->len == 4 && strncmp(m, "HEAD", 4) == 0)
+        return HEAD;
+    if (method->len == 4 && strncmp(m, "POST", 4) == 0)
+        return POST;
+    if (method->len == 6 && strncmp(m, "DELETE", 6) == 0)
+        return DELETE;
+    return NONE;
+}
+
+/* interprets the headers that matter for framing the request */
+static int header_done(HTTP_REQUEST *req, HTTP_HEADER *header) {
+    const char *buf = req->buf;
+
+    if (span_equals(buf, &header->name, "Connection")) {
+        if (span_contains_token(buf, &header->value, "keep-alive"))
+            req->keep_alive = 1;
+        else if (span_contains_token(buf, &header->value, "close"))
+            req->keep_alive = 0;
+    } else if (span_equals(buf, &header->name, "Content-Length")) {
+        long length = 0;
+        if (header->value.len == 0)
+            return -1;
+        for (int i = 0; i < header->value.len; i++) {
+            char c = buf[header->value.off + i];
+            if (c < '0' || c > '9' || length > (1L << 52))
+                return -1;
+            length = length * 10 + (c - '0');
+        }
+        if (req->content_length >= 0 && req->content_length != length)
+            return -1;
+        req->content_length = length;
+    } else if (span_equals(buf, &header->name, "Transfer-Encoding")) {
+        if (span_contains_token(buf, &header->value, "chunked"))
+            req->chunked = 1;
+    }
+    return 0;
+}
+
+static enum parse_results fail(HTTP_REQUEST *req, enum parse_results result) {
+    req->result = result;
+    return result;
+}
+
+/* Advances the parser over buf[req->pos..len). Every byte is looked at
+ * once, so calling this again after more data arrived costs only the new
+ * bytes.
+ */
+enum parse_results http_parse(HTTP_REQUEST *req, const char *buf, int len) {
+    req->buf = buf;
+    if (req->state == PS_DONE || req->result != PARSE_INCOMPLETE)
+        return req->result;
+
+    for (; req->pos < len; req->pos++) {
+        unsigned char c = buf[req->pos];
+        int pos = req->pos;
+
+        switch (req->state) {
+        case PS_METHOD:
+            if (c == ' ') {
+                req->method_name = (SPAN){req->start, pos - req->start};
+                if (req->method_name.len == 0)
+                    return fail(req, PARSE_ERROR);
+                req->method = method_of(buf, &req->method_name);
+                req->start = pos + 1;
+                req->state = PS_TARGET;
+            } else if (!is_tchar(c)) {
+                return fail(req, PARSE_ERROR);
+            }
+            break;
+
+        case PS_TARGET:
+        case PS_QUERY:
+            if (c == ' ' || c == '?') {
+                if (req->state == PS_QUERY && c == '?')
+                    break;
+                SPAN span = {req->start, pos - req->start};
+                if (req->state == PS_TARGET)
+                    req->path = span;
+                else
+                    req->query = span;
+                req->start = pos + 1;
+                req->state = c == '?' ? PS_QUERY : PS_VERSION;
+            } else if (c <= 0x20 || c == 0x7f) {
+                return fail(req, PARSE_ERROR);
+            }
+            break;
+
+        case PS_VERSION:
+            if (c == '\r' || c == '\n') {
+                req->version = (SPAN){req->start, pos - req->start};
+                if (req->path.len == 0 || buf[req->path.off] != '/' ||
+                    req->version.len != 8 ||
+                    strncmp(buf + req->version.off, "HTTP/1.", 7) != 0)
+                    return fail(req, PARSE_ERROR);
+                req->state = c == '\r' ? PS_REQUEST_LINE_LF : PS_HEADER_START;
+            }
+            break;
+
+        case PS_REQUEST_LINE_LF:
+        case PS_HEADER_LF:
+            if (c != '\n')
+                return fail(req, PARSE_ERROR);
+            req->state = PS_HEADER_START;
+            break;
+
+        case PS_HEADER_START:
+            if (c == '\r') {
+                req->state = PS_HEADERS_END_LF;
+            } else if (c == '\n') {
+                goto done;
+            } else if (is_tchar(c)) {
+                if (req->nheaders == MAX_HEADERS)
+                    return fail(req, PARSE_TOO_LARGE);
+                req->start = pos;
+                req->state = PS_HEADER_NAME;
+            } else {
+                return fail(req, PARSE_ERROR);
+            }
+            break;
+
+        case PS_HEADER_NAME:
+            if (c == ':') {
+                req->headers[req->nheaders].name =
+                    (SPAN){req->start, pos - req->start};
+                req->state = PS_HEADER_VALUE_START;
+            } else if (!is_tchar(c)) {
+                return fail(req, PARSE_ERROR);
+            }
+            break;
+
+        case PS_HEADER_VALUE_START:
+            if (c == ' ' || c == '\t')
+                break;
+            req->start = pos;
+            req->state = PS_HEADER_VALUE;
+            /* fall through */
+
+        case PS_HEADER_VALUE:
+            if (c == '\r' || c == '\n') {
+                HTTP_HEADER *header = &req->headers[req->nheaders];
+                int end = pos;
+                while (end > req->start &&
+                       (buf[end - 1] == ' ' || buf[end - 1] == '\t'))
+                    end--;
+                header->value = (SPAN){req->start, end - req->start};
+                req->nheaders++;
+                if (header_done(req, header) < 0)
+                    return fail(req, PARSE_ERROR);
+                req->state = c == '\r' ? PS_HEADER_LF : PS_HEADER_START;
+            } else if (c < 0x20 && c != '\t') {
+                return fail(req, PARSE_ERROR);
+            }
+            break;
+
+        case PS_HEADERS_END_LF:
+            if (c != '\n')
+                return fail(req, PARSE_ERROR);
+            goto done;
+
+        case PS_DONE:
+            break;
+        }
+    }
+    return PARSE_INCOMPLETE;
+
+done:
+    req->header_end = req->pos + 1;
+    req->pos++;
+    req->state = PS_DONE;
+    /* a body framed by both is ambiguous (request smuggling) */
+    if (req->chunked && req->content_length >= 0)
+        return fail(req, PARSE_ERROR);
+    req->result = PARSE_DONE;
+    return PARSE_DONE;
+}
+
+/* parses an IMF-fixdate ("Sun, 06 Nov 1994 08:49:37 GMT"), the only
+ * format senders may generate; returns -1 for anything else
+ */
+int http_date_parse(const char *buf, const SPAN *span, time_t *t) {
+    char date[64];
+    if (span->len >= (int)sizeof(date))
+        return -1;
+    memcpy(date, buf + span->off, span->len);
+    date[span->len] = '\0';
+
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    const char *end = strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if (end == NULL || *end != '\0')
+        return -1;
+    *t = timegm(&tm);
+    return 0;
+}
+
+size_t http_date_format(time_t t, char *out, size_t len) {
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    return strftime(out, len, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+void http_chunked_reset(CHUNKED *chunked) {
+    chunked->state = CS_SIZE;
+    chunked->left = 0;
+    chunked->digits = 0;
+}
+
+static int hex_value(unsigned char c) {
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    c = tolower(c);
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+/* Decodes the chunked body in in[0..len) in place: the data bytes are
+ * moved to the front of in and their number is returned, *consumed is set
+ * to the number of raw bytes used. Stops after the first run of data so a
+ * caller can hand it on, and at the end of the body (state CS_DONE).
+ * Returns -1 on malformed framing.
+ */
+long http_chunked_decode(CHUNKED *chunked, char *in, size_t len,
+                         size_t *consumed) {
+    size_t pos = 0;
+    long out = 0;
+
+    while (pos < len && chunked->state != CS_DONE) {
+        unsigned char c = in[pos];
+
+        switch (chunked->state) {
+        case CS_SIZE: {
+            int value = hex_value(c);
+            if (value >= 0) {
+                if (++chunked->digits > 15)
+                    return -1;
+                chunked->left = chunked->left * 16 + value;
+            } else if (chunked->digits == 0) {
+                return -1;
+            } else if (c == ';' || c == ' ' || c == '\t') {
+                chunked->state = CS_EXTENSION;
+            } else if (c == '\r') {
+                chunked->state = CS_SIZE_LF;
+            } else {
+                return -1;
+            }
+            pos++;
+            break;
+        }
+
+        case CS_EXTENSION: // ignored
+            if (c == '\r')
+                chunked->state = CS_SIZE_LF;
+            pos++;
+            break;
+
+        case CS_SIZE_LF:
+            if (c != '\n')
+                return -1;
+            chunked->digits = 0;
+            chunked->state =
+                chunked->left == 0 ? CS_TRAILER_START : CS_DATA;
+            pos++;
+            break;
+
+        case CS_DATA: {
+            size_t n = len - pos;
+            if ((long)n > chunked->left)
+                n = chunked->left;
+            memmove(in + out, in + pos, n);
+            out += n;
+            pos += n;
+            chunked->left -= n;
+            if (chunked->left == 0)
+                chunked->state = CS_DATA_CR;
+            *consumed = pos;
+            return out;
+        }
+
+        case CS_DATA_CR:
+            if (c != '\r')
+                return -1;
+            chunked->state = CS_DATA_LF;
+            pos++;
+            break;
+
+        case CS_DATA_LF:
+            if (c != '\n')
+                return -1;
+            chunked->state = CS_SIZE;
+            pos++;
+            break;
+
+        /* trailer fields are skipped, the body ends at an empty line */
+        case CS_TRAILER_START:
+            chunked->state = c == '\r' ? CS_END_LF : CS_TRAILER;
+            pos++;
+            break;
+
+        case CS_TRAILER:
+            if (c == '\r')
+                chunked->state = CS_TRAILER_LF;
+            pos++;
+            break;
+
+        case CS_TRAILER_LF:
+            if (c != '\n')
+                return -1;
+            chunked->state = CS_TRAILER_START;
+            pos++;
+            break;
+
+        case CS_END_LF:
+            if (c != '\n')
+                return -1;
+            chunked->state = CS_DONE;
+            pos++;
+            break;
+
+        case CS_DONE:
+            break;
+        }
+    }
+
+    *consumed = pos;
+    return out;
+}
@@ -0,0 +1,101 @@
+#ifndef HTTP_PARSER_H
+#define HTTP_PARSER_H
+
+#include <stddef.h>
+#include <time.h>
+
+#define MAX_HEADERS 32
+
+enum request_types { NONE = -1, GET = 0, HEAD = 1, POST = 2, DELETE = 3 };
+
+enum parse_states {
+    PS_METHOD,
+    PS_TARGET,
+    PS_QUERY,
+    PS_VERSION,
+    PS_REQUEST_LINE_LF,
+    PS_HEADER_START,
+    PS_HEADER_NAME,
+    PS_HEADER_VALUE_START,
+    PS_HEADER_VALUE,
+    PS_HEADER_LF,
+    PS_HEADERS_END_LF,
+    PS_DONE
+};
+
+enum parse_results {
+    PARSE_INCOMPLETE,
+    PARSE_DONE,
+    PARSE_ERROR,
+    PARSE_TOO_LARGE
+};
+
+enum chunk_states {
+    CS_SIZE,
+    CS_EXTENSION,
+    CS_SIZE_LF,
+    CS_DATA,
+    CS_DATA_CR,
+    CS_DATA_LF,
+    CS_TRAILER_START,
+    CS_TRAILER,
+    CS_TRAILER_LF,
+    CS_END_LF,
+    CS_DONE
+};
+
+/* state of a Transfer-Encoding: chunked body, kept between reads */
+typedef struct {
+    enum chunk_states state;
+    long left; // data bytes still to come in the current chunk
+    int digits;
+} CHUNKED;
+
+/* a token inside the request buffer */
+typedef struct {
+    int off;
+    int len;
+} SPAN;
+
+typedef struct {
+    SPAN name;
+    SPAN value;
+} HTTP_HEADER;
+
+/* The request line and headers, tokenized once into offsets of the
+ * connection's buffer. The parser keeps its state between calls, so a
+ * request can arrive over any number of reads.
+ */
+typedef struct {
+    const char *buf;
+    enum parse_states state;
+    enum parse_results result;
+    int pos;   // next byte to look at
+    int start; // start of the token being scanned
+
+    enum request_types method;
+    SPAN method_name;
+    SPAN path;
+    SPAN query;
+    SPAN version;
+    HTTP_HEADER headers[MAX_HEADERS];
+    int nheaders;
+
+    int header_end; // offset of the first body byte
+    long content_length; // -1 when not given
+    int chunked;
+    int keep_alive;
+} HTTP_REQUEST;
+
+void http_request_reset(HTTP_REQUEST *req);
+enum parse_results http_parse(HTTP_REQUEST *req, const char *buf, int len);
+const SPAN *http_header(const HTTP_REQUEST *req, const char *name);
+int span_equals(const char *buf, const SPAN *span, const char *str);
+int span_contains_token(const char *buf, const SPAN *span, const char *token);
+int http_date_parse(const char *buf, const SPAN *span, time_t *t);
+size_t http_date_format(time_t t, char *out, size_t len);
+void http_chunked_reset(CHUNKED *chunked);
+long http_chunked_decode(CHUNKED *chunked, char *in, size_t len,
+                         size_t *consumed);
+
+#endif
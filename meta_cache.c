@@ -0,0 +1,149 @@
+#include "meta_cache.h"
+#include "fs_watch.h"
+#include "hash.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define META_BUCKETS 256
+
+static atomic_int enabled = 0;
+static const char *home_dir = "";
+static size_t home_len = 0;
+static int home_fd = AT_FDCWD;
+
+static void destroy(CLOCK_NODE *node) {
+    META_ENTRY *entry = (META_ENTRY *)node;
+    if (entry->fd >= 0)
+        close(entry->fd);
+    free(atomic_load(&entry->head));
+    free(node->path);
+    free(entry);
+}
+
+/* same layout as the content cache, bounded by a number of entries */
+static CLOCK_CACHE cache = {.destroy = destroy};
+
+void meta_cache_release(META_ENTRY *entry) {
+    clock_node_release(&cache, &entry->node);
+}
+
+/* opens path relative to the HOME directory descriptor, so resolving it
+ * does not walk the HOME prefix again, and records its metadata
+ */
+static META_ENTRY *resolve(const char *path, uint64_t hash) {
+    const char *relative = path;
+    int dirfd = AT_FDCWD;
+    if (home_fd != AT_FDCWD && strncmp(path, home_dir, home_len) == 0 &&
+        path[home_len] == '/' && path[home_len + 1] != '\0') {
+        relative = path + home_len + 1;
+        dirfd = home_fd;
+    }
+
+    int fd = openat(dirfd, relative, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return NULL;
+    }
+
+    META_ENTRY *entry = calloc(1, sizeof(META_ENTRY));
+    char *copy = entry != NULL ? strdup(path) : NULL;
+    if (copy == NULL) {
+        free(entry);
+        close(fd);
+        return NULL;
+    }
+    clock_node_init(&entry->node, hash, copy, 1);
+    entry->fd = fd;
+    entry->size = st.st_size;
+    entry->mtime = st.st_mtim;
+    entry->ino = st.st_ino;
+    entry->dev = st.st_dev;
+    validators_init(&entry->validators, st.st_ino, st.st_size, st.st_mtim);
+    return entry;
+}
+
+/* Returns a referenced entry for a regular file, or NULL if there is none.
+ * A hit costs no system call at all, a miss opens and stats the file once
+ * and keeps the result until inotify reports a change.
+ */
+META_ENTRY *meta_cache_lookup(const char *path) {
+    if (path == NULL)
+        return NULL;
+
+    uint64_t hash = hash_path(path);
+    if (!enabled)
+        return resolve(path, hash);
+
+    CLOCK_SHARD *shard = clock_shard_of(&cache, hash);
+    META_ENTRY *entry =
+        (META_ENTRY *)clock_cache_get(&cache, shard, hash, path);
+    if (entry != NULL)
+        return entry;
+
+    unsigned int generation = atomic_load(&shard->generation);
+    if ((entry = resolve(path, hash)) == NULL || !fs_watch_covers(path))
+        return entry;
+
+    pthread_rwlock_wrlock(&shard->lock);
+    if (atomic_load(&shard->generation) == generation &&
+        clock_cache_lookup(&cache, shard, hash, path) == NULL)
+        clock_cache_insert(&cache, shard, &entry->node);
+    pthread_rwlock_unlock(&shard->lock);
+
+    return entry;
+}
+
+void meta_cache_invalidate(const char *path) {
+    if (!enabled || path == NULL)
+        return;
+
+    uint64_t hash = hash_path(path);
+    clock_cache_invalidate(&cache, clock_shard_of(&cache, hash), hash, path);
+}
+
+void meta_cache_invalidate_all(void) { clock_cache_clear(&cache); }
+
+void meta_cache_disable(void) {
+    enabled = 0;
+    meta_cache_invalidate_all();
+}
+
+/* Opens the HOME directory for openat() and sets the number of entries
+ * kept (0 disables caching, lookups then always go to the filesystem).
+ */
+int meta_cache_init(const char *home, int max_entries) {
+    home_dir = home;
+    home_len = strlen(home);
+    home_fd = open(home, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (home_fd < 0) {
+        perror(home);
+        home_fd = AT_FDCWD;
+        return -1;
+    }
+
+    if (max_entries > 0) {
+        if (clock_cache_init(&cache, META_SHARDS, META_BUCKETS,
+                             (max_entries + META_SHARDS - 1) / META_SHARDS,
+                             destroy) < 0)
+            return -1;
+        clock_cache_register_metrics(&cache, "cache=\"meta\"");
+        enabled = 1;
+    }
+    return 0;
+}
+
+void meta_cache_stats(FILE *fp) {
+    fprintf(fp,
+            "meta cache: entries %ld/%zu, hits %lu, misses %lu, "
+            "evictions %lu, invalidations %lu\n",
+            atomic_load(&cache.entries), cache.budget * META_SHARDS,
+            atomic_load(&cache.hits), atomic_load(&cache.misses),
+            atomic_load(&cache.evictions), atomic_load(&cache.invalidations));
+}
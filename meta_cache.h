@@ -0,0 +1,39 @@
+#ifndef META_CACHE_H
+#define META_CACHE_H
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "clock_cache.h"
+#include "header_block.h"
+#include "validators.h"
+
+#define META_SHARDS 16
+
+/* What a request needs to know about a file, plus a descriptor that stays
+ * open for as long as the entry lives. Readers share the descriptor and
+ * only use positional I/O on it.
+ */
+typedef struct meta_entry {
+    CLOCK_NODE node; // cost is 1, the cache is bounded by entries
+    int fd;
+    off_t size;
+    struct timespec mtime;
+    ino_t ino;
+    dev_t dev;
+    VALIDATORS validators;
+    HEADER_BLOCK *_Atomic head; // NULL until the first GET sent it
+} META_ENTRY;
+
+int meta_cache_init(const char *home, int max_entries);
+META_ENTRY *meta_cache_lookup(const char *path);
+void meta_cache_release(META_ENTRY *entry);
+void meta_cache_invalidate(const char *path);
+void meta_cache_invalidate_all(void);
+void meta_cache_disable(void);
+void meta_cache_stats(FILE *fp);
+
+#endif
@@ -0,0 +1,328 @@
+#include "metrics.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+int METRICS = 1;
+char *METRICS_PATH = "/metrics";
+
+static METRICS_SLOT *slots; // every thread that recorded something
+static pthread_mutex_t slots_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread METRICS_SLOT *slot;
+
+static const int status_codes[STATUS_CODES] = {200, 201, 204, 206, 304, 400,
+                                               404, 416, 431, 500, 501};
+static const char *method_names[METHODS] = {"other", "GET", "HEAD", "POST",
+                                            "DELETE"};
+static const char *phase_names[] = {"handshake", "header", "body", "idle",
+                                    "send"};
+static const struct {
+    const char *name;
+    const char *help;
+    int count; // observes plain numbers instead of nanoseconds
+} histogram_names[H_HISTOGRAMS] = {
+    {"https_handshake_duration_seconds", "TLS handshake duration.", 0},
+    {"https_request_duration_seconds",
+     "Time from a complete request to its queued response.", 0},
+    {"https_commit_batch_size", "Uploads synced by one group commit.", 1},
+    {"https_commit_duration_seconds",
+     "Time an upload waited for its data to reach the disk.", 0},
+};
+
+/* a series another module keeps, registered once and read at scrapes */
+typedef struct source {
+    const char *name;
+    const char *type;
+    const char *help;
+    const char *labels; // without the braces, or NULL
+    METRICS_READ read;
+    const void *source;
+    struct source *next;
+} SOURCE;
+
+static SOURCE *sources, **sources_tail = &sources;
+
+/* registers the calling thread's slot the first time it records; slots
+ * live as long as the process, like the threads that own them
+ */
+static METRICS_SLOT *own_slot(void) {
+    if (slot != NULL)
+        return slot;
+    METRICS_SLOT *s = aligned_alloc(alignof(METRICS_SLOT),
+                                    sizeof(METRICS_SLOT));
+    if (s == NULL)
+        return NULL;
+    memset(s, 0, sizeof(*s));
+    pthread_mutex_lock(&slots_lock);
+    s->next = slots;
+    slots = s;
+    pthread_mutex_unlock(&slots_lock);
+    return slot = s;
+}
+
+/* single writer: no locked instruction, readers see whole values */
+static void bump(atomic_ulong *counter, unsigned long n) {
+    atomic_store_explicit(
+        counter, atomic_load_explicit(counter, memory_order_relaxed) + n,
+        memory_order_relaxed);
+}
+
+static unsigned long load(atomic_ulong *counter) {
+    return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+unsigned long metrics_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+void metrics_add(enum counters counter, unsigned long n) {
+    METRICS_SLOT *s = own_slot();
+    if (s != NULL)
+        bump(&s->counters[counter], n);
+}
+
+void metrics_request(enum request_types rt) {
+    METRICS_SLOT *s = own_slot();
+    if (s != NULL)
+        bump(&s->requests[rt + 1], 1);
+}
+
+void metrics_status(int code) {
+    METRICS_SLOT *s = own_slot();
+    if (s == NULL)
+        return;
+    int i = 0;
+    while (i < STATUS_CODES && status_codes[i] != code)
+        i++;
+    bump(&s->statuses[i], 1);
+}
+
+void metrics_observe(enum histograms histogram, unsigned long value) {
+    METRICS_SLOT *s = own_slot();
+    if (s == NULL)
+        return;
+    unsigned long scaled = histogram_names[histogram].count ? value
+                                                            : value / 1000;
+    int bucket = scaled == 0 ? 0 : 64 - __builtin_clzl(scaled);
+    if (bucket > HIST_BUCKETS)
+        bucket = HIST_BUCKETS;
+    bump(&s->histograms[histogram].buckets[bucket], 1);
+    bump(&s->histograms[histogram].sum, value);
+}
+
+unsigned long metrics_read_atomic(const void *source) {
+    return atomic_load((atomic_ulong *)source);
+}
+
+/* Adds a series to every scrape, read from source when it runs. Series
+ * registered under the same name share one header, told apart by their
+ * labels. Strings are kept, not copied.
+ */
+void metrics_register(const char *name, const char *type, const char *help,
+                      const char *labels, METRICS_READ read,
+                      const void *source) {
+    SOURCE *src = malloc(sizeof(SOURCE));
+    if (src == NULL) {
+        perror("metrics");
+        return;
+    }
+    *src = (SOURCE){name, type, help, labels, read, source, NULL};
+    pthread_mutex_lock(&slots_lock);
+    *sources_tail = src;
+    sources_tail = &src->next;
+    pthread_mutex_unlock(&slots_lock);
+}
+
+/* whether a GET asks for the metrics instead of a file */
+int metrics_path(const HTTP_REQUEST *request) {
+    return METRICS && span_equals(request->buf, &request->path, METRICS_PATH);
+}
+
+static void put_header(STRBUF *sb, const char *name, const char *type,
+                       const char *help) {
+    strbuf_puts(sb, "# HELP ");
+    strbuf_puts(sb, name);
+    strbuf_puts(sb, " ");
+    strbuf_puts(sb, help);
+    strbuf_puts(sb, "\n# TYPE ");
+    strbuf_puts(sb, name);
+    strbuf_puts(sb, " ");
+    strbuf_puts(sb, type);
+    strbuf_puts(sb, "\n");
+}
+
+static void put_counter(STRBUF *sb, const char *name, const char *help,
+                        unsigned long value) {
+    put_header(sb, name, "counter", help);
+    strbuf_puts(sb, name);
+    strbuf_puts(sb, " ");
+    strbuf_putl(sb, value);
+    strbuf_puts(sb, "\n");
+}
+
+static void put_seconds(STRBUF *sb, unsigned long ns) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.9f", ns / 1e9);
+    strbuf_puts(sb, buf);
+}
+
+static void put_histogram(STRBUF *sb, int h, const unsigned long *buckets,
+                          unsigned long sum) {
+    const char *name = histogram_names[h].name;
+    int plain = histogram_names[h].count;
+    unsigned long count = 0;
+
+    put_header(sb, name, "histogram", histogram_names[h].help);
+    for (int i = 0; i <= HIST_BUCKETS; i++) {
+        count += buckets[i];
+        strbuf_puts(sb, name);
+        strbuf_puts(sb, "_bucket{le=\"");
+        if (i == HIST_BUCKETS)
+            strbuf_puts(sb, "+Inf");
+        else if (plain)
+            strbuf_putl(sb, (1UL << i) - 1); // le is inclusive
+        else
+            put_seconds(sb, (1UL << i) * 1000);
+        strbuf_puts(sb, "\"} ");
+        strbuf_putl(sb, count);
+        strbuf_puts(sb, "\n");
+    }
+    strbuf_puts(sb, name);
+    strbuf_puts(sb, "_sum ");
+    if (plain)
+        strbuf_putl(sb, sum);
+    else
+        put_seconds(sb, sum);
+    strbuf_puts(sb, "\n");
+    strbuf_puts(sb, name);
+    strbuf_puts(sb, "_count ");
+    strbuf_putl(sb, count);
+    strbuf_puts(sb, "\n");
+}
+
+/* the registered series, each name's header before the first of them */
+static void put_sources(STRBUF *sb) {
+    pthread_mutex_lock(&slots_lock);
+    for (SOURCE *src = sources; src != NULL; src = src->next) {
+        SOURCE *first = sources;
+        while (strcmp(first->name, src->name) != 0)
+            first = first->next;
+        if (first != src)
+            continue;
+
+        put_header(sb, src->name, src->type, src->help);
+        for (SOURCE *s = src; s != NULL; s = s->next) {
+            if (strcmp(s->name, src->name) != 0)
+                continue;
+            strbuf_puts(sb, s->name);
+            if (s->labels != NULL) {
+                strbuf_puts(sb, "{");
+                strbuf_puts(sb, s->labels);
+                strbuf_puts(sb, "}");
+            }
+            strbuf_puts(sb, " ");
+            strbuf_putl(sb, s->read(s->source));
+            strbuf_puts(sb, "\n");
+        }
+    }
+    pthread_mutex_unlock(&slots_lock);
+}
+
+/* Adds up the slots of all threads and formats them in the Prometheus
+ * text format, in the arena. Returns NULL when the arena ran out.
+ */
+const char *metrics_format(ARENA *arena, long *length) {
+    unsigned long counters[M_COUNTERS] = {0};
+    unsigned long requests[METHODS] = {0};
+    unsigned long statuses[STATUS_CODES + 1] = {0};
+    unsigned long buckets[H_HISTOGRAMS][HIST_BUCKETS + 1] = {{0}};
+    unsigned long sums[H_HISTOGRAMS] = {0};
+
+    pthread_mutex_lock(&slots_lock);
+    for (METRICS_SLOT *s = slots; s != NULL; s = s->next) {
+        for (int i = 0; i < M_COUNTERS; i++)
+            counters[i] += load(&s->counters[i]);
+        for (int i = 0; i < METHODS; i++)
+            requests[i] += load(&s->requests[i]);
+        for (int i = 0; i <= STATUS_CODES; i++)
+            statuses[i] += load(&s->statuses[i]);
+        for (int h = 0; h < H_HISTOGRAMS; h++) {
+            for (int i = 0; i <= HIST_BUCKETS; i++)
+                buckets[h][i] += load(&s->histograms[h].buckets[i]);
+            sums[h] += load(&s->histograms[h].sum);
+        }
+    }
+    pthread_mutex_unlock(&slots_lock);
+
+    STRBUF sb;
+    strbuf_init(&sb, arena, 4096);
+    put_counter(&sb, "https_accepts_total", "Connections accepted.",
+                counters[M_ACCEPTS]);
+    put_counter(&sb, "https_handshake_failures_total",
+                "TLS handshakes that failed.",
+                counters[M_HANDSHAKE_FAILURES]);
+    put_counter(&sb, "https_received_bytes_total",
+                "Bytes read from TLS connections.", counters[M_BYTES_IN]);
+    put_counter(&sb, "https_sent_bytes_total",
+                "Bytes written to TLS connections.", counters[M_BYTES_OUT]);
+    put_counter(&sb, "https_keepalive_reuse_total",
+                "Requests served on a connection that was used before.",
+                counters[M_KEEPALIVE_REUSE]);
+    put_counter(&sb, "https_access_log_dropped_total",
+                "Access log records dropped because the ring was full.",
+                counters[M_ACCESS_LOG_DROPS]);
+
+    put_header(&sb, "https_worker_busy_seconds_total", "counter",
+               "Time workers spent serving connections.");
+    strbuf_puts(&sb, "https_worker_busy_seconds_total ");
+    put_seconds(&sb, counters[M_BUSY_NS]);
+    strbuf_puts(&sb, "\n");
+
+    put_header(&sb, "https_timeouts_total", "counter",
+               "Connections closed by an expired deadline, by phase.");
+    for (int i = 0; i <= M_TIMEOUTS_SEND - M_TIMEOUTS; i++) {
+        strbuf_puts(&sb, "https_timeouts_total{phase=\"");
+        strbuf_puts(&sb, phase_names[i]);
+        strbuf_puts(&sb, "\"} ");
+        strbuf_putl(&sb, counters[M_TIMEOUTS + i]);
+        strbuf_puts(&sb, "\n");
+    }
+
+    put_header(&sb, "https_requests_total", "counter",
+               "Requests by method.");
+    for (int i = 0; i < METHODS; i++) {
+        strbuf_puts(&sb, "https_requests_total{method=\"");
+        strbuf_puts(&sb, method_names[i]);
+        strbuf_puts(&sb, "\"} ");
+        strbuf_putl(&sb, requests[i]);
+        strbuf_puts(&sb, "\n");
+    }
+
+    put_header(&sb, "https_responses_total", "counter",
+               "Responses by status code.");
+    for (int i = 0; i <= STATUS_CODES; i++) {
+        strbuf_puts(&sb, "https_responses_total{code=\"");
+        if (i < STATUS_CODES)
+            strbuf_putl(&sb, status_codes[i]);
+        else
+            strbuf_puts(&sb, "other");
+        strbuf_puts(&sb, "\"} ");
+        strbuf_putl(&sb, statuses[i]);
+        strbuf_puts(&sb, "\n");
+    }
+
+    for (int h = 0; h < H_HISTOGRAMS; h++)
+        put_histogram(&sb, h, buckets[h], sums[h]);
+
+    put_sources(&sb);
+
+    if (sb.failed)
+        return NULL;
+    *length = sb.len;
+    return sb.data;
+}
@@ -0,0 +1,78 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdalign.h>
+#include <stdatomic.h>
+
+#include "arena.h"
+#include "http_parser.h"
+
+extern int METRICS;
+extern char *METRICS_PATH;
+
+enum counters {
+    M_ACCEPTS,
+    M_HANDSHAKE_FAILURES,
+    M_BYTES_IN,
+    M_BYTES_OUT,
+    M_KEEPALIVE_REUSE, // requests on a connection that served one before
+    M_BUSY_NS,         // time workers spent serving connections
+    M_TIMEOUTS,        // expired deadlines, in enum conn_phases order
+    M_TIMEOUTS_HEADER,
+    M_TIMEOUTS_BODY,
+    M_TIMEOUTS_IDLE,
+    M_TIMEOUTS_SEND,
+    M_ACCESS_LOG_DROPS, // records that found the thread's ring full
+    M_COUNTERS
+};
+
+enum histograms {
+    H_HANDSHAKE,
+    H_REQUEST,
+    H_COMMIT_BATCH,   // uploads synced together, a count, not a duration
+    H_COMMIT_LATENCY, // from queueing an upload's sync to its completion
+    H_HISTOGRAMS
+};
+
+/* bucket i counts values below 2^i, microseconds for durations, the last
+ * one the rest
+ */
+#define HIST_BUCKETS 24
+
+#define STATUS_CODES 11 // the codes the server answers with, then "other"
+#define METHODS 5       // enum request_types, NONE first
+
+typedef struct {
+    atomic_ulong buckets[HIST_BUCKETS + 1];
+    atomic_ulong sum; // nanoseconds for durations
+} HISTOGRAM;
+
+/* The counters of one thread. Only that thread writes them, so recording
+ * is a plain load and store, and the slots are cache line aligned so that
+ * threads never share a line. A scrape adds up the slots of all threads.
+ */
+typedef struct metrics_slot {
+    alignas(64) atomic_ulong counters[M_COUNTERS];
+    atomic_ulong requests[METHODS];
+    atomic_ulong statuses[STATUS_CODES + 1];
+    HISTOGRAM histograms[H_HISTOGRAMS];
+    struct metrics_slot *next;
+} METRICS_SLOT;
+
+unsigned long metrics_now(void);
+void metrics_add(enum counters counter, unsigned long n);
+void metrics_request(enum request_types rt);
+void metrics_status(int code);
+void metrics_observe(enum histograms histogram, unsigned long value);
+
+/* reads a value another module keeps, at every scrape */
+typedef unsigned long (*METRICS_READ)(const void *source);
+unsigned long metrics_read_atomic(const void *source);
+void metrics_register(const char *name, const char *type, const char *help,
+                      const char *labels, METRICS_READ read,
+                      const void *source);
+
+int metrics_path(const HTTP_REQUEST *request);
+const char *metrics_format(ARENA *arena, long *length);
+
+#endif
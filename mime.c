@@ -0,0 +1,296 @@
+#include "mime.h"
+#include "hash.h"
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+typedef struct {
+    const char *ext; // lowercase, NULL for an empty slot
+    size_t len;
+    const char *type;
+    int order; // later entries replace earlier ones with the same ext
+} MIME_ENTRY;
+
+/* the types the server knows without a MIME_TYPES file */
+static const struct {
+    const char *ext;
+    const char *type;
+} builtin[] = {
+    {"txt", "text/plain"},
+    {"text", "text/plain"},
+    {"log", "text/plain"},
+    {"md", "text/markdown"},
+    {"c", "text/plain"},
+    {"h", "text/plain"},
+    {"sed", "text/plain"},
+    {"awk", "text/plain"},
+    {"html", "text/html"},
+    {"htm", "text/html"},
+    {"css", "text/css"},
+    {"csv", "text/csv"},
+    {"js", "text/javascript"},
+    {"mjs", "text/javascript"},
+    {"xml", "application/xml"},
+    {"xhtml", "application/xhtml+xml"},
+    {"json", "application/json"},
+    {"map", "application/json"},
+    {"jsonld", "application/ld+json"},
+    {"webmanifest", "application/manifest+json"},
+    {"wasm", "application/wasm"},
+    {"pdf", "application/pdf"},
+    {"rss", "application/rss+xml"},
+    {"atom", "application/atom+xml"},
+    {"zip", "application/zip"},
+    {"gz", "application/gzip"},
+    {"tar", "application/x-tar"},
+    {"bz2", "application/x-bzip2"},
+    {"xz", "application/x-xz"},
+    {"7z", "application/x-7z-compressed"},
+    {"bin", "application/octet-stream"},
+    {"jpeg", "image/jpeg"},
+    {"jpg", "image/jpeg"},
+    {"png", "image/png"},
+    {"gif", "image/gif"},
+    {"webp", "image/webp"},
+    {"avif", "image/avif"},
+    {"svg", "image/svg+xml"},
+    {"ico", "image/x-icon"},
+    {"bmp", "image/bmp"},
+    {"tif", "image/tiff"},
+    {"tiff", "image/tiff"},
+    {"woff", "font/woff"},
+    {"woff2", "font/woff2"},
+    {"ttf", "font/ttf"},
+    {"otf", "font/otf"},
+    {"mp3", "audio/mpeg"},
+    {"ogg", "audio/ogg"},
+    {"oga", "audio/ogg"},
+    {"wav", "audio/wav"},
+    {"flac", "audio/flac"},
+    {"m4a", "audio/mp4"},
+    {"mp4", "video/mp4"},
+    {"m4v", "video/mp4"},
+    {"webm", "video/webm"},
+    {"ogv", "video/ogg"},
+    {"mov", "video/quicktime"},
+    {"ts", "video/mp2t"},
+    {"m3u8", "application/vnd.apple.mpegurl"},
+};
+
+#define BUILTIN (int)(sizeof(builtin) / sizeof(builtin[0]))
+#define MAX_DISPLACEMENT 65536
+
+/* A perfect hash in two steps: the extension's hash picks a bucket, the
+ * bucket's displacement moves its extensions to slots no other extension
+ * uses. A lookup is one hash, two array reads and one comparison.
+ */
+static MIME_ENTRY *slots;
+static uint32_t *displacements;
+static uint64_t slot_mask, bucket_mask;
+
+/* FNV-1a over the lowercased extension */
+static uint64_t hash_ext(const char *ext, size_t len) {
+    uint64_t hash = FNV_OFFSET;
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = ext[i];
+        hash = fnv1a_byte(hash, c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c);
+    }
+    return hash;
+}
+
+static uint64_t slot_of(uint64_t hash, uint32_t displacement) {
+    hash ^= (displacement + 1) * 0x9e3779b97f4a7c15ULL;
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    return hash & slot_mask;
+}
+
+static uint64_t bucket_of(uint64_t hash) { return (hash >> 32) & bucket_mask; }
+
+const char *mime_type(const char *extension, size_t len) {
+    if (slots == NULL || len == 0 || len > MIME_EXT_MAX)
+        return NULL;
+    uint64_t hash = hash_ext(extension, len);
+    const MIME_ENTRY *entry =
+        &slots[slot_of(hash, displacements[bucket_of(hash)])];
+    if (entry->ext == NULL || entry->len != len ||
+        strncasecmp(entry->ext, extension, len) != 0)
+        return NULL;
+    return entry->type;
+}
+
+static int add_entry(MIME_ENTRY **keys, int *n, int *cap, const char *ext,
+                     size_t len, const char *type) {
+    if (*n == *cap) {
+        int grown = *cap ? *cap * 2 : 128;
+        MIME_ENTRY *more = realloc(*keys, grown * sizeof(MIME_ENTRY));
+        if (more == NULL)
+            return -1;
+        *keys = more;
+        *cap = grown;
+    }
+    (*keys)[*n] = (MIME_ENTRY){ext, len, type, *n};
+    (*n)++;
+    return 0;
+}
+
+/* reads "type ext ext ..." lines, '#' starts a comment */
+static int load_file(const char *path, MIME_ENTRY **keys, int *n, int *cap) {
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        perror(path);
+        return -1;
+    }
+    char line[1024];
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        line[strcspn(line, "#\n")] = '\0';
+        char *saveptr = NULL;
+        char *token = strtok_r(line, " \t\r", &saveptr);
+        if (token == NULL)
+            continue;
+        char *type = strdup(token);
+        if (type == NULL) {
+            fclose(fp);
+            return -1;
+        }
+        while ((token = strtok_r(NULL, " \t\r", &saveptr)) != NULL) {
+            size_t len = strlen(token);
+            if (len > MIME_EXT_MAX)
+                continue;
+            char *ext = strdup(token);
+            if (ext == NULL) {
+                fclose(fp);
+                return -1;
+            }
+            for (char *p = ext; *p; p++)
+                *p = tolower((unsigned char)*p);
+            if (add_entry(keys, n, cap, ext, len, type) < 0) {
+                fclose(fp);
+                return -1;
+            }
+        }
+    }
+    fclose(fp);
+    return 0;
+}
+
+/* by extension, the latest entry of each extension first */
+static int compare_keys(const void *a, const void *b) {
+    const MIME_ENTRY *x = a, *y = b;
+    int c = strcmp(x->ext, y->ext);
+    return c != 0 ? c : y->order - x->order;
+}
+
+static uint64_t next_pow2(uint64_t n) {
+    uint64_t size = 1;
+    while (size < n)
+        size <<= 1;
+    return size;
+}
+
+/* Places the keys into 2^k slots, buckets with the most keys first while
+ * most slots are free. start holds two arrays of one more int than there
+ * are buckets. Returns -1 when a bucket finds no displacement, the
+ * caller then retries with more slots.
+ */
+static int place(const MIME_ENTRY *keys, int n, MIME_ENTRY *table,
+                 uint32_t *disp, int *order, int *start) {
+    int nbuckets = bucket_mask + 1;
+    memset(start, 0, (nbuckets + 1) * sizeof(int));
+    for (int i = 0; i < n; i++)
+        start[bucket_of(hash_ext(keys[i].ext, keys[i].len)) + 1]++;
+    for (int b = 0; b < nbuckets; b++)
+        start[b + 1] += start[b];
+    int *fill = start + nbuckets + 1;
+    memcpy(fill, start, nbuckets * sizeof(int));
+    for (int i = 0; i < n; i++)
+        order[fill[bucket_of(hash_ext(keys[i].ext, keys[i].len))]++] = i;
+
+    int largest = 0;
+    for (int b = 0; b < nbuckets; b++)
+        if (start[b + 1] - start[b] > largest)
+            largest = start[b + 1] - start[b];
+
+    uint64_t used[largest > 0 ? largest : 1];
+    for (int size = largest; size > 0; size--) {
+        for (int b = 0; b < nbuckets; b++) {
+            if (start[b + 1] - start[b] != size)
+                continue;
+            uint32_t d = 0;
+            for (; d < MAX_DISPLACEMENT; d++) {
+                int ok = 1;
+                for (int k = 0; ok && k < size; k++) {
+                    const MIME_ENTRY *key = &keys[order[start[b] + k]];
+                    used[k] = slot_of(hash_ext(key->ext, key->len), d);
+                    ok = table[used[k]].ext == NULL;
+                    for (int j = 0; ok && j < k; j++)
+                        ok = used[j] != used[k];
+                }
+                if (ok)
+                    break;
+            }
+            if (d == MAX_DISPLACEMENT)
+                return -1;
+            disp[b] = d;
+            for (int k = 0; k < size; k++)
+                table[used[k]] = keys[order[start[b] + k]];
+        }
+    }
+    return 0;
+}
+
+int mime_init(const char *path) {
+    MIME_ENTRY *keys = NULL;
+    int n = 0, cap = 0;
+    for (int i = 0; i < BUILTIN; i++)
+        if (add_entry(&keys, &n, &cap, builtin[i].ext, strlen(builtin[i].ext),
+                      builtin[i].type) < 0)
+            goto fail;
+    if (path != NULL && load_file(path, &keys, &n, &cap) < 0)
+        goto fail;
+
+    qsort(keys, n, sizeof(MIME_ENTRY), compare_keys);
+    int unique = 0;
+    for (int i = 0; i < n; i++)
+        if (unique == 0 || strcmp(keys[unique - 1].ext, keys[i].ext) != 0)
+            keys[unique++] = keys[i];
+    n = unique;
+
+    int *order = malloc(n * sizeof(int));
+    if (order == NULL)
+        goto fail;
+    for (uint64_t size = next_pow2(2 * n); size <= (1u << 20); size <<= 1) {
+        slot_mask = size - 1;
+        bucket_mask = next_pow2(size / 4) - 1;
+        MIME_ENTRY *table = calloc(size, sizeof(MIME_ENTRY));
+        uint32_t *disp = calloc(bucket_mask + 1, sizeof(uint32_t));
+        int *start = malloc(2 * (bucket_mask + 2) * sizeof(int));
+        if (table == NULL || disp == NULL || start == NULL) {
+            free(table);
+            free(disp);
+            free(start);
+            break;
+        }
+        int placed = place(keys, n, table, disp, order, start);
+        free(start);
+        if (placed == 0) {
+            slots = table;
+            displacements = disp;
+            free(order);
+            free(keys);
+            return 0;
+        }
+        free(table);
+        free(disp);
+    }
+    free(order);
+fail:
+    fprintf(stderr, "could not build the MIME table\n");
+    free(keys);
+    return -1;
+}
@@ -0,0 +1,21 @@
+#ifndef MIME_H
+#define MIME_H
+
+#include <stddef.h>
+
+extern char *MIME_TYPES;
+
+#define MIME_EXT_MAX 16 // longer extensions are never looked up
+
+/* Builds the extension table from the built-in types and, when path is
+ * not NULL, a mime.types style file ("type ext ext ...") whose entries
+ * take precedence. Lookups are lock-free once it returned 0.
+ */
+int mime_init(const char *path);
+
+/* the media type for an extension without its '.', NULL when unknown;
+ * the same extension always yields the same pointer
+ */
+const char *mime_type(const char *extension, size_t len);
+
+#endif
@@ -0,0 +1,94 @@
+#include "path_lock.h"
+#include "hash.h"
+#include "metrics.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/* Paths hash to a fixed set of stripes: mutations of one path serialize,
+ * different paths only meet when they share a stripe.
+ */
+static PATH_LOCK *stripes;
+static unsigned int nstripes;
+
+/* the counters of every stripe added up, source is the field's offset */
+static unsigned long read_total(const void *source) {
+    size_t offset = (size_t)source;
+    unsigned long total = 0;
+    for (unsigned int i = 0; i < nstripes; i++)
+        total += atomic_load((atomic_ulong *)((char *)&stripes[i] + offset));
+    return total;
+}
+
+static PATH_LOCK *stripe_of(const char *path) {
+    return &stripes[hash_path(path) % nstripes];
+}
+
+int path_lock_init(int count) {
+    nstripes = count > 0 ? count : 1;
+    stripes = aligned_alloc(alignof(PATH_LOCK), sizeof(PATH_LOCK) * nstripes);
+    if (stripes == NULL) {
+        perror("path locks");
+        return -1;
+    }
+    for (unsigned int i = 0; i < nstripes; i++) {
+        pthread_rwlock_init(&stripes[i].lock, NULL);
+        atomic_init(&stripes[i].acquired, 0);
+        atomic_init(&stripes[i].contended, 0);
+    }
+    metrics_register("https_path_locks_acquired_total", "counter",
+                     "Path lock acquisitions.", NULL, read_total,
+                     (void *)offsetof(PATH_LOCK, acquired));
+    metrics_register("https_path_locks_contended_total", "counter",
+                     "Path lock acquisitions that waited for a holder.",
+                     NULL, read_total, (void *)offsetof(PATH_LOCK, contended));
+    return 0;
+}
+
+/* shared lock, for resolving a path without racing a replacement */
+PATH_LOCK *path_lock_read(const char *path) {
+    PATH_LOCK *stripe = stripe_of(path);
+    if (pthread_rwlock_tryrdlock(&stripe->lock) != 0) {
+        atomic_fetch_add(&stripe->contended, 1);
+        pthread_rwlock_rdlock(&stripe->lock);
+    }
+    atomic_fetch_add(&stripe->acquired, 1);
+    return stripe;
+}
+
+/* exclusive lock, for replacing or removing the file at path */
+PATH_LOCK *path_lock_write(const char *path) {
+    PATH_LOCK *stripe = stripe_of(path);
+    if (pthread_rwlock_trywrlock(&stripe->lock) != 0) {
+        atomic_fetch_add(&stripe->contended, 1);
+        pthread_rwlock_wrlock(&stripe->lock);
+    }
+    atomic_fetch_add(&stripe->acquired, 1);
+    return stripe;
+}
+
+void path_lock_release(PATH_LOCK *stripe) {
+    pthread_rwlock_unlock(&stripe->lock);
+}
+
+/* totals, plus every stripe that saw contention as index:count */
+void path_lock_stats(FILE *fp) {
+    unsigned long acquired = 0, contended = 0;
+    for (unsigned int i = 0; i < nstripes; i++) {
+        acquired += atomic_load(&stripes[i].acquired);
+        contended += atomic_load(&stripes[i].contended);
+    }
+    fprintf(fp, "path locks: stripes %u, acquired %lu, contended %lu\n",
+            nstripes, acquired, contended);
+    if (contended == 0)
+        return;
+
+    fprintf(fp, "  contended stripes:");
+    for (unsigned int i = 0; i < nstripes; i++) {
+        unsigned long count = atomic_load(&stripes[i].contended);
+        if (count > 0)
+            fprintf(fp, " %u:%lu", i, count);
+    }
+    fputc('\n', fp);
+}
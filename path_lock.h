@@ -0,0 +1,24 @@
+#ifndef PATH_LOCK_H
+#define PATH_LOCK_H
+
+#include <pthread.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdio.h>
+
+/* One stripe of the lock table, on its own cache line so that workers on
+ * unrelated paths do not bounce each other's lines.
+ */
+typedef struct {
+    alignas(64) pthread_rwlock_t lock;
+    atomic_ulong acquired;
+    atomic_ulong contended; // had to wait for another holder
+} PATH_LOCK;
+
+int path_lock_init(int stripes);
+PATH_LOCK *path_lock_read(const char *path);
+PATH_LOCK *path_lock_write(const char *path);
+void path_lock_release(PATH_LOCK *lock);
+void path_lock_stats(FILE *fp);
+
+#endif
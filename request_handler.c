@@ -1,209 +1,1025 @@
 #include "request_handler.h"
+#include "access_log.h"
+#include "alloc_count.h"
+#include "event_loop.h"
+#include "http2.h"
+#include "metrics.h"
 #include "request_impls.h"
+#include "tls_session.h"
+#include "uring_loop.h"
 
+#include <errno.h>
+#include <fcntl.h>
 #include <openssl/err.h>
 #include <openssl/ssl.h>
+#include <poll.h>
 #include <pthread.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#define MULTIPART_BOUNDARY "our_server_5f3a9c1e7b2d4068"
+
+static atomic_ulong ktls_sends;
+static atomic_ulong copy_sends;
+static atomic_ulong responses;
+static atomic_ulong ssl_writes;
+static atomic_ulong pipelined;
+static atomic_ulong request_allocs;
+static atomic_ulong blocks_built;
+static atomic_ulong blocks_reused;
+
 char *not_implemented =
     "HTTP/1.1 501 Not Implemented\r\nServer: my_webserver.com\r\n\
 Connection: close\r\nContent-Type: text/plain\r\n\
 Content-Length: 23\r\n\r\nMethod not implemented!";
 
-void cleanup_noexit(CONN *conn) {
+char *bad_request =
+    "HTTP/1.1 400 Bad Request\r\nServer: my_webserver.com\r\n\
+Connection: close\r\nContent-Type: text/plain\r\n\
+Content-Length: 12\r\n\r\nBad request!";
+
+char *header_too_large =
+    "HTTP/1.1 431 Request Header Fields Too Large\r\n\
+Server: my_webserver.com\r\nConnection: close\r\n\
+Content-Type: text/plain\r\nContent-Length: 25\r\n\r\n\
+Request header too large!";
+
+/* allocates a connection with a request buffer of MAX_REQUEST_SIZE bytes
+ * and the arena its requests are served from
+ */
+CONN *conn_new(SHARD *shard, int socket, SSL *ssl,
+               const struct sockaddr *peer, socklen_t peer_len) {
+    CONN *conn = (CONN *)malloc(sizeof(CONN));
+    if (conn == NULL)
+        return NULL;
+
+    conn->request = malloc(MAX_REQUEST_SIZE + 1);
+    if (conn->request == NULL) {
+        free(conn);
+        return NULL;
+    }
+    if (arena_init(&conn->arena, CONN_ARENA_SIZE) < 0) {
+        free(conn->request);
+        free(conn);
+        return NULL;
+    }
+
+    conn->socket = socket;
+    conn->ssl = ssl;
+    conn->shard = shard;
+    conn->epfd = -1;
+    conn->state = CONN_HANDSHAKE;
+    conn->bytes = 0;
+    conn->capacity = MAX_REQUEST_SIZE;
+    conn->h2 = NULL;
+    conn->io = NULL;
+    conn->accepted_at = metrics_now();
+    conn->served = 0;
+    conn->timer.next = NULL;
+    conn->timer.pprev = NULL;
+    conn->phase = PHASE_HANDSHAKE;
+    conn->peer_len = 0;
+    if (peer != NULL && peer_len > 0 && peer_len <= sizeof(conn->peer)) {
+        memcpy(&conn->peer, peer, peer_len);
+        conn->peer_len = peer_len;
+    }
+    http_request_reset(&conn->parsed);
+    atomic_fetch_add(&shard->active, 1);
+    return conn;
+}
+
+static void free_conn(CONN *conn) {
+    /* before the descriptor can be reused by another connection */
+    conn_deadline_cancel(conn);
+    atomic_fetch_sub(&conn->shard->active, 1);
+    http2_free(conn);
     SSL_shutdown(conn->ssl);
     SSL_free(conn->ssl);
+    uring_conn_free(conn);
+    /* whatever failed on the way out stays in the thread's error queue and
+     * would turn the next connection's SSL_get_error() into SSL_ERROR_SSL
+     */
+    ERR_clear_error();
     close(conn->socket);
+    free(conn->request);
+    arena_destroy(&conn->arena);
     free(conn);
 }
 
+void cleanup_noexit(CONN *conn) { free_conn(conn); }
+
+static unsigned long now_ms(void) { return metrics_now() / 1000000; }
+
+/* (re)starts the deadline of phase, a timeout of 0 disables it */
+void conn_deadline(CONN *conn, enum conn_phases phase) {
+    static int *timeouts[PHASES] = {&HANDSHAKE_TIMEOUT, &HEADER_TIMEOUT,
+                                    &BODY_TIMEOUT, &KEEPALIVE_TIMEOUT,
+                                    &SEND_TIMEOUT};
+    TIMER_WHEEL *wheel = &conn->shard->wheel;
+    int timeout = *timeouts[phase];
+    unsigned long now = now_ms();
+
+    pthread_mutex_lock(&wheel->lock);
+    conn->phase = phase;
+    conn->sent_at = now;
+    if (timeout > 0)
+        timer_arm(wheel, &conn->timer, now + timeout);
+    else
+        timer_cancel(wheel, &conn->timer);
+    pthread_mutex_unlock(&wheel->lock);
+}
+
+void conn_deadline_cancel(CONN *conn) {
+    TIMER_WHEEL *wheel = &conn->shard->wheel;
+    pthread_mutex_lock(&wheel->lock);
+    timer_cancel(wheel, &conn->timer);
+    pthread_mutex_unlock(&wheel->lock);
+}
+
+/* Pushes the send deadline back after a write made progress, so only a
+ * client that stops reading runs into it, however large the response. It
+ * is rearmed at most once a second to keep the wheel lock off each write.
+ */
+void conn_send_progress(CONN *conn) {
+    if (conn->phase == PHASE_SEND && SEND_TIMEOUT > 0 &&
+        now_ms() - conn->sent_at >= 1000)
+        conn_deadline(conn, PHASE_SEND);
+}
+
+/* Shuts down the sockets of the connections whose deadline passed. Whoever
+ * owns one, the event loop or a worker blocked in a read, sees the
+ * connection end and frees it as usual, so expiring never waits for a
+ * worker. The wheel lock keeps the connections from being freed meanwhile.
+ */
+void expire_connections(SHARD *shard) {
+    TIMER_WHEEL *wheel = &shard->wheel;
+
+    pthread_mutex_lock(&wheel->lock);
+    TIMER *timer = timer_wheel_advance(wheel, now_ms());
+    while (timer != NULL) {
+        CONN *conn = (CONN *)((char *)timer - offsetof(CONN, timer));
+        metrics_add(M_TIMEOUTS + conn->phase, 1);
+        shutdown(conn->socket, SHUT_RDWR);
+        timer = timer->next;
+    }
+    pthread_mutex_unlock(&wheel->lock);
+}
+
 void cleanup_exit(CONN *conn) {
-    SSL_shutdown(conn->ssl);
-    SSL_free(conn->ssl);
-    close(conn->socket);
-    free(conn);
+    free_conn(conn);
     pthread_exit((void *)EXIT_FAILURE);
 }
 
-void check_connection_type(char *request, int *keep_alive) {
-    // header field for connection
-    char *ka = strstr(request, "Connection: keep-alive");
-    char *cl = strstr(request, "Connection: close");
-
-    if (ka != NULL && ka < strstr(request, "\r\n\r\n"))
-        *keep_alive = 1;
-    else if (cl != NULL && cl < strstr(request, "\r\n\r\n"))
-        *keep_alive = 0;
-    else // if no connection header field given, assume close
-        *keep_alive = 0;
-}
-
-enum request_types check_request_type(char *request) {
-    char request_line[sizeof("DELETE")] = "";
-    strncpy(request_line, request, sizeof("DELETE"));
-    char *saveptr = NULL;
-    char *token = strtok_r(request_line, " ", &saveptr);
-
-    if (strcmp(token, "GET") == 0)
-        return GET;
-    if (strcmp(token, "HEAD") == 0)
-        return HEAD;
-    if (strcmp(token, "POST") == 0)
-        return POST;
-    if (strcmp(token, "DELETE") == 0)
-        return DELETE;
-    return NONE;
-}
-
-void generate_headers(char *headers, int keep_alive, char *content,
-                      enum request_types rt, int found, char *request,
-                      long file_size) {
-    // 22 for conversion int to str + \r\n
-    char itoa[sizeof("Content-Length: ") + 22] = "";
-    if (rt == HEAD)
-        sprintf(itoa, "Content-Length: %ld\r\n", file_size);
-    else if (content)
-        sprintf(itoa, "Content-Length: %ld\r\n", strlen(content));
-    else
-        sprintf(itoa, "Content-Length: 0\r\n");
+/* Content-Range of range, or the form for an unsatisfiable request with
+ * only the size when range is NULL
+ */
+static void put_content_range(STRBUF *sb, const BYTE_RANGE *range,
+                              off_t size) {
+    strbuf_puts(sb, "Content-Range: bytes ");
+    if (range != NULL) {
+        strbuf_putl(sb, range->start);
+        strbuf_puts(sb, "-");
+        strbuf_putl(sb, range->start + range->length - 1);
+    } else {
+        strbuf_puts(sb, "*");
+    }
+    strbuf_puts(sb, "/");
+    strbuf_putl(sb, size);
+    strbuf_puts(sb, "\r\n");
+}
+
+/* the header lines that do not depend on the connection, each ending in
+ * CRLF; a 304 carries no Content-Length and Content-Type of its own
+ */
+static void entity_headers(STRBUF *headers, long content_length,
+                           enum request_types rt, int found,
+                           const HTTP_REQUEST *request,
+                           const FILE_BODY *body) {
+    int file = (rt == GET || rt == HEAD) && found != 404;
+
+    if (found != 304) {
+        strbuf_puts(headers, "Content-Length: ");
+        strbuf_putl(headers, content_length);
+        strbuf_puts(headers, "\r\n");
+    }
+
+    if (file && found != 416) {
+        strbuf_puts(headers, "ETag: ");
+        strbuf_puts(headers, body->validators.etag);
+        strbuf_puts(headers, "\r\nLast-Modified: ");
+        strbuf_puts(headers, body->validators.last_modified);
+        strbuf_puts(headers, "\r\n");
+    }
+    if (rt == GET && found != 404)
+        strbuf_puts(headers, "Accept-Ranges: bytes\r\n");
+    if (rt == GET && body->encoding != NULL && found != 416) {
+        strbuf_puts(headers, "Content-Encoding: ");
+        strbuf_puts(headers, body->encoding);
+        strbuf_puts(headers, "\r\n");
+    }
+    if (rt == GET && body->vary)
+        strbuf_puts(headers, "Vary: Accept-Encoding\r\n");
+    if (rt == GET && found == 416)
+        put_content_range(headers, NULL, body->size);
+    else if (rt == GET && found == 206 && body->nranges == 1)
+        put_content_range(headers, &body->ranges[0], body->size);
+
+    if (found == 304)
+        return;
+    if (rt != GET || found == 404 || found == 416) {
+        strbuf_puts(headers, "Content-Type: text/plain\r\n");
+        return;
+    }
+    if (found == 206 && body->nranges > 1) {
+        strbuf_puts(headers, "Content-Type: multipart/byteranges; "
+                             "boundary=" MULTIPART_BOUNDARY "\r\n");
+        return;
+    }
 
-    strcat(headers, itoa);
+    strbuf_puts(headers, "Content-Type: ");
+    strbuf_puts(headers, content_type(request));
+    strbuf_puts(headers, "\r\n");
+}
 
+static void connection_header(STRBUF *headers, int keep_alive) {
     if (keep_alive)
-        strcat(headers, "Connection: keep-alive\r\n");
+        strbuf_puts(headers, "Connection: keep-alive\r\n");
     else
-        strcat(headers, "Connection: close\r\n");
+        strbuf_puts(headers, "Connection: close\r\n");
+}
 
-    if (rt != GET || found == 404) {
-        strcat(headers, "Content-Type: text/plain");
-        return;
+/* appends the header lines that describe the response, each ending in
+ * CRLF, Connection last
+ */
+void generate_headers(STRBUF *headers, int keep_alive, long content_length,
+                      enum request_types rt, int found,
+                      const HTTP_REQUEST *request, const FILE_BODY *body) {
+    entity_headers(headers, content_length, rt, found, request, body);
+    connection_header(headers, keep_alive);
+}
+
+/* Bodies that fit behind the header block are buffered before the request
+ * is handled, larger and chunked ones are streamed through read_body()
+ */
+static int body_buffered(CONN *conn) {
+    HTTP_REQUEST *req = &conn->parsed;
+    if (req->chunked || req->content_length < 0 ||
+        req->header_end + req->content_length > conn->capacity)
+        return 1;
+    return req->header_end + req->content_length <= conn->bytes;
+}
+
+/* Reads from the TLS connection and feeds the parser until a complete
+ * request is buffered in conn->request. Returns 1 when a request is ready
+ * (or could not be parsed, which handle_request answers), -1 on error or
+ * when the peer closed the connection, and 0 when a non-blocking socket has
+ * no more data, in which case *want holds the SSL_ERROR_WANT_READ/WANT_WRITE
+ * condition to wait for.
+ */
+int read_request(CONN *conn, int *want) {
+    *want = SSL_ERROR_NONE;
+    conn->request[conn->bytes] = 0;
+    while (1) {
+        enum parse_results result =
+            http_parse(&conn->parsed, conn->request, conn->bytes);
+        if (result == PARSE_ERROR || result == PARSE_TOO_LARGE)
+            return 1;
+        if (result == PARSE_DONE && body_buffered(conn))
+            return 1;
+
+        if (conn->bytes == conn->capacity) {
+            /* the header block does not fit into the buffer */
+            if (result != PARSE_DONE)
+                conn->parsed.result = PARSE_TOO_LARGE;
+            return 1;
+        }
+
+        int bytes = SSL_read(conn->ssl, conn->request + conn->bytes,
+                             conn->capacity - conn->bytes);
+        if (bytes <= 0) {
+            int err = SSL_get_error(conn->ssl, bytes);
+            if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) {
+                *want = err;
+                return 0;
+            }
+            return -1;
+        }
+        /* the header deadline runs from the first byte of the request */
+        if (conn->phase == PHASE_IDLE)
+            conn_deadline(conn, PHASE_HEADER);
+        metrics_add(M_BYTES_IN, bytes);
+        conn->bytes += bytes;
+        conn->request[conn->bytes] = 0;
     }
+}
 
-    // get file path
-    char *saveptr = NULL;
-    char *token = strtok_r(request, " ", &saveptr);
-    token = strtok_r(NULL, " ", &saveptr);
-    char *extension = strrchr(token, '.');
-    if (extension == NULL) {
-        strcat(headers, "Content-Type: text/plain");
-        return;
+/* Drops the request that was just served and gets the connection ready
+ * for the next one. Whatever the client pipelined behind it is moved to the
+ * front of the buffer instead of being discarded.
+ */
+static void reset_request(CONN *conn) {
+    HTTP_REQUEST *req = &conn->parsed;
+    int end = req->result == PARSE_DONE ? conn->body_pos : conn->bytes;
+
+    conn->bytes -= end;
+    memmove(conn->request, conn->request + end, conn->bytes);
+    conn->request[conn->bytes] = 0;
+    http_request_reset(req);
+    arena_reset(&conn->arena);
+}
+
+/* whether the next pipelined request is already complete in the buffer */
+static int request_buffered(CONN *conn) {
+    if (conn->bytes == 0)
+        return 0;
+    enum parse_results result =
+        http_parse(&conn->parsed, conn->request, conn->bytes);
+    if (result == PARSE_ERROR || result == PARSE_TOO_LARGE)
+        return 1;
+    return result == PARSE_DONE && body_buffered(conn);
+}
+
+/* waits for a non-blocking socket to become ready for whatever OpenSSL
+ * asked for, returns -1 if the SSL error is not a retryable one
+ */
+int ssl_wait(CONN *conn, int ret) {
+    int err = SSL_get_error(conn->ssl, ret);
+    if (conn->io != NULL)
+        return uring_wait(conn, err);
+    struct pollfd pfd = {conn->socket, 0, 0};
+    if (err == SSL_ERROR_WANT_WRITE)
+        pfd.events = POLLOUT;
+    else if (err == SSL_ERROR_WANT_READ)
+        pfd.events = POLLIN;
+    else
+        return -1;
+    if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+        return -1;
+    return 0;
+}
+
+/* SSL_write that also copes with non-blocking sockets by waiting for the
+ * socket to become ready whenever OpenSSL asks for it
+ */
+static int ssl_write_all(CONN *conn, const void *buf, int len) {
+    int bytes;
+    while ((bytes = SSL_write(conn->ssl, buf, len)) <= 0) {
+        if (ssl_wait(conn, bytes) < 0)
+            return -1;
+    }
+    /* the io_uring engine collects the records of one write in a send */
+    if (conn->io != NULL && uring_flush(conn) < 0)
+        return -1;
+    atomic_fetch_add(&ssl_writes, 1);
+    metrics_add(M_BYTES_OUT, bytes);
+    conn_send_progress(conn);
+    return bytes;
+}
+
+/* Responses are collected here and written together, so a batch of
+ * pipelined requests is answered with a few large TLS records instead of
+ * one or two small ones per request. A worker serves one connection at a
+ * time and always flushes before letting go of it, so the buffer is kept
+ * per worker rather than per connection.
+ */
+static __thread char *out_buf = NULL;
+static __thread int out_len = 0;
+
+int flush_responses(CONN *conn) {
+    if (out_len == 0)
+        return 0;
+    int ret = ssl_write_all(conn, out_buf, out_len);
+    out_len = 0;
+    return ret > 0 ? 0 : -1;
+}
+
+/* queues data behind the pending responses, flushing once FLUSH_THRESHOLD
+ * bytes are pending; data that would not fit is written out directly
+ */
+int queue_response(CONN *conn, const void *data, int len) {
+    if (out_buf == NULL && (out_buf = malloc(FLUSH_THRESHOLD)) == NULL) {
+        perror("out_buf");
+        return -1;
+    }
+    if (out_len + len > FLUSH_THRESHOLD && flush_responses(conn) < 0)
+        return -1;
+    if (len >= FLUSH_THRESHOLD)
+        return ssl_write_all(conn, data, len) > 0 ? 0 : -1;
+
+    memcpy(out_buf + out_len, data, len);
+    out_len += len;
+    if (out_len == FLUSH_THRESHOLD)
+        return flush_responses(conn);
+    return 0;
+}
+
+/* Gathers the parts of a response (header block, cached body) into the
+ * pending output. SSL has no writev(), so this is what keeps headers and
+ * small bodies in one record without assembling them first.
+ */
+static int queue_responsev(CONN *conn, const struct iovec *iov, int iovcnt) {
+    for (int i = 0; i < iovcnt; i++) {
+        if (iov[i].iov_len > 0 &&
+            queue_response(conn, iov[i].iov_base, iov[i].iov_len) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+static const char continue_100[] = "HTTP/1.1 100 Continue\r\n\r\n";
+
+/* sets up read_body() for the request that was just parsed */
+static void start_body(CONN *conn) {
+    HTTP_REQUEST *req = &conn->parsed;
+    conn->body_pos = req->header_end;
+    conn->body_left = req->content_length > 0 ? req->content_length : 0;
+    conn->continue_sent = 0;
+    http_chunked_reset(&conn->chunked);
+}
+
+static int body_done(CONN *conn) {
+    if (conn->parsed.chunked)
+        return conn->chunked.state == CS_DONE;
+    return conn->body_left == 0;
+}
+
+/* Reads more of the body into the buffer behind the header block, which
+ * stays intact for the handler. Pending responses are flushed first, the
+ * client may be waiting for them before it sends the rest.
+ */
+static int refill_body(CONN *conn) {
+    int start = conn->parsed.header_end;
+    if (start >= conn->capacity)
+        return -1;
+
+    const SPAN *expect = http_header(&conn->parsed, "Expect");
+    if (!conn->continue_sent && expect != NULL &&
+        span_equals(conn->request, expect, "100-continue")) {
+        conn->continue_sent = 1;
+        if (queue_response(conn, continue_100, sizeof(continue_100) - 1))
+            return -1;
+    }
+    if (flush_responses(conn) < 0)
+        return -1;
+
+    /* the body deadline only bounds the wait for more of it */
+    conn_deadline(conn, PHASE_BODY);
+    int bytes;
+    while ((bytes = SSL_read(conn->ssl, conn->request + start,
+                             conn->capacity - start)) <= 0) {
+        if (ssl_wait(conn, bytes) < 0)
+            return -1;
     }
-    // skip the '.' to avoid repetition
-    extension++;
-
-    if (strcmp(extension, "txt") == 0 || strcmp(extension, "sed") == 0 ||
-        strcmp(extension, "awk") == 0 || strcmp(extension, "c") == 0 ||
-        strcmp(extension, "h") == 0)
-        strcat(headers, "Content-Type: text/plain");
-    else if (strcmp(extension, "html") == 0 || strcmp(extension, "htm"))
-        strcat(headers, "Content-Type: text/html");
-    else if (strcmp(extension, "jpeg") == 0 || strcmp(extension, "jpg"))
-        strcat(headers, "Content-Type: image/jpeg");
-    else if (strcmp(extension, "gif") == 0)
-        strcat(headers, "Content-Type: image/gif");
+    conn_deadline(conn, PHASE_SEND);
+    metrics_add(M_BYTES_IN, bytes);
+    conn->bytes = start + bytes;
+    conn->body_pos = start;
+    conn->request[conn->bytes] = 0;
+    return 0;
+}
+
+/* BODY_READER callback: hands out the next piece of the request body from
+ * the connection buffer, decoding chunked framing in place
+ */
+static long read_body(void *arg, const char **data) {
+    CONN *conn = (CONN *)arg;
+
+    while (!body_done(conn)) {
+        if (conn->body_pos == conn->bytes && refill_body(conn) < 0)
+            return -1;
+
+        char *in = conn->request + conn->body_pos;
+        size_t avail = conn->bytes - conn->body_pos;
+        *data = in;
+
+        if (!conn->parsed.chunked) {
+            long n = (long)avail < conn->body_left ? (long)avail
+                                                   : conn->body_left;
+            conn->body_pos += n;
+            conn->body_left -= n;
+            return n;
+        }
+
+        size_t consumed;
+        long n = http_chunked_decode(&conn->chunked, in, avail, &consumed);
+        if (n < 0)
+            return -1;
+        conn->body_pos += consumed;
+        if (n > 0)
+            return n;
+    }
+    return 0;
+}
+
+/* reads past whatever part of the body the handler left unread, so the
+ * next pipelined request starts at body_pos
+ */
+static int skip_body(CONN *conn) {
+    const char *data;
+    long n;
+    while ((n = read_body(conn, &data)) > 0)
+        ;
+    return n;
+}
+
+#ifdef SSL_OP_ENABLE_KTLS
+/* With kernel TLS the record encryption happens in the kernel, so the file
+ * goes from the page cache to the socket without passing through userspace.
+ */
+static int send_file_ktls(CONN *conn, FILE_BODY *body) {
+    off_t offset = body->offset;
+    size_t left = body->length;
+
+    while (left > 0) {
+        ossl_ssize_t sent =
+            SSL_sendfile(conn->ssl, body->fd, offset, left, 0);
+        if (sent <= 0) {
+            if (ssl_wait(conn, sent) < 0)
+                return -1;
+            continue;
+        }
+        metrics_add(M_BYTES_OUT, sent);
+        conn_send_progress(conn);
+        offset += sent;
+        left -= sent;
+    }
+    return 0;
+}
+#endif
+
+/* Userspace fallback: stream the file through a fixed-size buffer, so the
+ * memory used per connection does not depend on the size of the file. Each
+ * worker serves one connection at a time and keeps its buffer for reuse.
+ */
+static int send_file_copy(CONN *conn, FILE_BODY *body) {
+    static __thread char *io_buf = NULL;
+    if (io_buf == NULL) {
+        if ((io_buf = malloc(IO_BUF_SIZE)) == NULL) {
+            perror("io_buf");
+            return -1;
+        }
+        if (CONN_ENGINE == ENGINE_URING)
+            uring_register_buffer(io_buf, IO_BUF_SIZE);
+    }
+
+    posix_fadvise(body->fd, body->offset, body->length,
+                  POSIX_FADV_SEQUENTIAL);
+
+    off_t offset = body->offset;
+    off_t left = body->length;
+    while (left > 0) {
+        size_t chunk = left < IO_BUF_SIZE ? (size_t)left : (size_t)IO_BUF_SIZE;
+        ssize_t bytes = conn->io != NULL
+                            ? uring_pread(body->fd, io_buf, chunk, offset)
+                            : pread(body->fd, io_buf, chunk, offset);
+        if (bytes <= 0) {
+            if (bytes < 0 && errno == EINTR)
+                continue;
+            perror("file read");
+            return -1;
+        }
+        if (ssl_write_all(conn, io_buf, bytes) <= 0)
+            return -1;
+        offset += bytes;
+        left -= bytes;
+    }
+    return 0;
+}
+
+/* sends a file body, using SSL_sendfile() when kernel TLS was negotiated
+ * for this connection and falling back to a userspace copy otherwise
+ */
+static int send_file_body(CONN *conn, FILE_BODY *body) {
+    if (body->length == 0)
+        return 0;
+    if (flush_responses(conn) < 0)
+        return -1;
+
+#ifdef SSL_OP_ENABLE_KTLS
+    if (KTLS && BIO_get_ktls_send(SSL_get_wbio(conn->ssl))) {
+        atomic_fetch_add(&ktls_sends, 1);
+        return send_file_ktls(conn, body);
+    }
+#endif
+
+    atomic_fetch_add(&copy_sends, 1);
+    return send_file_copy(conn, body);
+}
+
+void request_handler_stats(FILE *fp) {
+    fprintf(fp, "file bodies: ktls sendfile %lu, userspace copy %lu\n",
+            atomic_load(&ktls_sends), atomic_load(&copy_sends));
+    unsigned long served = atomic_load(&responses);
+    unsigned long allocs = atomic_load(&request_allocs);
+    fprintf(fp, "responses: %lu (%lu pipelined) in %lu SSL_write calls\n",
+            served, atomic_load(&pipelined), atomic_load(&ssl_writes));
+    fprintf(fp, "heap allocations: %lu while serving, %.2f per request\n",
+            allocs, served ? (double)allocs / served : 0.0);
+    fprintf(fp, "header blocks: %lu built, %lu reused\n",
+            atomic_load(&blocks_built), atomic_load(&blocks_reused));
+}
+
+/* Builds the part headers of a multipart/byteranges body in the arena:
+ * one per range followed by the closing delimiter. Returns the length of
+ * the whole body or -1 when the arena ran out.
+ */
+static long multipart_parts(const HTTP_REQUEST *request,
+                            const FILE_BODY *body, ARENA *arena,
+                            STRBUF *parts) {
+    long length = 0;
+    for (int i = 0; i <= body->nranges; i++) {
+        strbuf_init(&parts[i], arena, 128);
+        strbuf_puts(&parts[i], "\r\n--" MULTIPART_BOUNDARY);
+        if (i == body->nranges) {
+            strbuf_puts(&parts[i], "--\r\n");
+        } else {
+            strbuf_puts(&parts[i], "\r\nContent-Type: ");
+            strbuf_puts(&parts[i], content_type(request));
+            strbuf_puts(&parts[i], "\r\n");
+            put_content_range(&parts[i], &body->ranges[i], body->size);
+            strbuf_puts(&parts[i], "\r\n");
+            length += body->ranges[i].length;
+        }
+        if (parts[i].failed)
+            return -1;
+        length += parts[i].len;
+    }
+    return length;
+}
+
+/* sends every range behind its part header, each read at its offset */
+static int send_multipart(CONN *conn, FILE_BODY *body, const STRBUF *parts) {
+    for (int i = 0; i <= body->nranges; i++) {
+        if (queue_response(conn, parts[i].data, parts[i].len) < 0)
+            return -1;
+        if (i == body->nranges)
+            break;
+
+        BYTE_RANGE *range = &body->ranges[i];
+        if (body->cached != NULL) {
+            if (queue_response(conn, body->cached->data + range->start,
+                               range->length) < 0)
+                return -1;
+            continue;
+        }
+        FILE_BODY piece = *body;
+        piece.offset = range->start;
+        piece.length = range->length;
+        if (send_file_body(conn, &piece) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* Runs the handler for a parsed request and collects what the response is
+ * built from in res; the body holds its cache references until
+ * file_body_release(). Returns -1 when the arena ran out.
+ */
+int run_handler(HTTP_REQUEST *request, ARENA *arena, BODY_READER *reader,
+                RESPONSE *res) {
+    res->rt = request->method;
+    res->found = -1;
+    res->content_length = 0;
+    res->content = NULL;
+    res->body = (FILE_BODY){.fd = -1};
+    res->parts = NULL;
+
+    FILE_BODY *body = &res->body;
+    switch (res->rt) {
+    case GET:
+        /* generated like the other non-file bodies, as text/plain */
+        if (metrics_path(request)) {
+            res->rt = NONE;
+            if ((res->content = metrics_format(arena, &res->content_length)) ==
+                NULL)
+                return -1;
+            res->found = 200;
+            strcpy(res->status, RESPONSE_OK);
+            break;
+        }
+        res->found = _GET(request, arena, res->status, body);
+        res->content_length = body->length;
+        if (res->found == 206 && body->nranges > 1) {
+            res->parts =
+                arena_alloc(arena, sizeof(STRBUF) * (body->nranges + 1));
+            if (res->parts == NULL ||
+                (res->content_length = multipart_parts(
+                     request, body, arena, res->parts)) < 0) {
+                file_body_release(body);
+                return -1;
+            }
+        }
+        break;
+    case HEAD:
+        res->found = _HEAD(request, arena, res->status, body);
+        res->content_length = body->size;
+        break;
+    case POST:
+        res->found = _POST(request, arena, reader, res->status);
+        break;
+    case DELETE:
+        res->found = _DELETE(request, arena, res->status, &res->content);
+        if (res->content != NULL)
+            res->content_length = strlen(res->content);
+        break;
+    case NONE:
+        break;
+    }
+    return 0;
+}
+
+/* the slot of the entry whose header block a response can use: a 200
+ * GET for the whole of a cached file, an open file or a variant
+ */
+static HEADER_BLOCK *_Atomic *head_slot(const RESPONSE *res) {
+    const FILE_BODY *body = &res->body;
+    if (res->rt != GET || res->found != 200 || res->parts != NULL ||
+        res->content_length != body->size)
+        return NULL;
+    if (body->variant != NULL)
+        return &body->variant->head;
+    if (body->cached != NULL)
+        return &body->cached->head;
+    if (body->meta != NULL)
+        return &body->meta->head;
+    return NULL;
+}
+
+static int same_string(const char *a, const char *b) {
+    return a == b || (a != NULL && b != NULL && strcmp(a, b) == 0);
+}
+
+static int block_fits(const HEADER_BLOCK *block, const char *type,
+                      const FILE_BODY *body) {
+    return same_string(block->type, type) &&
+           same_string(block->encoding, body->encoding) &&
+           block->vary == body->vary;
+}
+
+/* keeps the header lines just formatted for the entry, the first
+ * response to get there wins
+ */
+static void publish_block(HEADER_BLOCK *_Atomic *slot, const char *type,
+                          const FILE_BODY *body, const char *data,
+                          size_t len) {
+    HEADER_BLOCK *block = malloc(sizeof(HEADER_BLOCK) + len);
+    if (block == NULL)
+        return;
+    block->type = type;
+    block->encoding = body->encoding;
+    block->vary = body->vary;
+    block->len = len;
+    memcpy(block->data, data, len);
+
+    HEADER_BLOCK *expected = NULL;
+    if (atomic_compare_exchange_strong(slot, &expected, block))
+        atomic_fetch_add(&blocks_built, 1);
     else
-        strcat(headers, "Content-Type: application/octet-stream");
+        free(block);
+}
+
+/* The status line and header block of an HTTP/1.1 response. A whole file
+ * GET copies the block kept with its cache entry and only appends the
+ * Connection line, the first one formats the block and keeps it.
+ */
+void response_head(STRBUF *headers, const RESPONSE *res, int keep_alive,
+                   const HTTP_REQUEST *request) {
+    HEADER_BLOCK *_Atomic *slot = head_slot(res);
+    const char *type = NULL;
+    HEADER_BLOCK *block = NULL;
+    if (slot != NULL) {
+        type = content_type(request);
+        block = atomic_load_explicit(slot, memory_order_acquire);
+    }
+
+    if (block != NULL && block_fits(block, type, &res->body)) {
+        strbuf_append(headers, block->data, block->len);
+        atomic_fetch_add(&blocks_reused, 1);
+    } else {
+        size_t start = headers->len;
+        strbuf_puts(headers, "HTTP/1.1 ");
+        strbuf_puts(headers, res->status);
+        strbuf_puts(headers, "\r\nServer: our_server.com\r\n");
+        entity_headers(headers, res->content_length, res->rt, res->found,
+                       request, &res->body);
+        if (slot != NULL && block == NULL && !headers->failed)
+            publish_block(slot, type, &res->body, headers->data + start,
+                          headers->len - start);
+    }
+    connection_header(headers, keep_alive);
+    strbuf_puts(headers, "\r\n");
+}
+
+/* the length of the body of a canned response */
+static long canned_body(const char *response) {
+    return strlen(strstr(response, "\r\n\r\n") + 4);
+}
+
+/* Builds and queues the response for the request buffered in
+ * conn->request, returns whether the connection can be kept alive. The
+ * header block is assembled in the connection's arena. status and bytes
+ * are what the access log records, 0 when no response was sent.
+ */
+static int serve_request(CONN *conn, int *status, long *bytes) {
+    HTTP_REQUEST *request = &conn->parsed;
+    ARENA *arena = &conn->arena;
+    BODY_READER reader = {read_body, conn};
+    RESPONSE res;
+
+    metrics_request(request->method);
+    if (request->result == PARSE_ERROR || request->result == PARSE_TOO_LARGE) {
+        char *error = request->result == PARSE_ERROR ? bad_request
+                                                     : header_too_large;
+        *status = request->result == PARSE_ERROR ? 400 : 431;
+        *bytes = canned_body(error);
+        metrics_status(*status);
+        queue_response(conn, error, strlen(error));
+        return 0;
+    }
+
+    int keep_alive = request->keep_alive;
+    if (request->method == NONE) {
+        *status = 501;
+        *bytes = canned_body(not_implemented);
+        metrics_status(501);
+        if (queue_response(conn, not_implemented, strlen(not_implemented)))
+            return 0;
+        return keep_alive && skip_body(conn) == 0;
+    }
+    if (run_handler(request, arena, &reader, &res) < 0)
+        return 0;
+    *status = atoi(res.status);
+    if (res.rt != HEAD && res.found != 304)
+        *bytes = res.content_length;
+    metrics_status(*status);
+    /* a body that broke off leaves the connection out of sync */
+    if (res.rt == POST && res.found == 400)
+        keep_alive = 0;
+
+    STRBUF headers;
+    strbuf_init(&headers, arena, 256);
+    response_head(&headers, &res, keep_alive, request);
+
+    /* file bodies are sent separately instead of being copied behind the
+     * headers, cached ones still go out with them when they fit below the
+     * flush threshold
+     */
+    FILE_BODY *body = &res.body;
+    struct iovec iov[2] = {{headers.data, headers.len}, {NULL, 0}};
+    if (res.content != NULL)
+        iov[1] = (struct iovec){(void *)res.content, res.content_length};
+    else if (body->cached != NULL && res.parts == NULL)
+        iov[1] = (struct iovec){body->cached->data + body->offset,
+                                body->length};
+    else if (body->variant != NULL)
+        iov[1] = (struct iovec){body->variant->data, body->length};
+
+    int ret = -1;
+    if (!headers.failed)
+        ret = queue_responsev(conn, iov, 2);
+    if (ret == 0 && res.parts != NULL)
+        ret = send_multipart(conn, body, res.parts);
+    else if (ret == 0 && body->fd >= 0)
+        ret = send_file_body(conn, body);
+    file_body_release(body);
+
+    if (ret < 0 || (keep_alive && skip_body(conn) < 0))
+        return 0;
+    return keep_alive;
+}
+
+/* hands the request to the access log writer, with the peer address the
+ * engine recorded when it accepted the connection
+ */
+void log_request(CONN *conn, const HTTP_REQUEST *request, int status,
+                 long bytes, unsigned long duration_ns) {
+    ACCESS_ENTRY entry = {
+        .peer = conn->peer_len ? (struct sockaddr *)&conn->peer : NULL,
+        .method = request->buf + request->method_name.off,
+        .method_len = request->method_name.len,
+        .path = request->buf + request->path.off,
+        .path_len = request->path.len,
+        .status = status,
+        .bytes = bytes,
+        .duration_ns = duration_ns,
+        .resumed = SSL_session_reused(conn->ssl),
+    };
+    access_log(&entry);
+}
+
+/* Serves the request buffered in conn->request and returns whether the
+ * connection should be kept alive for another request. The response is
+ * only flushed when no further pipelined request is already buffered, so
+ * back to back requests are answered in order with coalesced writes.
+ */
+int handle_request(CONN *conn) {
+    unsigned long allocs = alloc_count();
+    unsigned long start = metrics_now();
+    if (conn->served++ > 0)
+        metrics_add(M_KEEPALIVE_REUSE, 1);
+    start_body(conn);
+    /* from here the client only has to keep reading the response */
+    conn_deadline(conn, PHASE_SEND);
+    int status = 0;
+    long bytes = 0;
+    int keep_alive = serve_request(conn, &status, &bytes);
+    unsigned long elapsed = metrics_now() - start;
+    metrics_observe(H_REQUEST, elapsed);
+    if (ACCESS_LOG != NULL)
+        log_request(conn, &conn->parsed, status, bytes, elapsed);
+    atomic_fetch_add(&request_allocs, alloc_count() - allocs);
+    atomic_fetch_add(&responses, 1);
+    reset_request(conn);
+
+    if (keep_alive && request_buffered(conn)) {
+        atomic_fetch_add(&pipelined, 1);
+        return 1;
+    }
+    if (flush_responses(conn) < 0)
+        return 0;
+    if (keep_alive)
+        conn_deadline(conn, conn->bytes > 0 ? PHASE_HEADER : PHASE_IDLE);
+    return keep_alive;
+}
+
+/* The blocking TLS handshake of the threads engine, run by the worker so
+ * that a client that never sends its ClientHello does not hold up the
+ * accept loop. The handshake deadline still bounds the wait.
+ */
+static int worker_handshake(CONN *conn) {
+    if (SSL_accept(conn->ssl) <= 0) {
+        ERR_print_errors_fp(stderr);
+        metrics_add(M_HANDSHAKE_FAILURES, 1);
+        return -1;
+    }
+    metrics_observe(H_HANDSHAKE, metrics_now() - conn->accepted_at);
+    tls_session_handshake_done(conn->ssl);
+    conn->state = CONN_READING;
+    conn_deadline(conn, PHASE_IDLE);
+    return 0;
 }
 
 void *request_handler(void *arg) {
-    int index = *(int *)arg;
+    WORKER *worker = (WORKER *)arg;
     int err;
     if ((err = pthread_detach(pthread_self()))) {
         perror_thread("pthread_detach", err);
         pthread_exit((void *)EXIT_FAILURE);
     }
 
-    CONN *conn;
-    int bytes;
-    char request[BUF_SIZE];
+    CONN *conn = NULL;
     while (1) {
-        if ((err = pthread_mutex_lock(&mutex))) {
-            perror_thread("pthread_mutex_lock", err);
-            cleanup_exit(conn);
+        /* idle workers pick up the next connection from any ring */
+        conn = work_queue_pop(&worker->shard->queue, worker->index);
+        unsigned long busy = metrics_now();
+
+        if (conn->state == CONN_HANDSHAKE && worker_handshake(conn) < 0) {
+            cleanup_noexit(conn);
+            metrics_add(M_BUSY_NS, metrics_now() - busy);
+            continue;
         }
 
-        while (connections[index] == NULL) {
-            if ((err = pthread_cond_wait(&cond[index], &mutex))) {
-                perror_thread("pthread_cont_wait", err);
+        /* an HTTP/2 connection runs its own frame loop in the worker */
+        if (conn->h2 != NULL || http2_negotiated(conn->ssl)) {
+            if (!http2_serve(conn))
                 cleanup_noexit(conn);
-            }
+            metrics_add(M_BUSY_NS, metrics_now() - busy);
+            continue;
         }
 
-        conn = connections[index];
-        connections[index] = NULL;
-
-        if ((err = pthread_mutex_unlock(&mutex))) {
-            perror_thread("pthread_mutex_unlock", err);
-            cleanup_exit(conn);
+        /* the event loop only hands over connections with a complete
+         * request; keep-alive connections are served for as long as the
+         * next request is already buffered and then go back to the loop
+         */
+        if (CONN_ENGINE != ENGINE_THREADS) {
+            while (handle_request(conn)) {
+                if (!event_loop_resume(conn)) {
+                    conn = NULL;
+                    break;
+                }
+            }
+            if (conn != NULL)
+                cleanup_noexit(conn);
+            metrics_add(M_BUSY_NS, metrics_now() - busy);
+            continue;
         }
 
-        char *crlf = "\r\n";
-        int keep_alive = 0;
+        int keep_alive = 0, want;
         do {
-            char response[3 * BUF_SIZE] = "";
-            char response_status[BUF_SIZE] = "";
-            char headers[BUF_SIZE] = "Server: our_server.com\r\n";
-            char *content = NULL;
-
             /* get request */
-            bytes = SSL_read(conn->ssl, request, sizeof(request));
-            if (bytes > 0) {
-                request[bytes] = 0;
-                check_connection_type(request, &keep_alive);
-                enum request_types rt;
-                int found = -1;
-                long file_size = 0;
-
-                switch (rt = check_request_type(request)) {
-                case GET:
-                    found = _GET(request, response_status, &content);
-                    break;
-                case HEAD:
-                    found = _HEAD(request, response_status, &file_size);
-                    break;
-                case POST:
-                    _POST(request, response_status);
-                    break;
-                case DELETE:
-                    _DELETE(request, response_status, &content);
-                    break;
-                case NONE:
-                    SSL_write(conn->ssl, not_implemented,
-                              strlen(not_implemented));
-                    if (keep_alive)
-                        continue;
-                    if (!keep_alive)
-                        goto exit_loop;
-                }
-                // fprintf(stderr, "request:\n%s\n", request);
-                generate_headers(headers, keep_alive, content, rt, found,
-                                 request, file_size);
-
-                strcat(response, "HTTP/1.1 ");
-                strcat(response, response_status);
-                strcat(response, crlf);
-                strcat(response, headers);
-                strcat(response, crlf);
-                strcat(response, crlf);
-                if (content != NULL) {
-                    strcat(response, content);
-                    free(content);
-                }
-
-                SSL_write(conn->ssl, response, strlen(response));
-            } else {
+            if (read_request(conn, &want) <= 0) {
                 ERR_print_errors_fp(stderr);
+                break;
             }
+            keep_alive = handle_request(conn);
         } while (keep_alive);
-    exit_loop:
 
-        SSL_shutdown(conn->ssl);
-        SSL_free(conn->ssl);
-        close(conn->socket);
-        free(conn);
+        cleanup_noexit(conn);
+        metrics_add(M_BUSY_NS, metrics_now() - busy);
     }
 
     pthread_exit((void *)EXIT_SUCCESS);
@@ -4,22 +4,131 @@
 #include <openssl/err.h>
 #include <openssl/ssl.h>
 #include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+
+#include "arena.h"
+#include "http_parser.h"
+#include "request_impls.h"
+#include "timer_wheel.h"
+#include "work_queue.h"
 
 #define perror_thread(s, e) (fprintf(stderr, "%s: %s\n", s, strerror(e)))
 #define BUF_SIZE 2048
+#define CONN_ARENA_SIZE 4096
+
+enum engine_types { ENGINE_THREADS = 0, ENGINE_EPOLL = 1, ENGINE_URING = 2 };
+
+enum conn_states { CONN_HANDSHAKE, CONN_READING, CONN_PROCESSING };
+
+/* what a connection is waiting for, each with its own deadline */
+enum conn_phases {
+    PHASE_HANDSHAKE,
+    PHASE_HEADER, // part of a request header block arrived
+    PHASE_BODY,   // between two reads of a request body
+    PHASE_IDLE,   // no request started yet
+    PHASE_SEND,   // a response the client stopped reading
+    PHASES
+};
 
+/* A listener with its own accept loop, queue and workers. With more than
+ * one shard every listener is bound with SO_REUSEPORT and the kernel
+ * balances new connections between them.
+ */
 typedef struct {
+    int id;
+    int sock;
+    SSL_CTX *ctx;
+    WORK_QUEUE queue;
+    TIMER_WHEEL wheel; // deadlines of the shard's connections
+    int threads;
+    pthread_t tid; // accept loop or event loop
+    pthread_t *worker_tids;
+    struct worker *workers;
+
+    atomic_ulong accepted;
+    atomic_long active; // connections currently open
+    char labels[24];    // the shard's series on /metrics
+} SHARD;
+
+typedef struct worker {
+    SHARD *shard;
+    int index;
+} WORKER;
+
+typedef struct conn {
     int socket;
     SSL *ssl;
+    SHARD *shard;
+    int epfd; // owning epoll instance, -1 in the threads engine
+    enum conn_states state;
+    int bytes;    // bytes of the current request buffered in request
+    int capacity; // size of request, not counting the terminating NUL
+    char *request;
+    HTTP_REQUEST parsed;
+    int body_pos;   // next unread body byte in request
+    long body_left; // Content-Length bytes not yet read
+    CHUNKED chunked;
+    int continue_sent;
+    ARENA arena; // per-request allocations, reset after every response
+    struct h2_session *h2; // set once the connection speaks HTTP/2
+    struct uring_io *io;   // socket buffers of the io_uring engine, or NULL
+    unsigned long accepted_at; // metrics_now() when the socket was accepted
+    unsigned long served;      // requests answered on this connection
+    TIMER timer;               // the deadline of phase, in shard->wheel
+    enum conn_phases phase;
+    unsigned long sent_at; // ms of the last progress that moved PHASE_SEND
+    struct sockaddr_storage peer; // as accepted, for the access log
+    socklen_t peer_len;           // 0 when the address is unknown
+    struct conn *held; // next connection its event loop holds back
 } CONN;
 
-enum request_types { NONE = -1, GET = 0, HEAD = 1, POST = 2, DELETE = 3 };
+/* what a handler produced, everything the response is built from */
+typedef struct {
+    enum request_types rt;
+    int found;
+    char status[64];
+    long content_length;
+    const char *content; // a body that is not a file
+    FILE_BODY body;
+    STRBUF *parts; // multipart/byteranges part headers
+} RESPONSE;
 
-extern pthread_mutex_t mutex;
-extern pthread_cond_t *cond;
-extern CONN **connections;
+extern int CONN_ENGINE;
+extern int KTLS;
+extern int IO_BUF_SIZE;
+extern int MAX_REQUEST_SIZE;
+extern int FLUSH_THRESHOLD;
+extern int HANDSHAKE_TIMEOUT;
+extern int HEADER_TIMEOUT;
+extern int BODY_TIMEOUT;
+extern int KEEPALIVE_TIMEOUT;
+extern int SEND_TIMEOUT;
 
 void *request_handler(void *arg);
+CONN *conn_new(SHARD *shard, int socket, SSL *ssl,
+               const struct sockaddr *peer, socklen_t peer_len);
+void dispatch_connection(CONN *conn);
+int try_dispatch_connection(CONN *conn);
+void conn_deadline(CONN *conn, enum conn_phases phase);
+void conn_deadline_cancel(CONN *conn);
+void conn_send_progress(CONN *conn);
+void expire_connections(SHARD *shard);
+int read_request(CONN *conn, int *want);
+int handle_request(CONN *conn);
+int run_handler(HTTP_REQUEST *request, ARENA *arena, BODY_READER *reader,
+                RESPONSE *res);
+void generate_headers(STRBUF *headers, int keep_alive, long content_length,
+                      enum request_types rt, int found,
+                      const HTTP_REQUEST *request, const FILE_BODY *body);
+void response_head(STRBUF *headers, const RESPONSE *res, int keep_alive,
+                   const HTTP_REQUEST *request);
+void log_request(CONN *conn, const HTTP_REQUEST *request, int status,
+                 long bytes, unsigned long duration_ns);
+int queue_response(CONN *conn, const void *data, int len);
+int flush_responses(CONN *conn);
+int ssl_wait(CONN *conn, int ret);
+void request_handler_stats(FILE *fp);
 void cleanup_noexit(CONN *conn);
 void cleanup_exit(CONN *conn);
 
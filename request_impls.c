@@ -1,259 +1,654 @@
 #include "request_impls.h"
+#include "fs_watch.h"
+#include "group_commit.h"
+#include "mime.h"
+#include "path_lock.h"
 
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 extern char *HOME;
 
-static int file_exists(const char *path) { return access(path, F_OK); }
+static int file_exists(const char *path) { return access(path, F_OK) == 0; }
 
-static char *extract_filepath(const char *request, const char *type) {
-    if (request == NULL) {
-        return NULL;
-    }
+/* the media type for the extension of the request path */
+const char *content_type(const HTTP_REQUEST *request) {
+    const char *path = request->buf + request->path.off;
+    int i = request->path.len;
+    while (i > 0 && path[i - 1] != '.' && path[i - 1] != '/')
+        i--;
+    if (i == 0 || path[i - 1] != '.')
+        return "text/plain";
+    const char *type = mime_type(path + i, request->path.len - i);
+    return type != NULL ? type : "application/octet-stream";
+}
 
-    char *buffer = malloc(strlen(type) + 2); // 1 for space, 1 for \0
-    if (buffer == NULL) {
-        perror("buffer allocation in extract_filepath");
-        return NULL;
+/* whether the request path has no "." or ".." segment, openat() relative
+ * to HOME would follow those out of it
+ */
+static int path_confined(const char *path, int len) {
+    for (int i = 0; i < len; i++) {
+        if (path[i] != '/')
+            continue;
+        int seg = i + 1;
+        while (seg < len && path[seg] != '/')
+            seg++;
+        seg -= i + 1;
+        if ((seg == 1 && path[i + 1] == '.') ||
+            (seg == 2 && path[i + 1] == '.' && path[i + 2] == '.'))
+            return 0;
     }
-    strcpy(buffer, type);
-    strcat(buffer, " ");
+    return 1;
+}
 
-    const char *start = strstr(request, buffer);
-    if (start == NULL) {
+/* builds HOME followed by the path of the request target in the arena, or
+ * returns NULL for a target that would resolve outside HOME
+ */
+static char *extract_filepath(const HTTP_REQUEST *request, ARENA *arena) {
+    if (request == NULL || request->path.len == 0) {
         return NULL;
     }
-    start += strlen(buffer);
-    free(buffer);
-    const char *end = strstr(start, " HTTP/");
-    if (end == NULL) {
+    if (request->buf[request->path.off] != '/' ||
+        !path_confined(request->buf + request->path.off, request->path.len))
         return NULL;
-    }
 
-    size_t length = (end - 1) - start;
-    char *filepath = malloc(strlen(HOME) + 1 + length + 1);
+    size_t home_len = strlen(HOME);
+    size_t length = request->path.len;
+    char *filepath = arena_alloc(arena, home_len + length + 1);
     if (filepath == NULL) {
+        perror("filepath");
         return NULL;
     }
-    for (size_t i = 0; i < strlen(filepath); i++)
-        filepath[i] = '\0';
 
-    strcat(filepath, HOME);
-    strcat(filepath, "/");
-    strncat(filepath, start + 1, length);
-    filepath[strlen(HOME) + 1 + length] = '\0';
+    memcpy(filepath, HOME, home_len);
+    memcpy(filepath + home_len, request->buf + request->path.off, length);
+    filepath[home_len + length] = '\0';
 
     return filepath;
 }
 
-static int get_file(const char *path, char **content) {
-    FILE *fp;
-    long lsize;
+/* skips spaces and tabs, returns the number of digits read into *value */
+static int parse_offset(const char **p, const char *end, off_t *value) {
+    int digits = 0;
+    *value = 0;
+    while (*p < end && (**p == ' ' || **p == '\t'))
+        (*p)++;
+    while (*p < end && **p >= '0' && **p <= '9') {
+        if (++digits > 18)
+            return -1;
+        *value = *value * 10 + (*(*p)++ - '0');
+    }
+    while (*p < end && (**p == ' ' || **p == '\t'))
+        (*p)++;
+    return digits;
+}
+
+/* Parses "bytes=first-last, first-, -suffix" against a file of size bytes
+ * into body->ranges. Returns the number of satisfiable ranges, 0 when none
+ * is (416), or -1 when the header is to be ignored: malformed, another
+ * unit, or more ranges than MAX_RANGES.
+ */
+static int parse_ranges(const HTTP_REQUEST *request, const SPAN *range,
+                        off_t size, FILE_BODY *body) {
+    const char *p = request->buf + range->off;
+    const char *end = p + range->len;
+    if (range->len < 6 || strncasecmp(p, "bytes=", 6) != 0)
+        return -1;
+    p += 6;
+
+    int count = 0, specs = 0;
+    while (p < end) {
+        specs++;
+        off_t first = 0, last = size - 1;
+        int first_digits = parse_offset(&p, end, &first);
+        if (first_digits < 0 || p == end || *p++ != '-')
+            return -1;
+        off_t value;
+        int last_digits = parse_offset(&p, end, &value);
+        if (last_digits < 0 || (first_digits == 0 && last_digits == 0))
+            return -1;
+        if (p < end && *p++ != ',')
+            return -1;
+
+        if (first_digits == 0) { // suffix: the last value bytes
+            if (value == 0)
+                continue;
+            first = value < size ? size - value : 0;
+        } else if (last_digits > 0) {
+            if (value < first)
+                return -1;
+            if (value < last)
+                last = value;
+        }
+        if (first >= size)
+            continue; // not satisfiable, the others may be
 
-    fp = fopen(path, "rb");
-    if (!fp) {
-        perror("file");
+        if (count == MAX_RANGES)
+            return -1;
+        body->ranges[count++] = (BYTE_RANGE){first, last - first + 1};
+    }
+    return specs > 0 ? count : -1;
+}
+
+/* Looks for etag in a list of entity tags such as If-None-Match. The weak
+ * comparison ignores W/ prefixes, the strong one never matches a weak tag.
+ */
+static int etag_matches(const char *buf, const SPAN *list, const char *etag,
+                        int weak) {
+    const char *p = buf + list->off;
+    const char *end = p + list->len;
+    size_t etag_len = strlen(etag);
+
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+            p++;
+        const char *item = p;
+        while (p < end && *p != ',')
+            p++;
+        const char *item_end = p;
+        while (item_end > item &&
+               (item_end[-1] == ' ' || item_end[-1] == '\t'))
+            item_end--;
+
+        if (item_end - item == 1 && *item == '*')
+            return 1;
+        if (item_end - item > 2 && item[0] == 'W' && item[1] == '/') {
+            if (!weak)
+                continue;
+            item += 2;
+        }
+        if ((size_t)(item_end - item) == etag_len &&
+            memcmp(item, etag, etag_len) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+/* If-None-Match, or If-Modified-Since without it: whether the client's
+ * copy is current and a 304 is the answer
+ */
+static int not_modified(const HTTP_REQUEST *request, const VALIDATORS *v) {
+    const SPAN *if_none_match = http_header(request, "If-None-Match");
+    if (if_none_match != NULL)
+        return etag_matches(request->buf, if_none_match, v->etag, 1);
+
+    const SPAN *if_modified_since = http_header(request, "If-Modified-Since");
+    time_t date;
+    if (if_modified_since != NULL &&
+        http_date_parse(request->buf, if_modified_since, &date) == 0)
+        return v->mtime <= date;
+    return 0;
+}
+
+/* If-Range: the ranges only apply while the file is still the version the
+ * client has part of, compared strongly by entity tag or date
+ */
+static int if_range_matches(const HTTP_REQUEST *request,
+                            const VALIDATORS *v) {
+    const SPAN *if_range = http_header(request, "If-Range");
+    time_t date;
+    if (if_range == NULL)
+        return 1;
+    const char *value = request->buf + if_range->off;
+    if (if_range->len > 0 && (value[0] == '"' || value[0] == 'W'))
+        return etag_matches(request->buf, if_range, v->etag, 0);
+    if (http_date_parse(request->buf, if_range, &date) < 0)
         return 0;
+    return date == v->mtime;
+}
+
+/* turns a found file into a 304, 200, 206 or 416 answer */
+static int select_ranges(HTTP_REQUEST *request, FILE_BODY *body,
+                         char *response) {
+    if (not_modified(request, &body->validators)) {
+        body->length = 0;
+        strcpy(response, RESPONSE_NOT_MODIFIED);
+        return 304;
     }
 
-    fseek(fp, 0L, SEEK_END);
-    lsize = ftell(fp);
-    rewind(fp);
+    const SPAN *range = http_header(request, "Range");
+    int count = -1;
+    if (range != NULL && if_range_matches(request, &body->validators))
+        count = parse_ranges(request, range, body->size, body);
 
-    *content = calloc(1, lsize + 1);
-    if (!*content) {
-        fclose(fp);
-        fputs("memory alloc fails", stderr);
-        exit(1);
+    if (count < 0) {
+        body->offset = 0;
+        body->length = body->size;
+        strcpy(response, RESPONSE_OK);
+        return 200;
     }
+    if (count == 0) {
+        body->length = 0;
+        strcpy(response, RESPONSE_RANGE_NOT_SATISFIABLE);
+        return 416;
+    }
+
+    body->nranges = count;
+    body->offset = body->ranges[0].start;
+    body->length = body->ranges[0].length;
+    strcpy(response, RESPONSE_PARTIAL_CONTENT);
+    return 206;
+}
+
+void file_body_release(FILE_BODY *body) {
+    if (body->cached != NULL)
+        file_cache_release(body->cached);
+    if (body->meta != NULL)
+        meta_cache_release(body->meta);
+    if (body->variant != NULL)
+        compress_cache_release(body->variant);
+    body->cached = NULL;
+    body->meta = NULL;
+    body->variant = NULL;
+    body->fd = -1;
+}
 
-    if (1 != fread(*content, lsize, 1, fp)) {
-        fclose(fp);
-        free(content);
-        fputs("entire read fails", stderr);
-        exit(1);
+/* Finds the file at filepath for a GET, returns -1 if there is none. The
+ * body is sent from the descriptor kept open in the metadata cache, small
+ * files are also copied into the content cache unless only parts of them
+ * were asked for or the client's copy is current. Hits do not lock,
+ * cached content is immutable.
+ */
+static int resolve_body(HTTP_REQUEST *request, const char *filepath,
+                        FILE_BODY *body) {
+    if ((body->cached = file_cache_get(filepath)) != NULL) {
+        body->size = body->cached->size;
+        body->validators = body->cached->validators;
+        return 0;
     }
 
-    fclose(fp);
-    return 1;
+    int whole = http_header(request, "Range") == NULL;
+    PATH_LOCK *lock = path_lock_read(filepath);
+    META_ENTRY *meta = meta_cache_lookup(filepath);
+    if (meta != NULL && whole && !not_modified(request, &meta->validators))
+        body->cached = file_cache_load(filepath, meta->fd, meta->size,
+                                       &meta->validators);
+    path_lock_release(lock);
+    if (meta == NULL)
+        return -1;
+
+    body->size = meta->size;
+    body->validators = meta->validators;
+    if (body->cached != NULL) {
+        meta_cache_release(meta);
+    } else {
+        body->meta = meta;
+        body->fd = meta->fd;
+    }
+    return 0;
 }
 
-int _GET(char *request, char *response, char **content) {
-    if (request == NULL || response == NULL) {
-        strcpy(response, RESPONSE_NOT_FOUND);
-        return 404;
+/* whether the media type is listed in COMPRESS_TYPES; types compare
+ * without regard to case and the list may have spaces after its commas
+ */
+static int compressible(const char *type) {
+    size_t len = strlen(type);
+    for (const char *p = COMPRESS_TYPES; p != NULL && *p != '\0';) {
+        while (*p == ' ' || *p == '\t')
+            p++;
+        const char *end = strchr(p, ',');
+        size_t item = end != NULL ? (size_t)(end - p) : strlen(p);
+        while (item > 0 && (p[item - 1] == ' ' || p[item - 1] == '\t'))
+            item--;
+        if (item == len && strncasecmp(p, type, len) == 0)
+            return 1;
+        p = end != NULL ? end + 1 : NULL;
     }
-    char *filepath;
-    filepath = extract_filepath(request, "GET");
-    // fprintf(stderr, "filepath:%s\n", filepath);
-    if (file_exists(filepath) == 1) {
+    return 0;
+}
 
-        if (get_file(filepath, content) == 1) {
-            strcpy(response, RESPONSE_OK);
-            return 204;
-        } else {
-            strcpy(response, RESPONSE_NOT_FOUND);
-            return 404;
+/* gzip or deflate if Accept-Encoding allows it (q not 0), gzip first */
+static enum encodings accepted_encoding(const HTTP_REQUEST *request) {
+    const SPAN *accept = http_header(request, "Accept-Encoding");
+    if (accept == NULL)
+        return ENC_IDENTITY;
+
+    const char *p = request->buf + accept->off;
+    const char *end = p + accept->len;
+    int gzip = 0, deflate = 0;
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+            p++;
+        const char *name = p;
+        while (p < end && *p != ',' && *p != ';' && *p != ' ')
+            p++;
+        size_t name_len = p - name;
+
+        int rejected = 0;
+        while (p < end && *p != ',') {
+            if (*p == 'q' && p + 1 < end && p[1] == '=') {
+                rejected = 1;
+                for (p += 2; p < end && *p != ',' && *p != ';'; p++)
+                    if (*p != '0' && *p != '.' && *p != ' ')
+                        rejected = 0;
+                continue;
+            }
+            p++;
         }
-    } else {
-        strcpy(response, RESPONSE_NOT_FOUND);
-        return 404;
+        if (rejected)
+            continue;
+
+        if ((name_len == 4 && strncasecmp(name, "gzip", 4) == 0) ||
+            (name_len == 6 && strncasecmp(name, "x-gzip", 6) == 0) ||
+            (name_len == 1 && *name == '*'))
+            gzip = 1;
+        else if (name_len == 7 && strncasecmp(name, "deflate", 7) == 0)
+            deflate = 1;
     }
+    return gzip ? ENC_GZIP : deflate ? ENC_DEFLATE : ENC_IDENTITY;
 }
 
-static long file_head(const char *path) {
-    FILE *fp;
-    long lsize = -1;
+/* serves "path.gz" in place of the file if it exists */
+static int use_sibling(HTTP_REQUEST *request, ARENA *arena,
+                       const char *filepath, FILE_BODY *body) {
+    size_t len = strlen(filepath);
+    char *gz = arena_alloc(arena, len + sizeof(".gz"));
+    if (gz == NULL)
+        return 0;
+    memcpy(gz, filepath, len);
+    memcpy(gz + len, ".gz", sizeof(".gz"));
 
-    fp = fopen(path, "rb");
-    if (!fp) {
-        perror("file");
+    FILE_BODY sibling = {.fd = -1};
+    if (resolve_body(request, gz, &sibling) < 0)
         return 0;
+    file_body_release(body);
+    *body = sibling;
+    return 1;
+}
+
+/* Replaces the body of a whole-file GET with a gzip or deflate encoding
+ * when the client takes one and the type is configured for it: a
+ * precompressed ".gz" sibling when there is one, otherwise the file is
+ * compressed once per version and kept in the compressed variant cache.
+ */
+static void negotiate_encoding(HTTP_REQUEST *request, ARENA *arena,
+                               const char *filepath, FILE_BODY *body) {
+    if (http_header(request, "Range") != NULL ||
+        body->size < COMPRESS_MIN_SIZE || !compressible(content_type(request)))
+        return;
+    body->vary = 1;
+
+    enum encodings encoding = accepted_encoding(request);
+    if (encoding == ENC_IDENTITY)
+        return;
+
+    COMPRESS_ENTRY *variant =
+        compress_cache_get(filepath, encoding, &body->validators);
+    if (variant == NULL && encoding == ENC_GZIP && GZIP_STATIC &&
+        use_sibling(request, arena, filepath, body)) {
+        body->encoding = "gzip";
+        body->vary = 1;
+        return;
+    }
+    if (variant == NULL) {
+        /* a client that has the variant already gets its 304 without the
+         * file being compressed for it
+         */
+        VALIDATORS validators;
+        compress_validators(&validators, &body->validators, encoding);
+        if (not_modified(request, &validators)) {
+            body->validators = validators;
+            body->encoding = encoding == ENC_GZIP ? "gzip" : "deflate";
+            return;
+        }
+        variant = compress_cache_load(
+            filepath, encoding, &body->validators,
+            body->cached != NULL ? body->cached->data : NULL, body->fd,
+            body->size);
+    }
+    if (variant == NULL)
+        return;
+    if (variant->data == NULL) { // does not get smaller
+        compress_cache_release(variant);
+        return;
     }
 
-    fseek(fp, 0L, SEEK_END);
-    lsize = ftell(fp);
-    long *f_size = malloc(sizeof(int *));
-    *f_size = lsize;
-    return *f_size;
+    file_body_release(body);
+    body->variant = variant;
+    body->size = variant->size;
+    body->validators = variant->validators;
+    body->encoding = encoding == ENC_GZIP ? "gzip" : "deflate";
+}
+
+int _GET(HTTP_REQUEST *request, ARENA *arena, char *response,
+         FILE_BODY *body) {
+    if (request == NULL || response == NULL) {
+        strcpy(response, RESPONSE_NOT_FOUND);
+        return 404;
+    }
+    char *filepath;
+    filepath = extract_filepath(request, arena);
+    if (filepath == NULL || resolve_body(request, filepath, body) < 0) {
+        strcpy(response, RESPONSE_NOT_FOUND);
+        return 404;
+    }
+    // fprintf(stderr, "filepath:%s\n", filepath);
+    negotiate_encoding(request, arena, filepath, body);
+    return select_ranges(request, body, response);
 }
 
-int _HEAD(char *request, char *response, long *f_size) {
+int _HEAD(HTTP_REQUEST *request, ARENA *arena, char *response,
+          FILE_BODY *body) {
 
     if (request == NULL || response == NULL) {
         strcpy(response, RESPONSE_NOT_FOUND);
         return 404;
     }
     char *filepath;
-    filepath = extract_filepath(request, "HEAD");
-    if (file_exists(filepath) == 1) {
-        *f_size = file_head(filepath);
-        if (*f_size != -1) {
-            strcpy(response, RESPONSE_OK);
-            return 204;
-        } else {
-            strcpy(response, RESPONSE_NOT_FOUND);
-            return 404;
+    filepath = extract_filepath(request, arena);
+    if (filepath == NULL) {
+        strcpy(response, RESPONSE_NOT_FOUND);
+        return 404;
+    }
+    /* answered from the metadata cache without touching the filesystem */
+    PATH_LOCK *lock = path_lock_read(filepath);
+    META_ENTRY *meta = meta_cache_lookup(filepath);
+    path_lock_release(lock);
+    if (meta != NULL) {
+        body->size = meta->size;
+        body->validators = meta->validators;
+        meta_cache_release(meta);
+        if (not_modified(request, &body->validators)) {
+            strcpy(response, RESPONSE_NOT_MODIFIED);
+            return 304;
         }
+        strcpy(response, RESPONSE_OK);
+        return 200;
     } else {
         strcpy(response, RESPONSE_NOT_FOUND);
         return 404;
     }
 }
 
-static int extractcontent(char *request, char **content) {
-    if (request == NULL) {
-        return 0;
+/* mkdir -p for the directories between HOME and the file, path is
+ * modified while walking it and restored afterwards
+ */
+static int create_directories_for_file(char *path) {
+    for (char *slash = strchr(path + strlen(HOME) + 1, '/'); slash != NULL;
+         slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        int ret = mkdir(path, 0755);
+        *slash = '/';
+        if (ret < 0 && errno != EEXIST) {
+            perror("mkdir");
+            return -1;
+        }
     }
-    const char *body_start = strstr(request, "\r\n\r\n");
-    if (body_start) {
-        body_start += 4;
-        *content = strdup(body_start);
-        return 1;
-    } else {
-        *content = NULL;
-        return 0;
+    return 0;
+}
+
+static int write_all(int fd, const char *data, long len) {
+    while (len > 0) {
+        ssize_t bytes = write(fd, data, len);
+        if (bytes < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        data += bytes;
+        len -= bytes;
     }
-    return 1;
+    return 0;
 }
 
-static int create_directories_for_file(const char *path) {
-    char directories[256] = "";
-    strcpy(directories, path);
-    char *last_slash = strrchr(directories, '/');
-    directories[last_slash - directories] = '\0';
+/* "dir/.name.XXXXXX" next to path, for mkstemp() */
+static char *temp_path(const char *path, ARENA *arena) {
+    const char *name = strrchr(path, '/') + 1;
+    size_t dir_len = name - path;
+    char *tmp = arena_alloc(arena, strlen(path) + sizeof(".") +
+                                       sizeof(".XXXXXX"));
+    if (tmp == NULL)
+        return NULL;
+    memcpy(tmp, path, dir_len);
+    sprintf(tmp + dir_len, ".%s.XXXXXX", name);
+    return tmp;
+}
 
-    char command[300] = "mkdir -p ";
-    strcat(command, directories);
-    // fprintf(stderr, "command:%s\n", command);
-    system(command);
-    return 0;
+/* makes the rename durable, a directory entry is only on disk once the
+ * directory itself has been synced
+ */
+static int sync_parent(char *path) {
+    char *slash = strrchr(path, '/');
+    *slash = '\0';
+    int fd = open(path, O_RDONLY | O_DIRECTORY);
+    *slash = '/';
+    if (fd < 0) {
+        perror("open directory");
+        return -1;
+    }
+    int ret = group_commit_sync(fd);
+    close(fd);
+    return ret;
 }
 
-int _POST(char *request, char *response) {
-    char *content;
+/* Streams the request body into the file piece by piece, so the memory
+ * used does not depend on the size of the upload.
+ */
+int _POST(HTTP_REQUEST *request, ARENA *arena, BODY_READER *body,
+          char *response) {
     if (request == NULL || response == NULL) {
         strcpy(response, RESPONSE_NOT_FOUND);
         return 404;
     }
     char *filepath;
-    filepath = extract_filepath(request, "POST");
-    int err_val = extractcontent(request, &content);
-    if (err_val == 0) {
-        perror("extractcontent");
+    filepath = extract_filepath(request, arena);
+    if (filepath == NULL) {
+        strcpy(response, RESPONSE_BAD_REQUEST);
+        return 400;
+    }
+
+    /* The body goes to a temporary file that is renamed over the target,
+     * so readers see either the old or the new content and descriptors
+     * already handed out keep serving the old inode. extract_filepath()
+     * already refused targets that leave HOME.
+     */
+    if (!file_exists(filepath) && create_directories_for_file(filepath) < 0) {
         strcpy(response, RESPONSE_INTERNAL_ERROR);
         return 500;
     }
-    if (file_exists(filepath) == 1) {
-        remove(filepath);
-        FILE *file = fopen(filepath, "w");
-        if (file == NULL) {
-            perror("file");
-            return -1;
+    char *tmppath = temp_path(filepath, arena);
+    int fd = tmppath != NULL ? mkstemp(tmppath) : -1;
+    if (fd < 0 || fchmod(fd, 0644) < 0) {
+        perror("temp file");
+        if (fd >= 0) {
+            close(fd);
+            unlink(tmppath);
         }
-        fprintf(file, "%s", content);
-        fclose(file);
-        strcpy(response, RESPONSE_CREATED);
-        return 201;
-    } else {
-        create_directories_for_file(filepath);
-        FILE *file = fopen(filepath, "w");
-        if (file == NULL) {
-            perror("file");
-            return -1;
+        strcpy(response, RESPONSE_INTERNAL_ERROR);
+        return 500;
+    }
+
+    const char *data;
+    long bytes;
+    int status = 201;
+    while ((bytes = body->read(body->ctx, &data)) > 0) {
+        if (write_all(fd, data, bytes) < 0) {
+            perror("file write");
+            status = 500;
+            break;
         }
-        fprintf(file, "%s", content);
-        fclose(file);
-        strcpy(response, RESPONSE_CREATED);
-        return 201;
     }
+    if (bytes < 0)
+        status = 400; // incomplete upload
+    if (status == 201 && DURABLE_POST && group_commit_sync(fd) < 0)
+        status = 500;
+    close(fd);
+
+    /* the upload itself runs unlocked, only replacing the file is
+     * serialized with other writers and with lookups of the same path
+     */
+    PATH_LOCK *lock = path_lock_write(filepath);
+    if (status == 201 && rename(tmppath, filepath) < 0) {
+        perror("rename");
+        status = 500;
+    }
+    if (status != 201)
+        unlink(tmppath);
+    else
+        fs_invalidate(filepath);
+    path_lock_release(lock);
+
+    /* the rename is atomic for readers already, only making it durable
+     * waits for a flush and that must not hold up the path's stripe
+     */
+    if (status == 201 && DURABLE_POST && sync_parent(filepath) < 0)
+        status = 500;
+
+    if (status == 201)
+        strcpy(response, RESPONSE_CREATED);
+    else if (status == 400)
+        strcpy(response, RESPONSE_BAD_REQUEST);
+    else
+        strcpy(response, RESPONSE_INTERNAL_ERROR);
+    return status;
 }
 
 static int delete_file(const char *path) {
     if (remove(path) == 0) {
+        fs_invalidate(path);
         return 1;
     }
     perror("delete file");
     return 0;
 }
 
-int _DELETE(char *request, char *response, char **content) {
+int _DELETE(HTTP_REQUEST *request, ARENA *arena, char *response,
+            const char **content) {
 
     if (request == NULL || response == NULL) {
         strcpy(response, RESPONSE_BAD_REQUEST);
         return 400;
     }
 
-    char *path = extract_filepath(request, "DELETE");
+    char *path = extract_filepath(request, arena);
     if (path == NULL) {
         strcpy(response, RESPONSE_BAD_REQUEST);
         return 404;
     }
 
-    if (file_exists(path)) {
-        if (delete_file(path) != 0) {
-            free(path);
+    PATH_LOCK *lock = path_lock_write(path);
+    int exists = file_exists(path);
+    int deleted = exists && delete_file(path);
+    path_lock_release(lock);
+
+    if (exists) {
+        if (deleted) {
             strcpy(response, RESPONSE_NO_CONTENT);
             return 204;
         } else {
-            free(path);
             strcpy(response, RESPONSE_BAD_REQUEST);
             return 404;
         }
     } else {
-        *content = (char *)malloc(sizeof("Document not found!" + 1));
-        if (*content == NULL) {
-            return 500;
-            strcpy(response, RESPONSE_INTERNAL_ERROR);
-        }
         *content = "Document was not found!";
         strcpy(response, RESPONSE_NOT_FOUND);
         return 404;
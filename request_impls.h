@@ -1,18 +1,79 @@
 #ifndef REQUEST_IMPLS_H
 #define REQUEST_IMPLS_H
 
+#include <sys/types.h>
+
+#include "arena.h"
+#include "compress_cache.h"
+#include "file_cache.h"
+#include "http_parser.h"
+#include "meta_cache.h"
+
 extern char *HOME;
+extern int DURABLE_POST;
+extern int GZIP_STATIC;
+extern long COMPRESS_MIN_SIZE;
+extern char *COMPRESS_TYPES;
 
 #define RESPONSE_OK "200 OK"
 #define RESPONSE_CREATED "201 Created"
 #define RESPONSE_NO_CONTENT "204 No Content"
+#define RESPONSE_PARTIAL_CONTENT "206 Partial Content"
+#define RESPONSE_NOT_MODIFIED "304 Not Modified"
 #define RESPONSE_BAD_REQUEST "400 Bad Request"
 #define RESPONSE_NOT_FOUND "404 Not Found"
+#define RESPONSE_RANGE_NOT_SATISFIABLE "416 Range Not Satisfiable"
 #define RESPONSE_INTERNAL_ERROR "500 Internal Server Error"
 
-int _GET(char *request, char *response, char **content);
-int _HEAD(char *request, char *response, long *f_size);
-int _POST(char *request, char *response);
-int _DELETE(char *request, char *response, char **content);
+#define MAX_RANGES 8
+
+typedef struct {
+    off_t start;
+    off_t length;
+} BYTE_RANGE;
+
+/* A response body that is sent from the content cache, a compressed
+ * variant or straight from an open file. offset and length select the part
+ * of the file to send, a request for several ranges lists them in ranges
+ * instead and is answered with multipart/byteranges.
+ */
+typedef struct {
+    int fd; // -1 when there is no file to send, owned by meta
+    off_t offset;
+    off_t length;
+    CACHE_ENTRY *cached; // set instead of fd on a cache hit
+    META_ENTRY *meta;
+    COMPRESS_ENTRY *variant; // set instead of both when compressed
+    const char *encoding;    // Content-Encoding, NULL for identity
+    int vary;                // the type is negotiated on Accept-Encoding
+    off_t size;              // of the whole file
+    VALIDATORS validators;
+    int nranges;
+    BYTE_RANGE ranges[MAX_RANGES];
+} FILE_BODY;
+
+/* Pulls the request body in pieces of at most the request buffer size.
+ * read() points *data at the next piece and returns its length, 0 at the
+ * end of the body and -1 on error or a malformed body.
+ */
+typedef struct {
+    long (*read)(void *ctx, const char **data);
+    void *ctx;
+} BODY_READER;
+
+const char *content_type(const HTTP_REQUEST *request);
+void file_body_release(FILE_BODY *body);
+
+/* handlers allocate from the connection's arena, which is reset once the
+ * response has been queued
+ */
+int _GET(HTTP_REQUEST *request, ARENA *arena, char *response,
+         FILE_BODY *body);
+int _HEAD(HTTP_REQUEST *request, ARENA *arena, char *response,
+          FILE_BODY *body);
+int _POST(HTTP_REQUEST *request, ARENA *arena, BODY_READER *body,
+          char *response);
+int _DELETE(HTTP_REQUEST *request, ARENA *arena, char *response,
+            const char **content);
 
 #endif
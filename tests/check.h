@@ -0,0 +1,23 @@
+#ifndef CHECK_H
+#define CHECK_H
+
+#include <stdio.h>
+
+/* counts and reports a failed expectation, the test goes on with the next */
+static int failures;
+
+#define CHECK(cond)                                                          \
+    do {                                                                     \
+        if (!(cond)) {                                                       \
+            fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond);       \
+            failures++;                                                      \
+        }                                                                    \
+    } while (0)
+
+/* what main returns: prints the verdict of the whole program */
+static int check_done(const char *name) {
+    printf("%s: %s\n", name, failures == 0 ? "ok" : "FAILED");
+    return failures != 0;
+}
+
+#endif
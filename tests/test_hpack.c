@@ -0,0 +1,154 @@
+/* HPACK against the examples of RFC 7541 appendix C: Huffman coded
+ * strings, and a dynamic table small enough that the responses evict.
+ */
+#include <string.h>
+
+#include "../hpack.h"
+#include "check.h"
+
+#define MAX_FIELDS 16
+
+typedef struct {
+    char text[MAX_FIELDS][128]; // "name: value"
+    int count;
+} FIELDS;
+
+static void collect(void *ctx, const char *name, int name_len,
+                    const char *value, int value_len) {
+    FIELDS *fields = ctx;
+    if (fields->count < MAX_FIELDS)
+        snprintf(fields->text[fields->count++], sizeof(fields->text[0]),
+                 "%.*s: %.*s", name_len, name, value_len, value);
+}
+
+/* decodes a block given in hex and compares the fields with expected,
+ * which ends with NULL
+ */
+static void decode(HPACK_TABLE *table, const char *hex,
+                   const char *const *expected) {
+    unsigned char in[512];
+    char scratch[1024];
+    size_t len = 0;
+    FIELDS fields = {.count = 0};
+
+    for (const char *p = hex; p[0] && p[1]; p++) {
+        unsigned int byte;
+        if (*p == ' ' || sscanf(p, "%2x", &byte) != 1)
+            continue;
+        in[len++] = byte;
+        p++;
+    }
+
+    CHECK(hpack_decode(table, in, len, scratch, sizeof(scratch), collect,
+                       &fields) == 0);
+    int n = 0;
+    while (expected[n] != NULL)
+        n++;
+    CHECK(fields.count == n);
+    for (int i = 0; i < n && i < fields.count; i++)
+        if (strcmp(fields.text[i], expected[i]) != 0) {
+            fprintf(stderr, "  field %d: \"%s\", expected \"%s\"\n", i,
+                    fields.text[i], expected[i]);
+            failures++;
+        }
+}
+
+/* C.4: requests with Huffman coded strings */
+static void test_huffman_requests(void) {
+    HPACK_TABLE table;
+    hpack_table_init(&table);
+
+    decode(&table, "8286 8441 8cf1 e3c2 e5f2 3a6b a0ab 90f4 ff",
+           (const char *const[]){":method: GET", ":scheme: http", ":path: /",
+                                 ":authority: www.example.com", NULL});
+    CHECK(table.count == 1 && table.size == 57);
+
+    decode(&table, "8286 84be 5886 a8eb 1064 9cbf",
+           (const char *const[]){":method: GET", ":scheme: http", ":path: /",
+                                 ":authority: www.example.com",
+                                 "cache-control: no-cache", NULL});
+    CHECK(table.count == 2 && table.size == 110);
+
+    decode(&table,
+           "8287 85bf 4088 25a8 49e9 5ba9 7d7f 8925 a849 e95b b8e8 b4bf",
+           (const char *const[]){":method: GET", ":scheme: https",
+                                 ":path: /index.html",
+                                 ":authority: www.example.com",
+                                 "custom-key: custom-value", NULL});
+    CHECK(table.count == 3 && table.size == 164);
+}
+
+/* C.6: responses with a 256 byte table, each of the later ones evicts */
+static void test_eviction(void) {
+    HPACK_TABLE table;
+    hpack_table_init(&table);
+    hpack_set_max_size(&table, 256);
+
+    decode(&table,
+           "4882 6402 5885 aec3 771a 4b61 96d0 7abe 9410 54d4 44a8 2005 9504"
+           "0b81 66e0 82a6 2d1b ff6e 919d 29ad 1718 63c7 8f0b 97c8 e9ae 82ae"
+           "43d3",
+           (const char *const[]){":status: 302", "cache-control: private",
+                                 "date: Mon, 21 Oct 2013 20:13:21 GMT",
+                                 "location: https://www.example.com", NULL});
+    CHECK(table.count == 4 && table.size == 222);
+
+    /* ":status: 307" pushes out ":status: 302", the oldest */
+    decode(&table, "4883 640e ffc1 c0bf",
+           (const char *const[]){":status: 307", "cache-control: private",
+                                 "date: Mon, 21 Oct 2013 20:13:21 GMT",
+                                 "location: https://www.example.com", NULL});
+    CHECK(table.count == 4 && table.size == 222);
+
+    /* three new entries push out all four older ones */
+    decode(&table,
+           "88c1 6196 d07a be94 1054 d444 a820 0595 040b 8166 e084 a62d 1bff"
+           "c05a 839b d9ab 77ad 94e7 821d d7f2 e6c7 b335 dfdf cd5b 3960 d5af"
+           "2708 7f36 72c1 ab27 0fb5 291f 9587 3160 65c0 03ed 4ee5 b106 3d50"
+           "07",
+           (const char *const[]){
+               ":status: 200", "cache-control: private",
+               "date: Mon, 21 Oct 2013 20:13:22 GMT",
+               "location: https://www.example.com", "content-encoding: gzip",
+               "set-cookie: foo=ASDJKHQKBZXOQWEOPIUAXQWEOIU; max-age=3600; "
+               "version=1",
+               NULL});
+    CHECK(table.count == 3 && table.size == 215);
+
+    /* what was evicted can no longer be referenced: index 65 is gone */
+    FIELDS fields = {.count = 0};
+    char scratch[64];
+    CHECK(hpack_decode(&table, (const unsigned char *)"\xc1", 1, scratch,
+                       sizeof(scratch), collect, &fields) < 0);
+
+    /* shrinking the table evicts oldest first down to the new size,
+     * leaving the 98 byte cookie
+     */
+    hpack_set_max_size(&table, 100);
+    CHECK(table.count == 1 && table.size == 98);
+}
+
+static void test_malformed(void) {
+    HPACK_TABLE table;
+    FIELDS fields = {.count = 0};
+    char scratch[64];
+    hpack_table_init(&table);
+
+    /* a Huffman string padded with more than 7 bits */
+    CHECK(hpack_decode(&table, (const unsigned char *)"\x00\x81\xff\x00", 4,
+                       scratch, sizeof(scratch), collect, &fields) < 0);
+    /* index 0 is not a field */
+    CHECK(hpack_decode(&table, (const unsigned char *)"\x80", 1, scratch,
+                       sizeof(scratch), collect, &fields) < 0);
+    /* a size update after a field */
+    CHECK(hpack_decode(&table, (const unsigned char *)"\x82\x20", 2, scratch,
+                       sizeof(scratch), collect, &fields) < 0);
+}
+
+int main(void) {
+    hpack_init();
+    test_huffman_requests();
+    test_eviction();
+    test_malformed();
+    return check_done("hpack");
+}
@@ -0,0 +1,163 @@
+/* The HTTP/1.1 request parser: framing by Content-Length and chunked
+ * encoding, the ambiguous framings it must refuse, and requests that
+ * arrive over several reads.
+ */
+#include <string.h>
+
+#include "../http_parser.h"
+#include "check.h"
+
+static enum parse_results parse(HTTP_REQUEST *req, const char *text) {
+    http_request_reset(req);
+    return http_parse(req, text, strlen(text));
+}
+
+/* decodes a whole chunked body fed in pieces of at most step bytes, returns
+ * the data length or -1
+ */
+static long dechunk(const char *raw, size_t step, char *out) {
+    char buf[256];
+    size_t len = strlen(raw), fed = 0, kept = 0;
+    long total = 0;
+    CHUNKED chunked;
+
+    http_chunked_reset(&chunked);
+    while (chunked.state != CS_DONE) {
+        size_t n = len - fed < step ? len - fed : step;
+        if (n == 0)
+            return -1; // the body never ended
+        memcpy(buf + kept, raw + fed, n);
+        fed += n;
+        size_t avail = kept + n, off = 0;
+
+        while (off < avail && chunked.state != CS_DONE) {
+            size_t consumed = 0;
+            long data = http_chunked_decode(&chunked, buf + off, avail - off,
+                                            &consumed);
+            if (data < 0)
+                return -1;
+            memcpy(out + total, buf + off, data);
+            total += data;
+            off += consumed;
+        }
+        kept = avail - off;
+        memmove(buf, buf + off, kept);
+    }
+    return total;
+}
+
+static void test_content_length(void) {
+    HTTP_REQUEST req;
+
+    CHECK(parse(&req, "POST /up HTTP/1.1\r\nHost: a\r\n"
+                      "Content-Length: 5\r\n\r\nhello") == PARSE_DONE);
+    CHECK(req.method == POST);
+    CHECK(req.content_length == 5);
+    CHECK(!req.chunked);
+    CHECK(req.header_end == (int)strlen("POST /up HTTP/1.1\r\nHost: a\r\n"
+                                        "Content-Length: 5\r\n\r\n"));
+
+    /* repeating the same length is allowed, differing ones are not */
+    CHECK(parse(&req, "POST /up HTTP/1.1\r\nContent-Length: 5\r\n"
+                      "Content-Length: 5\r\n\r\n") == PARSE_DONE);
+    CHECK(parse(&req, "POST /up HTTP/1.1\r\nContent-Length: 5\r\n"
+                      "Content-Length: 6\r\n\r\n") == PARSE_ERROR);
+    CHECK(parse(&req, "POST /up HTTP/1.1\r\nContent-Length: -5\r\n\r\n") ==
+          PARSE_ERROR);
+    CHECK(parse(&req, "POST /up HTTP/1.1\r\nContent-Length:\r\n\r\n") ==
+          PARSE_ERROR);
+}
+
+/* a body framed by both headers is how requests get smuggled */
+static void test_length_and_chunked(void) {
+    HTTP_REQUEST req;
+
+    CHECK(parse(&req, "POST /up HTTP/1.1\r\nContent-Length: 5\r\n"
+                      "Transfer-Encoding: chunked\r\n\r\n") == PARSE_ERROR);
+    CHECK(parse(&req, "POST /up HTTP/1.1\r\nTransfer-Encoding: chunked\r\n"
+                      "Content-Length: 5\r\n\r\n") == PARSE_ERROR);
+    CHECK(parse(&req, "POST /up HTTP/1.1\r\n"
+                      "Transfer-Encoding: gzip, chunked\r\n"
+                      "Content-Length: 0\r\n\r\n") == PARSE_ERROR);
+
+    CHECK(parse(&req, "POST /up HTTP/1.1\r\n"
+                      "Transfer-Encoding: chunked\r\n\r\n") == PARSE_DONE);
+    CHECK(req.chunked);
+    CHECK(req.content_length == -1);
+}
+
+static void test_chunked(void) {
+    static const char body[] = "4\r\nWiki\r\n"
+                               "5;name=value\r\npedia\r\n"
+                               "E\r\n in\r\n\r\nchunks.\r\n"
+                               "0\r\nExpires: never\r\n\r\n";
+    static const char data[] = "Wikipedia in\r\n\r\nchunks.";
+    char out[256];
+
+    /* the same body whole, split at every byte and in odd pieces */
+    size_t steps[] = {sizeof(body), 1, 3, 7};
+    for (size_t i = 0; i < sizeof(steps) / sizeof(steps[0]); i++) {
+        memset(out, 0, sizeof(out));
+        CHECK(dechunk(body, steps[i], out) == (long)strlen(data));
+        CHECK(strcmp(out, data) == 0);
+    }
+
+    CHECK(dechunk("0\r\n\r\n", 1, out) == 0);
+    CHECK(dechunk("zz\r\n", 1, out) < 0);                  // not hex
+    CHECK(dechunk("\r\n", 1, out) < 0);                    // no digits
+    CHECK(dechunk("4\r\nWikiX\r\n0\r\n\r\n", 1, out) < 0); // data overruns
+    CHECK(dechunk("4\rWiki\r\n0\r\n\r\n", 1, out) < 0);    // bare CR
+    CHECK(dechunk("1000000000000000\r\n", 1, out) < 0);    // 16 digits
+}
+
+/* every prefix of a request is incomplete and the whole one parses the
+ * same as in one read
+ */
+static void test_split_reads(void) {
+    static const char text[] = "GET /dir/file.txt?x=1 HTTP/1.1\r\n"
+                               "Host: example.com\r\n"
+                               "Connection: keep-alive\r\n"
+                               "Accept: */*\r\n\r\n";
+    int len = strlen(text);
+    HTTP_REQUEST whole, split;
+
+    CHECK(parse(&whole, text) == PARSE_DONE);
+
+    http_request_reset(&split);
+    for (int n = 1; n < len; n++)
+        CHECK(http_parse(&split, text, n) == PARSE_INCOMPLETE);
+    CHECK(http_parse(&split, text, len) == PARSE_DONE);
+
+    CHECK(split.method == GET);
+    CHECK(span_equals(text, &split.path, "/dir/file.txt"));
+    CHECK(span_equals(text, &split.query, "x=1"));
+    CHECK(split.keep_alive);
+    CHECK(split.nheaders == whole.nheaders);
+    CHECK(split.header_end == whole.header_end && split.header_end == len);
+    const SPAN *host = http_header(&split, "host");
+    CHECK(host != NULL && span_equals(text, host, "example.com"));
+
+    /* a pipelined request after the first is left for the next parse */
+    char two[256];
+    snprintf(two, sizeof(two), "%sGET / HTTP/1.1\r\n\r\n", text);
+    CHECK(parse(&split, two) == PARSE_DONE);
+    CHECK(split.header_end == len);
+}
+
+static void test_malformed(void) {
+    HTTP_REQUEST req;
+
+    CHECK(parse(&req, "GET /\r\n\r\n") == PARSE_ERROR);
+    CHECK(parse(&req, "GET / HTTP/1.1\r\nBad Name: x\r\n\r\n") ==
+          PARSE_ERROR);
+    CHECK(parse(&req, "G(T / HTTP/1.1\r\n\r\n") == PARSE_ERROR);
+}
+
+int main(void) {
+    test_content_length();
+    test_length_and_chunked();
+    test_chunked();
+    test_split_reads();
+    test_malformed();
+    return check_done("http_parser");
+}
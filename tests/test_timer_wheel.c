@@ -0,0 +1,135 @@
+/* The timer wheel: timers on every level cascade down and fire on their
+ * own tick, neither early nor late, and cancelling or re-arming works
+ * wherever a timer currently sits.
+ */
+#include "../timer_wheel.h"
+#include "check.h"
+
+#define TICK TIMER_TICK_MS
+
+typedef struct {
+    TIMER timer; // first, expired timers are cast back
+    unsigned long due; // tick it has to fire on
+    long fired;        // tick it fired on, or -1
+} ITEM;
+
+/* advances to tick and marks what expired */
+static void advance(TIMER_WHEEL *wheel, unsigned long tick) {
+    TIMER *timer = timer_wheel_advance(wheel, tick * TICK);
+    while (timer != NULL) {
+        ITEM *item = (ITEM *)timer;
+        CHECK(item->fired < 0); // once only
+        CHECK(!timer_armed(timer));
+        item->fired = tick;
+        timer = timer->next;
+    }
+}
+
+static void arm(TIMER_WHEEL *wheel, ITEM *item, unsigned long tick) {
+    item->timer.pprev = NULL;
+    item->due = tick;
+    item->fired = -1;
+    timer_arm(wheel, &item->timer, tick * TICK);
+}
+
+/* one timer per level boundary, advanced a tick at a time */
+static void test_cascade(void) {
+    static const unsigned long ticks[] = {
+        1,    63,   64,   65,   127,  128,  4095, 4096, 4097,
+        4160, 8191, 8192, 20000,
+    };
+    enum { N = sizeof(ticks) / sizeof(ticks[0]) };
+    ITEM items[N];
+    TIMER_WHEEL wheel;
+
+    timer_wheel_init(&wheel, 0);
+    for (int i = 0; i < N; i++)
+        arm(&wheel, &items[i], ticks[i]);
+    CHECK(wheel.armed == N);
+
+    for (unsigned long tick = 1; tick <= 20000; tick++) {
+        advance(&wheel, tick);
+        for (int i = 0; i < N; i++)
+            CHECK(items[i].fired < 0 ? items[i].due > tick
+                                     : items[i].fired == (long)items[i].due);
+    }
+    CHECK(wheel.armed == 0);
+}
+
+/* the same timers fire when the wheel jumps many ticks at once, and
+ * timers on the third and fourth level come down through every level
+ */
+static void test_jumps(void) {
+    static const unsigned long ticks[] = {
+        64 * 64 * 64 - 1, 64 * 64 * 64, 64 * 64 * 64 + 4161,
+        64 * 64 * 64 * 3 + 64 * 5 + 7,
+    };
+    enum { N = sizeof(ticks) / sizeof(ticks[0]) };
+    ITEM items[N];
+    TIMER_WHEEL wheel;
+
+    timer_wheel_init(&wheel, 0);
+    for (int i = 0; i < N; i++)
+        arm(&wheel, &items[i], ticks[i]);
+
+    for (int i = 0; i < N; i++) {
+        advance(&wheel, ticks[i] - 1);
+        CHECK(items[i].fired < 0);
+        advance(&wheel, ticks[i]);
+        CHECK(items[i].fired == (long)ticks[i]);
+    }
+}
+
+/* beyond the last level a timer is parked and cascaded again until due */
+static void test_beyond_span(void) {
+    unsigned long span = 1UL << (WHEEL_BITS * WHEEL_LEVELS);
+    ITEM item;
+    TIMER_WHEEL wheel;
+
+    timer_wheel_init(&wheel, 0);
+    arm(&wheel, &item, span + 100);
+    advance(&wheel, span + 99);
+    CHECK(item.fired < 0);
+    CHECK(timer_armed(&item.timer));
+    advance(&wheel, span + 100);
+    CHECK(item.fired == (long)(span + 100));
+}
+
+/* a timer cancelled or moved after it cascaded down a level */
+static void test_cancel_and_rearm(void) {
+    ITEM cancelled, moved, kept;
+    TIMER_WHEEL wheel;
+
+    timer_wheel_init(&wheel, 0);
+    arm(&wheel, &cancelled, 4100);
+    arm(&wheel, &moved, 4100);
+    arm(&wheel, &kept, 4100);
+
+    advance(&wheel, 4096); // all three are on level 0 by now
+    timer_cancel(&wheel, &cancelled.timer);
+    CHECK(!timer_armed(&cancelled.timer));
+    timer_cancel(&wheel, &cancelled.timer); // twice is harmless
+    moved.due = 4096 + 200;
+    timer_arm(&wheel, &moved.timer, moved.due * TICK);
+    CHECK(wheel.armed == 2);
+
+    for (unsigned long tick = 4097; tick <= 4400; tick++)
+        advance(&wheel, tick);
+    CHECK(cancelled.fired < 0);
+    CHECK(kept.fired == 4100);
+    CHECK(moved.fired == (long)moved.due);
+    CHECK(wheel.armed == 0);
+
+    /* arming in the past fires on the next tick */
+    arm(&wheel, &kept, 10);
+    advance(&wheel, 4401);
+    CHECK(kept.fired == 4401);
+}
+
+int main(void) {
+    test_cascade();
+    test_jumps();
+    test_beyond_span();
+    test_cancel_and_rearm();
+    return check_done("timer_wheel");
+}
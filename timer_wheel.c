@@ -0,0 +1,114 @@
+#include "timer_wheel.h"
+
+#include <string.h>
+
+int timer_wheel_init(TIMER_WHEEL *wheel, unsigned long now_ms) {
+    memset(wheel->slots, 0, sizeof(wheel->slots));
+    wheel->base_ms = now_ms;
+    wheel->now = 0;
+    wheel->armed = 0;
+    return pthread_mutex_init(&wheel->lock, NULL) == 0 ? 0 : -1;
+}
+
+static void link_timer(TIMER_WHEEL *wheel, TIMER *timer) {
+    unsigned long delta = timer->expires - wheel->now;
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 &&
+           delta >= 1UL << (WHEEL_BITS * (level + 1)))
+        level++;
+    /* beyond the last level the timer waits in the farthest slot and is
+     * cascaded again when it comes around
+     */
+    unsigned long span = 1UL << (WHEEL_BITS * WHEEL_LEVELS);
+    unsigned long expires = delta < span ? timer->expires
+                                         : wheel->now + span - 1;
+
+    TIMER **slot = &wheel->slots[level][(expires >> (WHEEL_BITS * level)) &
+                                        (WHEEL_SLOTS - 1)];
+    timer->next = *slot;
+    if (*slot != NULL)
+        (*slot)->pprev = &timer->next;
+    timer->pprev = slot;
+    *slot = timer;
+}
+
+static void unlink_timer(TIMER *timer) {
+    *timer->pprev = timer->next;
+    if (timer->next != NULL)
+        timer->next->pprev = timer->pprev;
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+/* (re)arms timer to fire at expires_ms, at the latest one tick late */
+void timer_arm(TIMER_WHEEL *wheel, TIMER *timer, unsigned long expires_ms) {
+    if (timer_armed(timer))
+        unlink_timer(timer);
+    else
+        wheel->armed++;
+
+    unsigned long ms = expires_ms > wheel->base_ms ? expires_ms - wheel->base_ms
+                                                   : 0;
+    timer->expires = (ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    if (timer->expires <= wheel->now)
+        timer->expires = wheel->now + 1;
+    link_timer(wheel, timer);
+}
+
+void timer_cancel(TIMER_WHEEL *wheel, TIMER *timer) {
+    if (!timer_armed(timer))
+        return;
+    unlink_timer(timer);
+    wheel->armed--;
+}
+
+/* moves the timers of a higher level slot down to where they belong now */
+static void cascade(TIMER_WHEEL *wheel, int level) {
+    int index = (wheel->now >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1);
+    TIMER *timer = wheel->slots[level][index];
+    wheel->slots[level][index] = NULL;
+    while (timer != NULL) {
+        TIMER *next = timer->next;
+        link_timer(wheel, timer);
+        timer = next;
+    }
+    if (index == 0 && level + 1 < WHEEL_LEVELS)
+        cascade(wheel, level + 1);
+}
+
+/* Processes every tick up to now_ms and returns the timers that expired,
+ * unarmed and chained through next.
+ */
+TIMER *timer_wheel_advance(TIMER_WHEEL *wheel, unsigned long now_ms) {
+    unsigned long target = now_ms > wheel->base_ms
+                               ? (now_ms - wheel->base_ms) / TIMER_TICK_MS
+                               : 0;
+    TIMER *expired = NULL;
+
+    while (wheel->now < target) {
+        wheel->now++;
+        int index = wheel->now & (WHEEL_SLOTS - 1);
+        if (index == 0)
+            cascade(wheel, 1);
+
+        TIMER *timer = wheel->slots[0][index];
+        wheel->slots[0][index] = NULL;
+        while (timer != NULL) {
+            TIMER *next = timer->next;
+            timer->pprev = NULL;
+            /* a cascaded timer parked in the farthest slot is not due yet */
+            if (timer->expires > wheel->now) {
+                link_timer(wheel, timer);
+            } else {
+                timer->next = expired;
+                expired = timer;
+                wheel->armed--;
+            }
+            timer = next;
+        }
+        /* nothing left to expire, skip the empty ticks */
+        if (wheel->armed == 0)
+            wheel->now = target;
+    }
+    return expired;
+}
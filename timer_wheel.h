@@ -0,0 +1,42 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <pthread.h>
+
+#define TIMER_TICK_MS 100
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4 // 64^4 ticks of 100ms, about 19 days
+
+/* A timer embedded in what it times, linked into one wheel slot while it
+ * is armed. Arming and cancelling only touch the slot's list.
+ */
+typedef struct timer {
+    struct timer *next;
+    struct timer **pprev; // NULL while the timer is not armed
+    unsigned long expires; // in ticks
+} TIMER;
+
+/* A hierarchical timing wheel: level 0 has a slot per tick, every further
+ * level a slot per WHEEL_SLOTS ticks of the level below. Timers move down
+ * a level whenever the lower level wraps, so advancing costs O(1) per tick
+ * and per timer. Callers hold lock around every operation.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    unsigned long base_ms; // time of tick 0
+    unsigned long now;     // the last tick that was processed
+    int armed;
+    TIMER *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+} TIMER_WHEEL;
+
+int timer_wheel_init(TIMER_WHEEL *wheel, unsigned long now_ms);
+void timer_arm(TIMER_WHEEL *wheel, TIMER *timer, unsigned long expires_ms);
+void timer_cancel(TIMER_WHEEL *wheel, TIMER *timer);
+TIMER *timer_wheel_advance(TIMER_WHEEL *wheel, unsigned long now_ms);
+
+static inline int timer_armed(const TIMER *timer) {
+    return timer->pprev != NULL;
+}
+
+#endif
@@ -2,29 +2,63 @@
 #include <errno.h>
 #include <openssl/err.h>
 #include <openssl/ssl.h>
+#include <signal.h>
 #include <stdio.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "access_log.h"
+#include "compress_cache.h"
+#include "event_loop.h"
+#include "file_cache.h"
+#include "fs_watch.h"
+#include "group_commit.h"
+#include "http2.h"
+#include "meta_cache.h"
+#include "metrics.h"
+#include "mime.h"
+#include "path_lock.h"
 #include "request_handler.h"
+#include "tls_session.h"
+#include "uring_loop.h"
 
 int THREADS;
 int PORT;
 char *HOME;
-
-pthread_mutex_t mutex;
-pthread_cond_t *cond;
-CONN **connections;
-
-void cleanup(SSL *ssl, int client, int *execute) {
-    SSL_shutdown(ssl);
-    SSL_free(ssl);
-    close(client);
-    *execute = 0;
-}
-
-int create_socket(int port) {
-    int s;
+int CONN_ENGINE = ENGINE_EPOLL;
+int QUEUE_SIZE = 1024;
+int SHARDS = 1;
+int BACKLOG = 128;
+int KTLS = 0;
+int IO_BUF_SIZE = 16384;
+int MAX_REQUEST_SIZE = 8192;
+int FLUSH_THRESHOLD = 16384;
+int DURABLE_POST = 0;
+int PATH_LOCK_STRIPES = 64;
+long COMPRESS_CACHE_SIZE = 16L * 1024 * 1024;
+long COMPRESS_MIN_SIZE = 1024;
+char *COMPRESS_TYPES = "text/plain,text/html";
+int GZIP_STATIC = 1;
+char *MIME_TYPES = NULL;
+long CACHE_SIZE = 64L * 1024 * 1024;
+long CACHE_MAX_FILE = 1024L * 1024;
+int META_CACHE_ENTRIES = 1024;
+long SESSION_CACHE_SIZE = 20480;
+int SESSION_TICKETS = 1;
+int TLS13_TICKETS = 2;
+int TICKET_KEY_ROTATE = 3600;
+int HANDSHAKE_TIMEOUT = 10000;
+int HEADER_TIMEOUT = 10000;
+int BODY_TIMEOUT = 30000;
+int KEEPALIVE_TIMEOUT = 15000;
+int SEND_TIMEOUT = 30000;
+
+SHARD *shards;
+
+int create_socket(int port, int backlog, int reuseport) {
+    int s, on = 1;
     struct sockaddr_in addr;
 
     /* set the type of connection to TCP/IP */
@@ -40,14 +74,27 @@ int create_socket(int port) {
         exit(EXIT_FAILURE);
     }
 
+    /* allow a restarted server to bind while old connections linger */
+    if (setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0) {
+        perror("SO_REUSEADDR");
+        exit(EXIT_FAILURE);
+    }
+
+    /* let several listeners share the port, one per shard */
+    if (reuseport &&
+        setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+        perror("SO_REUSEPORT");
+        exit(EXIT_FAILURE);
+    }
+
     /* bind serv information to s socket */
     if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
         perror("Unable to bind");
         exit(EXIT_FAILURE);
     }
 
-    /* start listening allowing a queue of up to 1 pending connection */
-    if (listen(s, 1) < 0) {
+    /* start listening allowing a queue of up to backlog pending connections */
+    if (listen(s, backlog) < 0) {
         perror("Unable to listen");
         exit(EXIT_FAILURE);
     }
@@ -100,6 +147,34 @@ void configure_context(SSL_CTX *ctx) {
         ERR_print_errors_fp(stderr);
         exit(EXIT_FAILURE);
     }
+
+    /* resumed handshakes skip the certificate and key exchange, which is
+     * most of the cost of a new connection
+     */
+    if (tls_session_configure(ctx, SESSION_CACHE_SIZE, SESSION_TICKETS,
+                              TLS13_TICKETS, TICKET_KEY_ROTATE) < 0) {
+        ERR_print_errors_fp(stderr);
+        exit(EXIT_FAILURE);
+    }
+
+    /* ALPN picks h2 for clients that offer it, HTTP/1.1 otherwise */
+    if (http2_configure(ctx) < 0) {
+        ERR_print_errors_fp(stderr);
+        exit(EXIT_FAILURE);
+    }
+
+    /* Ask OpenSSL to hand the record layer to the kernel. Whether kTLS is
+     * actually used is decided per connection (kernel support, cipher), so
+     * GET bodies fall back to a userspace copy when it was not negotiated.
+     */
+    if (KTLS) {
+#ifdef SSL_OP_ENABLE_KTLS
+        SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#else
+        fprintf(stderr, "KTLS: not supported by this OpenSSL build\n");
+        KTLS = 0;
+#endif
+    }
 }
 
 int configure_server() {
@@ -116,17 +191,18 @@ int configure_server() {
         if (buffer[0] == '#' || buffer[0] == '\n')
             continue;
         buffer[strcspn(buffer, "\n")] = '\0';
-        if (strstr(buffer, "THREADS") != NULL) {
-            token = strtok(buffer, "=");
-            token = strtok(NULL, "=");
+
+        char *saveptr = NULL;
+        char *key = strtok_r(buffer, "=", &saveptr);
+        token = strtok_r(NULL, "=", &saveptr);
+        if (key == NULL || token == NULL)
+            continue;
+
+        if (strcmp(key, "THREADS") == 0) {
             THREADS = atoi(token);
-        } else if (strstr(buffer, "PORT") != NULL) {
-            token = strtok(buffer, "=");
-            token = strtok(NULL, "=");
+        } else if (strcmp(key, "PORT") == 0) {
             PORT = atoi(token);
-        } else if (strstr(buffer, "HOME") != NULL) {
-            token = strtok(buffer, "=");
-            token = strtok(NULL, "=");
+        } else if (strcmp(key, "HOME") == 0) {
             HOME = (char *)malloc(strlen(token) + 1);
             if (HOME == NULL) {
                 perror("HOME path");
@@ -134,6 +210,100 @@ int configure_server() {
                 return EXIT_FAILURE;
             }
             strcpy(HOME, token);
+        } else if (strcmp(key, "SHARDS") == 0) {
+            SHARDS = atoi(token);
+        } else if (strcmp(key, "BACKLOG") == 0) {
+            BACKLOG = atoi(token);
+        } else if (strcmp(key, "KTLS") == 0) {
+            KTLS = atoi(token);
+        } else if (strcmp(key, "IO_BUF_SIZE") == 0) {
+            IO_BUF_SIZE = atoi(token);
+        } else if (strcmp(key, "CACHE_SIZE") == 0) {
+            CACHE_SIZE = atol(token);
+        } else if (strcmp(key, "CACHE_MAX_FILE") == 0) {
+            CACHE_MAX_FILE = atol(token);
+        } else if (strcmp(key, "META_CACHE_ENTRIES") == 0) {
+            META_CACHE_ENTRIES = atoi(token);
+        } else if (strcmp(key, "SESSION_CACHE_SIZE") == 0) {
+            SESSION_CACHE_SIZE = atol(token);
+        } else if (strcmp(key, "SESSION_TICKETS") == 0) {
+            SESSION_TICKETS = atoi(token);
+        } else if (strcmp(key, "TLS13_TICKETS") == 0) {
+            TLS13_TICKETS = atoi(token);
+        } else if (strcmp(key, "TICKET_KEY_ROTATE") == 0) {
+            TICKET_KEY_ROTATE = atoi(token);
+        } else if (strcmp(key, "MAX_REQUEST_SIZE") == 0) {
+            MAX_REQUEST_SIZE = atoi(token);
+        } else if (strcmp(key, "COMPRESS_CACHE_SIZE") == 0) {
+            COMPRESS_CACHE_SIZE = atol(token);
+        } else if (strcmp(key, "COMPRESS_MIN_SIZE") == 0) {
+            COMPRESS_MIN_SIZE = atol(token);
+        } else if (strcmp(key, "COMPRESS_TYPES") == 0) {
+            if ((COMPRESS_TYPES = strdup(token)) == NULL) {
+                perror("COMPRESS_TYPES");
+                fclose(fp);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(key, "MIME_TYPES") == 0) {
+            if ((MIME_TYPES = strdup(token)) == NULL) {
+                perror("MIME_TYPES");
+                fclose(fp);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(key, "GZIP_STATIC") == 0) {
+            GZIP_STATIC = atoi(token);
+        } else if (strcmp(key, "PATH_LOCK_STRIPES") == 0) {
+            PATH_LOCK_STRIPES = atoi(token);
+        } else if (strcmp(key, "DURABLE_POST") == 0) {
+            DURABLE_POST = atoi(token);
+        } else if (strcmp(key, "METRICS") == 0) {
+            METRICS = atoi(token);
+        } else if (strcmp(key, "METRICS_PATH") == 0) {
+            if ((METRICS_PATH = strdup(token)) == NULL) {
+                perror("METRICS_PATH");
+                fclose(fp);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(key, "ACCESS_LOG") == 0) {
+            if ((ACCESS_LOG = strdup(token)) == NULL) {
+                perror("ACCESS_LOG");
+                fclose(fp);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(key, "ACCESS_LOG_ROTATE") == 0) {
+            ACCESS_LOG_ROTATE = atol(token);
+        } else if (strcmp(key, "ACCESS_LOG_RING") == 0) {
+            ACCESS_LOG_RING = atoi(token);
+        } else if (strcmp(key, "HTTP2") == 0) {
+            HTTP2 = atoi(token);
+        } else if (strcmp(key, "H2_MAX_STREAMS") == 0) {
+            H2_MAX_STREAMS = atoi(token);
+        } else if (strcmp(key, "H2_WINDOW") == 0) {
+            H2_WINDOW = atoi(token);
+        } else if (strcmp(key, "HANDSHAKE_TIMEOUT") == 0) {
+            HANDSHAKE_TIMEOUT = atoi(token);
+        } else if (strcmp(key, "HEADER_TIMEOUT") == 0) {
+            HEADER_TIMEOUT = atoi(token);
+        } else if (strcmp(key, "BODY_TIMEOUT") == 0) {
+            BODY_TIMEOUT = atoi(token);
+        } else if (strcmp(key, "KEEPALIVE_TIMEOUT") == 0) {
+            KEEPALIVE_TIMEOUT = atoi(token);
+        } else if (strcmp(key, "SEND_TIMEOUT") == 0) {
+            SEND_TIMEOUT = atoi(token);
+        } else if (strcmp(key, "FLUSH_THRESHOLD") == 0) {
+            FLUSH_THRESHOLD = atoi(token);
+        } else if (strcmp(key, "QUEUE_SIZE") == 0) {
+            QUEUE_SIZE = atoi(token);
+        } else if (strcmp(key, "CONN_ENGINE") == 0) {
+            if (strcmp(token, "epoll") == 0)
+                CONN_ENGINE = ENGINE_EPOLL;
+            else if (strcmp(token, "threads") == 0)
+                CONN_ENGINE = ENGINE_THREADS;
+            else if (strcmp(token, "uring") == 0)
+                CONN_ENGINE = ENGINE_URING;
+            else
+                fprintf(stderr, "config.txt: unknown CONN_ENGINE %s\n",
+                        token);
         }
     }
 
@@ -141,67 +311,72 @@ int configure_server() {
     return EXIT_SUCCESS;
 }
 
-int main(void) {
-    if (configure_server() == EXIT_FAILURE)
-        return EXIT_FAILURE;
-
-    int sock;
-    SSL_CTX *ctx;
-
-    /* initialize OpenSSL */
-    init_openssl();
-
-    /* setting up algorithms needed by TLS */
-    ctx = create_context();
+/* Queues a connection for the workers of its shard. When every worker ring
+ * is full this blocks the accepting thread, which leaves new clients
+ * waiting in the listen backlog.
+ */
+void dispatch_connection(CONN *conn) {
+    work_queue_push(&conn->shard->queue, conn);
+}
 
-    /* specify the certificate and private key to use */
-    configure_context(ctx);
+/* the same for the event loops, which must not block: returns 0 when every
+ * worker ring is full, the loop then holds on to the connection until the
+ * queue's wake_fd signals a free slot
+ */
+int try_dispatch_connection(CONN *conn) {
+    return work_queue_try_push(&conn->shard->queue, conn);
+}
 
-    sock = create_socket(PORT);
+/* dumps the shard and queue statistics to stderr on SIGUSR1 */
+static void *stats_reporter(void *arg) {
+    sigset_t *set = (sigset_t *)arg;
+    int sig;
+
+    while (sigwait(set, &sig) == 0) {
+        for (int i = 0; i < SHARDS; i++) {
+            fprintf(stderr, "shard %d: accepted %lu, active %ld\n", i,
+                    atomic_load(&shards[i].accepted),
+                    atomic_load(&shards[i].active));
+            work_queue_stats(&shards[i].queue, stderr);
+        }
+        request_handler_stats(stderr);
+        if (HTTP2)
+            http2_stats(stderr);
+        if (CONN_ENGINE == ENGINE_URING)
+            uring_stats(stderr);
+        file_cache_stats(stderr);
+        meta_cache_stats(stderr);
+        compress_cache_stats(stderr);
+        tls_session_stats(shards[0].ctx, stderr);
+        path_lock_stats(stderr);
+        if (DURABLE_POST)
+            group_commit_stats(stderr);
+        if (ACCESS_LOG != NULL)
+            access_log_stats(stderr);
+    }
 
-    cond = malloc(sizeof(pthread_cond_t) * THREADS);
-    connections = malloc(sizeof(CONN *) * THREADS);
-    pthread_t *tid = malloc(sizeof(pthread_t) * THREADS);
-    int *args = malloc(sizeof(int) * THREADS);
+    return NULL;
+}
 
-    if (cond == NULL || connections == NULL || args == NULL || tid == NULL) {
-        if (cond == NULL)
-            perror("cond");
-        if (connections == NULL)
-            perror("connections");
-        if (args == NULL)
-            perror("args");
-        if (tid == NULL)
-            perror("tid");
+/* expires the connection deadlines of every shard once per wheel tick */
+static void *deadline_reaper(void *arg) {
+    int count = *(int *)arg;
+    struct timespec tick = {0, TIMER_TICK_MS * 1000000L};
 
-        close(sock);
-        SSL_CTX_free(ctx);
-        cleanup_openssl();
-        return EXIT_FAILURE;
+    while (1) {
+        nanosleep(&tick, NULL);
+        for (int i = 0; i < count; i++)
+            expire_connections(&shards[i]);
     }
 
-    int i, err, execute = 1;
-    for (i = 0; i < THREADS; i++) {
-        connections[i] = NULL;
-        args[i] = i;
-        if ((err = pthread_create(&(tid[i]), NULL, (void *)&request_handler,
-                                  (void *)&(args[i])))) {
-            perror_thread("pthread_create", err);
-            execute = 0;
-            break;
-        }
-        pthread_cond_init(&cond[i], NULL);
-    }
-    pthread_mutex_init(&mutex, NULL);
-    free(args);
-
-    int current_thread = 0;
+    return NULL;
+}
 
-    /* Handle connections */
-    while (execute) {
-        printf("Accepting client....\n");
-        struct sockaddr_in addr;
-        uint len = sizeof(addr);
+/* blocking accept, used by the threads engine */
+static void accept_loop(SHARD *shard) {
+    while (1) {
+        struct sockaddr_storage addr;
+        socklen_t len = sizeof(addr);
         SSL *ssl;
 
         /* Server accepts a new connection on a socket.
@@ -210,75 +385,242 @@ int main(void) {
          * socket type protocol and address family as the specified
          * socket, and allocate a new file descriptor for that socket.
          */
-        int client = accept(sock, (struct sockaddr *)&addr, &len);
+        int client = accept(shard->sock, (struct sockaddr *)&addr, &len);
         if (client < 0) {
             perror("Unable to accept");
             exit(EXIT_FAILURE);
         }
+        atomic_fetch_add(&shard->accepted, 1);
+        metrics_add(M_ACCEPTS, 1);
 
         /* creates a new SSL structure which is needed to hold the data
          * for a TLS/SSL connection
          */
-        ssl = SSL_new(ctx);
+        ssl = SSL_new(shard->ctx);
+        CONN *connection =
+            ssl != NULL
+                ? conn_new(shard, client, ssl, (struct sockaddr *)&addr, len)
+                : NULL;
+        if (connection == NULL) {
+            perror("connection");
+            SSL_free(ssl);
+            close(client);
+            continue;
+        }
         SSL_set_fd(ssl, client);
 
-        /* wait for a TLS/SSL client to initiate a TLS/SSL handshake */
-        if (SSL_accept(ssl) <= 0) {
-            ERR_print_errors_fp(stderr);
-        }
-        /* if TLS/SSL handshake was successfully completed, a TLS/SSL
-         * connection has been established
+        /* the worker runs the handshake, a client that stays silent only
+         * ties up that worker until its handshake deadline
          */
-        else {
-            CONN *connection = (CONN *)malloc(sizeof(CONN));
-            if (connection == NULL) {
-                perror("connection");
-                SSL_shutdown(ssl);
-                SSL_free(ssl);
-                close(client);
-                break;
-            }
+        conn_deadline(connection, PHASE_HANDSHAKE);
+        dispatch_connection(connection);
+    }
+}
 
-            connection->ssl = ssl;
-            connection->socket = client;
+static void *shard_main(void *arg) {
+    SHARD *shard = (SHARD *)arg;
 
-            if ((err = pthread_mutex_lock(&mutex))) {
-                perror_thread("pthread_mutex_lock", err);
-                cleanup(ssl, client, &execute);
-                break;
-            }
+    if (CONN_ENGINE == ENGINE_URING) {
+        struct uring_loop *loop = uring_loop_new(shard);
+        if (loop != NULL)
+            return (void *)(long)uring_loop_run(loop);
+        fprintf(stderr, "shard %d: io_uring unavailable, using epoll\n",
+                shard->id);
+    }
 
-            connections[current_thread] = connection;
-            pthread_cond_signal(&cond[current_thread]);
+    /* the epoll engine drives accepts and handshakes without blocking */
+    if (CONN_ENGINE != ENGINE_THREADS)
+        event_loop_run(shard);
+    else
+        accept_loop(shard);
 
-            if ((err = pthread_mutex_unlock(&mutex))) {
-                perror_thread("pthread_mutex_unlock", err);
-                cleanup(ssl, client, &execute);
-                break;
-            }
+    return (void *)EXIT_FAILURE;
+}
 
-            current_thread++;
-            if (current_thread == THREADS) {
-                current_thread = 0;
-            }
+/* opens the shard's listener and starts its workers and accept loop */
+static int start_shard(SHARD *shard, int id, SSL_CTX *ctx) {
+    int i, err;
+
+    shard->id = id;
+    shard->ctx = ctx;
+    shard->sock = create_socket(PORT, BACKLOG, SHARDS > 1);
+    atomic_init(&shard->accepted, 0);
+    atomic_init(&shard->active, 0);
+    if (timer_wheel_init(&shard->wheel, metrics_now() / 1000000) < 0) {
+        perror("timer wheel");
+        return -1;
+    }
+
+    /* the THREADS workers are split evenly between the shards */
+    shard->threads = THREADS / SHARDS;
+    if (shard->threads < 1)
+        shard->threads = 1;
+
+    shard->worker_tids = malloc(sizeof(pthread_t) * shard->threads);
+    shard->workers = malloc(sizeof(WORKER) * shard->threads);
+    int queue_err = work_queue_init(&shard->queue, shard->threads,
+                                    QUEUE_SIZE / SHARDS);
+
+    if (queue_err < 0 || shard->workers == NULL ||
+        shard->worker_tids == NULL) {
+        if (queue_err < 0)
+            perror("queue");
+        if (shard->workers == NULL)
+            perror("workers");
+        if (shard->worker_tids == NULL)
+            perror("worker_tids");
+        return -1;
+    }
+    snprintf(shard->labels, sizeof(shard->labels), "shard=\"%d\"", id);
+    work_queue_register_metrics(&shard->queue, shard->labels);
+
+    for (i = 0; i < shard->threads; i++) {
+        shard->workers[i].shard = shard;
+        shard->workers[i].index = i;
+        if ((err = pthread_create(&(shard->worker_tids[i]), NULL,
+                                  (void *)&request_handler,
+                                  (void *)&(shard->workers[i])))) {
+            perror_thread("pthread_create", err);
+            return -1;
         }
     }
 
-    for (i = 0; i < THREADS; i++) {
-        pthread_cancel(tid[i]);
-        pthread_cond_destroy(&cond[i]);
+    if ((err = pthread_create(&shard->tid, NULL, shard_main, shard))) {
+        perror_thread("pthread_create", err);
+        return -1;
     }
-    pthread_mutex_destroy(&mutex);
 
-    free(tid);
-    free(connections);
+    return 0;
+}
 
-    close(sock);
-    SSL_CTX_free(ctx);
-    cleanup_openssl();
+int main(void) {
+    if (configure_server() == EXIT_FAILURE)
+        return EXIT_FAILURE;
+
+    /* a client closing its end mid-response must not kill the server */
+    signal(SIGPIPE, SIG_IGN);
+
+    /* every connection and every cached file holds a descriptor */
+    struct rlimit nofile;
+    if (getrlimit(RLIMIT_NOFILE, &nofile) == 0) {
+        nofile.rlim_cur = nofile.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &nofile);
+    }
+
+    SSL_CTX *ctx;
+
+    /* initialize OpenSSL */
+    init_openssl();
 
-    if (execute == 0)
+    /* setting up algorithms needed by TLS */
+    ctx = create_context();
+
+    /* specify the certificate and private key to use */
+    configure_context(ctx);
+
+    /* kernels without io_uring (or with it disabled) get the epoll engine */
+    if (CONN_ENGINE == ENGINE_URING && !uring_available()) {
+        fprintf(stderr, "io_uring is not available, using epoll\n");
+        CONN_ENGINE = ENGINE_EPOLL;
+    }
+    if (SHARDS < 1)
+        SHARDS = 1;
+    if (IO_BUF_SIZE < 1)
+        IO_BUF_SIZE = 16384;
+    if (MAX_REQUEST_SIZE < BUF_SIZE)
+        MAX_REQUEST_SIZE = BUF_SIZE;
+    if (FLUSH_THRESHOLD < 1)
+        FLUSH_THRESHOLD = 16384;
+    if (H2_MAX_STREAMS < 1)
+        H2_MAX_STREAMS = 1;
+    /* clients may use the default window before they see our SETTINGS */
+    if (H2_WINDOW < 65535)
+        H2_WINDOW = 65535;
+    if (CACHE_SIZE < 0)
+        CACHE_SIZE = 0;
+    shards = calloc(SHARDS, sizeof(SHARD));
+    if (shards == NULL) {
+        perror("shards");
+        SSL_CTX_free(ctx);
+        cleanup_openssl();
         return EXIT_FAILURE;
+    }
 
-    return EXIT_SUCCESS;
+    /* SIGUSR1 is only handled by the stats reporter thread, so block it
+     * before any other thread inherits the signal mask
+     */
+    sigset_t stats_signals;
+    pthread_t stats_tid;
+    sigemptyset(&stats_signals);
+    sigaddset(&stats_signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &stats_signals, NULL);
+
+    int i, err, started = 0, execute = 1;
+    if ((err = pthread_create(&stats_tid, NULL, stats_reporter,
+                              &stats_signals))) {
+        perror_thread("pthread_create", err);
+        execute = 0;
+    }
+
+    if (execute && mime_init(MIME_TYPES) < 0)
+        execute = 0;
+    if (execute && ACCESS_LOG != NULL &&
+        access_log_init(ACCESS_LOG, ACCESS_LOG_ROTATE, ACCESS_LOG_RING) < 0)
+        execute = 0;
+    if (execute && (file_cache_init(CACHE_SIZE, CACHE_MAX_FILE) < 0 ||
+                    meta_cache_init(HOME, META_CACHE_ENTRIES) < 0 ||
+                    compress_cache_init(COMPRESS_CACHE_SIZE,
+                                        CACHE_MAX_FILE) < 0))
+        execute = 0;
+
+    /* the inotify watcher is started after the signal mask is set up */
+    if (execute && (CACHE_SIZE > 0 || META_CACHE_ENTRIES > 0) &&
+        fs_watch_init(HOME) < 0)
+        execute = 0;
+
+    if (execute && path_lock_init(PATH_LOCK_STRIPES) < 0)
+        execute = 0;
+    if (execute && DURABLE_POST && group_commit_init() < 0)
+        execute = 0;
+
+    for (i = 0; execute && i < SHARDS; i++) {
+        if (start_shard(&shards[i], i, ctx) < 0)
+            execute = 0;
+        else
+            started++;
+    }
+    /* the accept loops already running never return, so a partial set of
+     * shards would be served instead of failing
+     */
+    if (!execute && started > 0) {
+        fprintf(stderr, "shard %d failed to start\n", started);
+        exit(EXIT_FAILURE);
+    }
+
+    /* without it connections wait for their clients however long it takes,
+     * so like a shard it is not left out
+     */
+    pthread_t reaper_tid;
+    if (started > 0 && (HANDSHAKE_TIMEOUT > 0 || HEADER_TIMEOUT > 0 ||
+                        BODY_TIMEOUT > 0 || KEEPALIVE_TIMEOUT > 0 ||
+                        SEND_TIMEOUT > 0) &&
+        (err = pthread_create(&reaper_tid, NULL, deadline_reaper, &started))) {
+        perror_thread("deadline reaper", err);
+        exit(EXIT_FAILURE);
+    }
+
+    /* the accept loops only return on a fatal error */
+    for (i = 0; i < started; i++)
+        pthread_join(shards[i].tid, NULL);
+
+    for (i = 0; i < started; i++) {
+        for (int j = 0; j < shards[i].threads; j++)
+            pthread_cancel(shards[i].worker_tids[j]);
+        close(shards[i].sock);
+    }
+
+    SSL_CTX_free(ctx);
+    cleanup_openssl();
+
+    return EXIT_FAILURE;
 }
@@ -0,0 +1,175 @@
+#include "tls_session.h"
+#include "metrics.h"
+
+#include <openssl/core_names.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <time.h>
+
+/* A session ticket key. Tickets are encrypted with the current key and
+ * still accepted (and renewed) under the previous one for another
+ * rotation period, so clients do not lose their tickets at every rotation.
+ */
+typedef struct {
+    unsigned char name[TICKET_KEY_NAME_LEN];
+    unsigned char aes_key[32];
+    unsigned char hmac_key[32];
+    time_t created;
+    int valid;
+} TICKET_KEY;
+
+/* one SSL_CTX is shared by every shard and worker, and so are the keys */
+static pthread_rwlock_t keys_lock = PTHREAD_RWLOCK_INITIALIZER;
+static TICKET_KEY current_key;
+static TICKET_KEY previous_key;
+static int rotate_interval;
+
+static atomic_ulong full_handshakes, resumed_handshakes;
+
+static int generate_key(TICKET_KEY *key) {
+    if (RAND_bytes(key->name, sizeof(key->name)) <= 0 ||
+        RAND_bytes(key->aes_key, sizeof(key->aes_key)) <= 0 ||
+        RAND_bytes(key->hmac_key, sizeof(key->hmac_key)) <= 0)
+        return -1;
+    key->created = time(NULL);
+    key->valid = 1;
+    return 0;
+}
+
+/* lazily replaces the current key once it is older than the interval */
+static void rotate_keys(void) {
+    time_t now = time(NULL);
+
+    pthread_rwlock_rdlock(&keys_lock);
+    int due = now - current_key.created >= rotate_interval;
+    pthread_rwlock_unlock(&keys_lock);
+    if (!due)
+        return;
+
+    TICKET_KEY fresh;
+    if (generate_key(&fresh) < 0)
+        return;
+
+    pthread_rwlock_wrlock(&keys_lock);
+    if (now - current_key.created >= rotate_interval) {
+        previous_key = current_key;
+        current_key = fresh;
+    }
+    pthread_rwlock_unlock(&keys_lock);
+    OPENSSL_cleanse(&fresh, sizeof(fresh));
+}
+
+static int init_cipher(const TICKET_KEY *key, unsigned char *iv,
+                       EVP_CIPHER_CTX *cctx, EVP_MAC_CTX *hctx, int enc) {
+    OSSL_PARAM params[3];
+    params[0] = OSSL_PARAM_construct_octet_string(
+        OSSL_MAC_PARAM_KEY, (void *)key->hmac_key, sizeof(key->hmac_key));
+    params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST,
+                                                 "SHA256", 0);
+    params[2] = OSSL_PARAM_construct_end();
+
+    if (!EVP_CipherInit_ex(cctx, EVP_aes_256_cbc(), NULL, key->aes_key, iv,
+                           enc) ||
+        !EVP_MAC_CTX_set_params(hctx, params))
+        return -1;
+    return 0;
+}
+
+/* Encrypts new tickets under the current key and decrypts tickets issued
+ * under the current or the previous one. Returning 2 asks OpenSSL to issue
+ * a fresh ticket, 0 falls back to a full handshake.
+ */
+static int ticket_key_cb(SSL *ssl, unsigned char key_name[16],
+                         unsigned char *iv, EVP_CIPHER_CTX *cctx,
+                         EVP_MAC_CTX *hctx, int enc) {
+    (void)ssl;
+    int ret = 0;
+
+    rotate_keys();
+    if (enc) {
+        if (RAND_bytes(iv, EVP_MAX_IV_LENGTH) <= 0)
+            return -1;
+
+        pthread_rwlock_rdlock(&keys_lock);
+        memcpy(key_name, current_key.name, TICKET_KEY_NAME_LEN);
+        ret = init_cipher(&current_key, iv, cctx, hctx, 1) < 0 ? -1 : 1;
+        pthread_rwlock_unlock(&keys_lock);
+        return ret;
+    }
+
+    pthread_rwlock_rdlock(&keys_lock);
+    if (memcmp(key_name, current_key.name, TICKET_KEY_NAME_LEN) == 0)
+        ret = init_cipher(&current_key, iv, cctx, hctx, 0) < 0 ? -1 : 1;
+    else if (previous_key.valid &&
+             memcmp(key_name, previous_key.name, TICKET_KEY_NAME_LEN) == 0)
+        ret = init_cipher(&previous_key, iv, cctx, hctx, 0) < 0 ? -1 : 2;
+    pthread_rwlock_unlock(&keys_lock);
+    return ret;
+}
+
+/* Configures session resumption on the shared context: a server-side
+ * session cache of cache_size entries (0 disables it), stateless session
+ * tickets with keys rotated every rotate seconds, and the number of
+ * TLS 1.3 tickets (PSKs) sent after each full handshake.
+ */
+int tls_session_configure(SSL_CTX *ctx, long cache_size, int tickets,
+                          int tls13_tickets, int rotate) {
+    static const unsigned char sid_ctx[] = "minimal_https_server";
+
+    if (!SSL_CTX_set_session_id_context(ctx, sid_ctx, sizeof(sid_ctx) - 1))
+        return -1;
+
+    if (cache_size > 0) {
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+        SSL_CTX_sess_set_cache_size(ctx, cache_size);
+    } else {
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+    }
+
+    if (tickets) {
+        rotate_interval = rotate > 0 ? rotate : 3600;
+        if (generate_key(&current_key) < 0)
+            return -1;
+        SSL_CTX_clear_options(ctx, SSL_OP_NO_TICKET);
+        SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, ticket_key_cb);
+    } else {
+        SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+    }
+
+    /* in TLS 1.3 tickets are how PSK resumption is offered, with
+     * SSL_OP_NO_TICKET they refer to the session cache instead
+     */
+    if (!SSL_CTX_set_num_tickets(ctx, tls13_tickets))
+        return -1;
+
+    metrics_register("https_handshakes_total", "counter",
+                     "Completed TLS handshakes, full or resumed.",
+                     "kind=\"full\"", metrics_read_atomic, &full_handshakes);
+    metrics_register("https_handshakes_total", "counter",
+                     "Completed TLS handshakes, full or resumed.",
+                     "kind=\"resumed\"", metrics_read_atomic,
+                     &resumed_handshakes);
+    return 0;
+}
+
+/* counts a completed handshake as full or resumed */
+void tls_session_handshake_done(SSL *ssl) {
+    if (SSL_session_reused(ssl))
+        atomic_fetch_add(&resumed_handshakes, 1);
+    else
+        atomic_fetch_add(&full_handshakes, 1);
+}
+
+void tls_session_stats(SSL_CTX *ctx, FILE *fp) {
+    fprintf(fp,
+            "tls: full handshakes %lu, resumed %lu, session cache %ld/%ld "
+            "(hits %ld, misses %ld, timeouts %ld)\n",
+            atomic_load(&full_handshakes), atomic_load(&resumed_handshakes),
+            SSL_CTX_sess_number(ctx), SSL_CTX_sess_get_cache_size(ctx),
+            SSL_CTX_sess_hits(ctx), SSL_CTX_sess_misses(ctx),
+            SSL_CTX_sess_timeouts(ctx));
+}
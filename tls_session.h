@@ -0,0 +1,14 @@
+#ifndef TLS_SESSION_H
+#define TLS_SESSION_H
+
+#include <openssl/ssl.h>
+#include <stdio.h>
+
+#define TICKET_KEY_NAME_LEN 16
+
+int tls_session_configure(SSL_CTX *ctx, long cache_size, int tickets,
+                          int tls13_tickets, int rotate);
+void tls_session_handshake_done(SSL *ssl);
+void tls_session_stats(SSL_CTX *ctx, FILE *fp);
+
+#endif
@@ -0,0 +1,174 @@
+#include "uring.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static int sys_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned submit, unsigned wait, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, submit, wait, flags, NULL, 0);
+}
+
+static int sys_register(int fd, unsigned op, const void *arg, unsigned n) {
+    return (int)syscall(__NR_io_uring_register, fd, op, arg, n);
+}
+
+/* maps the rings the kernel set up, returns -1 with errno set on failure */
+int uring_init(URING *ring, unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    memset(ring, 0, sizeof(*ring));
+
+    ring->fd = sys_setup(entries, &p);
+    if (ring->fd < 0)
+        return -1;
+
+    ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size =
+        p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size)
+            ring->sq_ring_size = ring->cq_ring_size;
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd,
+                         IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED)
+        goto fail;
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size,
+                             PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                             ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            munmap(ring->sq_ring, ring->sq_ring_size);
+            goto fail;
+        }
+    }
+    ring->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        if (ring->cq_ring != ring->sq_ring)
+            munmap(ring->cq_ring, ring->cq_ring_size);
+        munmap(ring->sq_ring, ring->sq_ring_size);
+        goto fail;
+    }
+
+    char *sq = ring->sq_ring, *cq = ring->cq_ring;
+    ring->sq_head = (unsigned *)(sq + p.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    ring->entries = p.sq_entries;
+    return 0;
+
+fail:;
+    int err = errno;
+    close(ring->fd);
+    errno = err;
+    return -1;
+}
+
+void uring_destroy(URING *ring) {
+    munmap(ring->sqes, ring->entries * sizeof(struct io_uring_sqe));
+    if (ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+}
+
+/* Returns a cleared submission entry. A full queue is submitted first, so
+ * this only fails when the kernel refuses to take entries.
+ */
+struct io_uring_sqe *uring_sqe(URING *ring) {
+    unsigned tail = *ring->sq_tail;
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (tail - head >= ring->entries) {
+        if (uring_submit(ring, 0) < 0)
+            return NULL;
+        head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        if (tail - head >= ring->entries)
+            return NULL;
+    }
+
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->queued++;
+    return sqe;
+}
+
+/* Submits every queued entry in one system call and, with wait set, waits
+ * until that many completions are available.
+ */
+int uring_submit(URING *ring, unsigned wait) {
+    while (1) {
+        int ret = sys_enter(ring->fd, ring->queued, wait,
+                            wait ? IORING_ENTER_GETEVENTS : 0);
+        if (ret >= 0) {
+            ring->queued -= (unsigned)ret < ring->queued ? (unsigned)ret
+                                                         : ring->queued;
+            return ret;
+        }
+        if (errno != EINTR)
+            return -1;
+    }
+}
+
+/* the oldest completion that was not marked seen yet, or NULL */
+struct io_uring_cqe *uring_peek(URING *ring) {
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        return NULL;
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+void uring_seen(URING *ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/* pins buffers for IORING_OP_READ_FIXED/WRITE_FIXED, by index */
+int uring_register_buffers(URING *ring, const struct iovec *iov, unsigned n) {
+    return sys_register(ring->fd, IORING_REGISTER_BUFFERS, iov, n);
+}
+
+/* descriptors used with IOSQE_FIXED_FILE, by index */
+int uring_register_files(URING *ring, const int *fds, unsigned n) {
+    return sys_register(ring->fd, IORING_REGISTER_FILES, fds, n);
+}
+
+/* whether the kernel has io_uring with every one of the opcodes */
+int uring_supports(const int *ops, int n) {
+    URING ring;
+    if (uring_init(&ring, 4) < 0)
+        return 0;
+
+    size_t size = sizeof(struct io_uring_probe) +
+                  256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, size);
+    int supported = probe != NULL &&
+                    sys_register(ring.fd, IORING_REGISTER_PROBE, probe, 256) ==
+                        0;
+    for (int i = 0; supported && i < n; i++)
+        supported = ops[i] <= probe->last_op &&
+                    (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    uring_destroy(&ring);
+    return supported;
+}
@@ -0,0 +1,41 @@
+#ifndef URING_H
+#define URING_H
+
+#include <linux/io_uring.h>
+#include <sys/uio.h>
+
+/* A submission and completion queue pair set up with the raw io_uring
+ * system calls, the kernel header is all it needs. One thread owns a ring:
+ * it fills submission entries, submits them together and reaps the
+ * completions.
+ */
+typedef struct {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned entries;
+    unsigned queued; // entries filled since the last submit
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+} URING;
+
+int uring_init(URING *ring, unsigned entries);
+void uring_destroy(URING *ring);
+struct io_uring_sqe *uring_sqe(URING *ring);
+int uring_submit(URING *ring, unsigned wait);
+struct io_uring_cqe *uring_peek(URING *ring);
+void uring_seen(URING *ring);
+int uring_register_buffers(URING *ring, const struct iovec *iov, unsigned n);
+int uring_register_files(URING *ring, const int *fds, unsigned n);
+int uring_supports(const int *ops, int n);
+
+#endif
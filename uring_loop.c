@@ -0,0 +1,697 @@
+#define _GNU_SOURCE
+
+#include "uring_loop.h"
+#include "http2.h"
+#include "metrics.h"
+#include "tls_session.h"
+#include "uring.h"
+
+#include <errno.h>
+#include <openssl/bio.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define LOOP_ENTRIES 256
+#define WORKER_ENTRIES 8
+#define IN_SIZE 16384  // what one receive asks for
+#define OUT_SIZE 16384 // handshake flights written by the event loop
+#define SEND_BUF_SIZE (4 * (16384 + 256)) // a few full TLS records
+
+/* low bits of user_data, the rest is the connection or NULL */
+enum tags { TAG_ACCEPT = 1, TAG_EVENT = 2, TAG_RECV = 1, TAG_SEND = 2 };
+#define TAG_MASK 3
+
+/* registered descriptors of the event loop's ring */
+enum fixed_files { FIXED_LISTENER, FIXED_EVENTFD };
+
+typedef struct uring_loop {
+    URING ring;
+    SHARD *shard;
+    int fixed;       // whether the listener and eventfd are registered
+    int efd;         // workers wake the loop through it
+    uint64_t events; // target of the eventfd read
+    pthread_mutex_t lock;
+    CONN *handback; // connections workers gave back, under lock
+    CONN *held;      // found every worker ring full, oldest first
+    CONN *held_tail;
+    int accept_paused; // no accept is posted while connections are held
+    struct sockaddr_storage peer; // filled in by the pending accept
+    socklen_t peer_len;
+} URING_LOOP;
+
+/* The socket side of a connection in this engine. OpenSSL reads and writes
+ * through a BIO over these buffers instead of the socket, and the event
+ * loop moves them with receive and send submissions.
+ */
+struct uring_io {
+    URING_LOOP *loop;
+    int in_pos;
+    int in_len;
+    int eof; // the peer closed the connection or it broke
+    int out_len;
+    int out_sent;
+    int recv_pending;
+    int send_pending;
+    int closing; // freed once no submission refers to it anymore
+    CONN *next;  // in the hand-back list
+    char in[IN_SIZE];
+    char out[OUT_SIZE];
+};
+
+static atomic_ulong loop_submits;
+static atomic_ulong loop_completions;
+static atomic_ulong worker_sends;
+static atomic_ulong worker_recvs;
+static atomic_ulong fixed_reads;
+
+static BIO_METHOD *bio_method;
+static pthread_once_t bio_once = PTHREAD_ONCE_INIT;
+
+/* set in the event loop thread, NULL in workers */
+static __thread URING_LOOP *current_loop;
+
+/* Workers block on a small ring of their own. Their TLS output collects
+ * in send_buf until the write it belongs to is done; like out_buf in
+ * request_handler.c it is only ever filled for one connection at a time.
+ */
+static __thread URING *worker_ring;
+static __thread int worker_ring_failed;
+static __thread char *send_buf;
+static __thread int send_len;
+static __thread CONN *send_owner;
+static __thread void *fixed_buf; // registered as buffer 0 of worker_ring
+static __thread size_t fixed_len;
+
+static URING *get_worker_ring(void) {
+    if (worker_ring != NULL || worker_ring_failed)
+        return worker_ring;
+    URING *ring = malloc(sizeof(URING));
+    if (ring == NULL || uring_init(ring, WORKER_ENTRIES) < 0) {
+        free(ring);
+        worker_ring_failed = 1;
+        return NULL;
+    }
+    return worker_ring = ring;
+}
+
+/* submits one entry and waits for its completion, the worker ring never
+ * has more than one in flight
+ */
+static int worker_complete(URING *ring) {
+    if (uring_submit(ring, 1) < 0)
+        return -errno;
+    struct io_uring_cqe *cqe = uring_peek(ring);
+    if (cqe == NULL)
+        return -EIO;
+    int res = cqe->res;
+    uring_seen(ring);
+    return res;
+}
+
+static int worker_send(CONN *conn, const char *data, int len) {
+    URING *ring = get_worker_ring();
+    while (len > 0) {
+        int sent;
+        struct io_uring_sqe *sqe = ring != NULL ? uring_sqe(ring) : NULL;
+        if (sqe != NULL) {
+            sqe->opcode = IORING_OP_SEND;
+            sqe->fd = conn->socket;
+            sqe->addr = (uintptr_t)data;
+            sqe->len = len;
+            sqe->msg_flags = MSG_NOSIGNAL;
+            sent = worker_complete(ring);
+        } else {
+            sent = send(conn->socket, data, len, MSG_NOSIGNAL);
+            if (sent < 0)
+                sent = -errno;
+        }
+        if (sent == -EINTR || sent == -EAGAIN)
+            continue;
+        if (sent <= 0)
+            return -1;
+        atomic_fetch_add(&worker_sends, 1);
+        data += sent;
+        len -= sent;
+    }
+    return 0;
+}
+
+/* sends whatever OpenSSL wrote for conn on this worker */
+int uring_flush(CONN *conn) {
+    if (send_owner != conn || send_len == 0)
+        return 0;
+    int len = send_len;
+    send_len = 0;
+    return worker_send(conn, send_buf, len);
+}
+
+static int worker_write(CONN *conn, const char *data, int len) {
+    if (send_owner != conn) {
+        send_owner = conn;
+        send_len = 0;
+    }
+    if (send_buf == NULL && (send_buf = malloc(SEND_BUF_SIZE)) == NULL)
+        return -1;
+    if (send_len + len > SEND_BUF_SIZE && uring_flush(conn) < 0)
+        return -1;
+    if (len > SEND_BUF_SIZE)
+        return worker_send(conn, data, len) < 0 ? -1 : len;
+    memcpy(send_buf + send_len, data, len);
+    send_len += len;
+    return len;
+}
+
+static int bio_write(BIO *bio, const char *data, int len) {
+    CONN *conn = BIO_get_data(bio);
+    struct uring_io *io = conn->io;
+
+    BIO_clear_retry_flags(bio);
+    if (current_loop == NULL)
+        return worker_write(conn, data, len);
+
+    /* the event loop sends its output once the connection is driven */
+    int room = OUT_SIZE - io->out_len;
+    if (room == 0) {
+        BIO_set_retry_write(bio);
+        return -1;
+    }
+    int n = len < room ? len : room;
+    memcpy(io->out + io->out_len, data, n);
+    io->out_len += n;
+    return n;
+}
+
+static int bio_read(BIO *bio, char *buf, int len) {
+    CONN *conn = BIO_get_data(bio);
+    struct uring_io *io = conn->io;
+
+    BIO_clear_retry_flags(bio);
+    int avail = io->in_len - io->in_pos;
+    if (avail == 0) {
+        if (io->eof)
+            return 0;
+        BIO_set_retry_read(bio);
+        return -1;
+    }
+    int n = len < avail ? len : avail;
+    memcpy(buf, io->in + io->in_pos, n);
+    io->in_pos += n;
+    if (io->in_pos == io->in_len)
+        io->in_pos = io->in_len = 0;
+    return n;
+}
+
+static long bio_ctrl(BIO *bio, int cmd, long num, void *ptr) {
+    (void)bio;
+    (void)num;
+    (void)ptr;
+    return cmd == BIO_CTRL_FLUSH;
+}
+
+static int bio_create(BIO *bio) {
+    BIO_set_init(bio, 1);
+    return 1;
+}
+
+static void create_bio_method(void) {
+    BIO_METHOD *m = BIO_meth_new(BIO_get_new_index() | BIO_TYPE_SOURCE_SINK,
+                                 "io_uring");
+    if (m == NULL || !BIO_meth_set_write(m, bio_write) ||
+        !BIO_meth_set_read(m, bio_read) || !BIO_meth_set_ctrl(m, bio_ctrl) ||
+        !BIO_meth_set_create(m, bio_create)) {
+        BIO_meth_free(m);
+        return;
+    }
+    bio_method = m;
+}
+
+/* Called by a worker whenever OpenSSL needs more input: the receive is
+ * submitted on the worker's ring and waited for. Output is flushed first,
+ * the peer may be waiting for it.
+ */
+int uring_wait(CONN *conn, int err) {
+    struct uring_io *io = conn->io;
+    if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE)
+        return -1;
+    if (uring_flush(conn) < 0)
+        return -1;
+    if (err == SSL_ERROR_WANT_WRITE || io->in_len > io->in_pos || io->eof)
+        return 0;
+
+    URING *ring = get_worker_ring();
+    int bytes;
+    do {
+        struct io_uring_sqe *sqe = ring != NULL ? uring_sqe(ring) : NULL;
+        if (sqe != NULL) {
+            sqe->opcode = IORING_OP_RECV;
+            sqe->fd = conn->socket;
+            sqe->addr = (uintptr_t)io->in;
+            sqe->len = IN_SIZE;
+            bytes = worker_complete(ring);
+        } else {
+            bytes = recv(conn->socket, io->in, IN_SIZE, 0);
+            if (bytes < 0)
+                bytes = -errno;
+        }
+    } while (bytes == -EINTR || bytes == -EAGAIN);
+    atomic_fetch_add(&worker_recvs, 1);
+
+    if (bytes <= 0) {
+        io->eof = 1;
+        return bytes == 0 ? 0 : -1;
+    }
+    io->in_pos = 0;
+    io->in_len = bytes;
+    return 0;
+}
+
+/* buf is read into with IORING_OP_READ_FIXED from then on */
+void uring_register_buffer(void *buf, size_t len) {
+    URING *ring = get_worker_ring();
+    struct iovec iov = {buf, len};
+    if (ring != NULL && fixed_buf == NULL &&
+        uring_register_buffers(ring, &iov, 1) == 0) {
+        fixed_buf = buf;
+        fixed_len = len;
+    }
+}
+
+ssize_t uring_pread(int fd, void *buf, size_t len, off_t offset) {
+    URING *ring = get_worker_ring();
+    struct io_uring_sqe *sqe = ring != NULL ? uring_sqe(ring) : NULL;
+    if (sqe == NULL)
+        return pread(fd, buf, len, offset);
+
+    int fixed = fixed_buf != NULL && buf >= fixed_buf &&
+                (char *)buf + len <= (char *)fixed_buf + fixed_len;
+    sqe->opcode = fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)buf;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->buf_index = 0;
+    int res = worker_complete(ring);
+    if (fixed)
+        atomic_fetch_add(&fixed_reads, 1);
+    if (res < 0) {
+        errno = -res;
+        return -1;
+    }
+    return res;
+}
+
+void uring_conn_free(CONN *conn) {
+    if (conn->io == NULL)
+        return;
+    if (send_owner == conn) {
+        send_owner = NULL;
+        send_len = 0;
+    }
+    free(conn->io);
+    conn->io = NULL;
+}
+
+static struct io_uring_sqe *loop_sqe(URING_LOOP *loop, int fixed_index,
+                                     int fd) {
+    struct io_uring_sqe *sqe = uring_sqe(&loop->ring);
+    if (sqe == NULL)
+        return NULL;
+    if (loop->fixed) {
+        sqe->fd = fixed_index;
+        sqe->flags = IOSQE_FIXED_FILE;
+    } else {
+        sqe->fd = fd;
+    }
+    return sqe;
+}
+
+static void post_accept(URING_LOOP *loop) {
+    struct io_uring_sqe *sqe =
+        loop_sqe(loop, FIXED_LISTENER, loop->shard->sock);
+    if (sqe == NULL)
+        return;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    loop->peer_len = sizeof(loop->peer);
+    sqe->addr = (uintptr_t)&loop->peer;
+    sqe->addr2 = (uintptr_t)&loop->peer_len;
+    sqe->user_data = TAG_ACCEPT;
+}
+
+static void post_event_read(URING_LOOP *loop) {
+    struct io_uring_sqe *sqe = loop_sqe(loop, FIXED_EVENTFD, loop->efd);
+    if (sqe == NULL)
+        return;
+    sqe->opcode = IORING_OP_READ;
+    sqe->addr = (uintptr_t)&loop->events;
+    sqe->len = sizeof(loop->events);
+    sqe->user_data = TAG_EVENT;
+}
+
+static int post_recv(CONN *conn) {
+    struct uring_io *io = conn->io;
+    struct io_uring_sqe *sqe = uring_sqe(&io->loop->ring);
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->socket;
+    sqe->addr = (uintptr_t)io->in;
+    sqe->len = IN_SIZE;
+    sqe->user_data = (uintptr_t)conn | TAG_RECV;
+    io->recv_pending = 1;
+    return 0;
+}
+
+static int post_send(CONN *conn) {
+    struct uring_io *io = conn->io;
+    struct io_uring_sqe *sqe = uring_sqe(&io->loop->ring);
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = conn->socket;
+    sqe->addr = (uintptr_t)(io->out + io->out_sent);
+    sqe->len = io->out_len - io->out_sent;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (uintptr_t)conn | TAG_SEND;
+    io->send_pending = 1;
+    return 0;
+}
+
+/* frees a connection of the event loop once no submission refers to it */
+static void close_conn(CONN *conn) {
+    struct uring_io *io = conn->io;
+    if (io->recv_pending || io->send_pending) {
+        if (!io->closing)
+            shutdown(conn->socket, SHUT_RDWR);
+        io->closing = 1;
+        return;
+    }
+    cleanup_noexit(conn);
+}
+
+/* Queues what the connection waits for: its pending output and, when
+ * OpenSSL asked for it, more input. Everything queued goes to the kernel
+ * with the loop's next submission.
+ */
+static void wait_for(CONN *conn, int input) {
+    struct uring_io *io = conn->io;
+    if (io->out_len > io->out_sent && !io->send_pending &&
+        post_send(conn) < 0) {
+        close_conn(conn);
+        return;
+    }
+    if (input && !io->recv_pending && !io->eof && post_recv(conn) < 0)
+        close_conn(conn);
+}
+
+/* gives a connection to the workers, or holds it back while they are busy;
+ * until they made room no new clients are accepted
+ */
+static void hand_over(CONN *conn) {
+    URING_LOOP *loop = conn->io->loop;
+    conn->state = CONN_PROCESSING;
+    if (loop->held == NULL && try_dispatch_connection(conn))
+        return;
+
+    conn->held = NULL;
+    if (loop->held_tail != NULL)
+        loop->held_tail->held = conn;
+    else
+        loop->held = conn;
+    loop->held_tail = conn;
+}
+
+/* queues the held connections in order once a worker wrote the eventfd */
+static void release_held(URING_LOOP *loop) {
+    while (loop->held != NULL) {
+        CONN *next = loop->held->held;
+        if (!try_dispatch_connection(loop->held))
+            return;
+        loop->held = next;
+    }
+    loop->held_tail = NULL;
+    if (loop->accept_paused) {
+        loop->accept_paused = 0;
+        post_accept(loop);
+    }
+}
+
+/* advances a connection as far as its buffers allow, like drive() in
+ * event_loop.c
+ */
+static void drive(CONN *conn) {
+    struct uring_io *io = conn->io;
+    int ret, want;
+
+    if (io->closing) {
+        close_conn(conn);
+        return;
+    }
+    /* output leaves in order, the next step waits for the send */
+    if (io->send_pending)
+        return;
+
+    if (conn->state == CONN_HANDSHAKE) {
+        ret = SSL_accept(conn->ssl);
+        if (ret <= 0) {
+            want = SSL_get_error(conn->ssl, ret);
+            if (want == SSL_ERROR_WANT_READ || want == SSL_ERROR_WANT_WRITE) {
+                wait_for(conn, want == SSL_ERROR_WANT_READ);
+                return;
+            }
+            ERR_print_errors_fp(stderr);
+            metrics_add(M_HANDSHAKE_FAILURES, 1);
+            close_conn(conn);
+            return;
+        }
+        metrics_observe(H_HANDSHAKE, metrics_now() - conn->accepted_at);
+        tls_session_handshake_done(conn->ssl);
+        conn->state = CONN_READING;
+        conn_deadline(conn, PHASE_IDLE);
+    }
+
+    /* a worker only gets the connection once the last flight is out */
+    if (io->out_len > io->out_sent) {
+        wait_for(conn, 0);
+        return;
+    }
+    if (conn->h2 != NULL || http2_negotiated(conn->ssl)) {
+        if (io->recv_pending)
+            return;
+        hand_over(conn);
+        return;
+    }
+
+    ret = read_request(conn, &want);
+    if (ret < 0) {
+        close_conn(conn);
+        return;
+    }
+    if (ret == 0 || io->out_len > io->out_sent || io->recv_pending) {
+        wait_for(conn, ret == 0);
+        return;
+    }
+
+    conn_deadline_cancel(conn);
+    hand_over(conn);
+}
+
+static void accept_client(URING_LOOP *loop, int client) {
+    SHARD *shard = loop->shard;
+    SSL *ssl = SSL_new(shard->ctx);
+    CONN *conn = ssl != NULL ? conn_new(shard, client, ssl,
+                                        (struct sockaddr *)&loop->peer,
+                                        loop->peer_len)
+                             : NULL;
+    struct uring_io *io = conn != NULL ? malloc(sizeof(*io)) : NULL;
+    BIO *bio = io != NULL ? BIO_new(bio_method) : NULL;
+    if (bio == NULL) {
+        perror("connection");
+        free(io);
+        if (conn != NULL) {
+            cleanup_noexit(conn);
+        } else {
+            SSL_free(ssl);
+            close(client);
+        }
+        return;
+    }
+
+    memset(io, 0, offsetof(struct uring_io, in));
+    io->loop = loop;
+    conn->io = io;
+    BIO_set_data(bio, conn);
+    SSL_set_bio(ssl, bio, bio);
+    atomic_fetch_add(&shard->accepted, 1);
+    metrics_add(M_ACCEPTS, 1);
+    conn_deadline(conn, PHASE_HANDSHAKE);
+
+    /* the handshake starts once the ClientHello arrives */
+    if (post_recv(conn) < 0)
+        cleanup_noexit(conn);
+}
+
+/* connections the workers gave back wait for input again */
+static void take_handbacks(URING_LOOP *loop) {
+    pthread_mutex_lock(&loop->lock);
+    CONN *conn = loop->handback;
+    loop->handback = NULL;
+    pthread_mutex_unlock(&loop->lock);
+
+    while (conn != NULL) {
+        CONN *next = conn->io->next;
+        if (conn->io->in_len > conn->io->in_pos)
+            drive(conn);
+        else
+            wait_for(conn, 1);
+        conn = next;
+    }
+}
+
+static void complete(URING_LOOP *loop, uint64_t data, int res) {
+    CONN *conn = (CONN *)(uintptr_t)(data & ~(uint64_t)TAG_MASK);
+    int tag = data & TAG_MASK;
+
+    if (conn == NULL) {
+        if (tag == TAG_ACCEPT) {
+            if (res >= 0)
+                accept_client(loop, res);
+            else if (res != -EINTR && res != -EAGAIN && res != -ECONNABORTED)
+                fprintf(stderr, "Unable to accept: %s\n", strerror(-res));
+            if (loop->held == NULL)
+                post_accept(loop);
+            else
+                loop->accept_paused = 1;
+        } else {
+            take_handbacks(loop);
+            release_held(loop);
+            post_event_read(loop);
+        }
+        return;
+    }
+
+    struct uring_io *io = conn->io;
+    if (tag == TAG_RECV) {
+        io->recv_pending = 0;
+        if (res > 0) {
+            io->in_pos = 0;
+            io->in_len = res;
+        } else if (res != -EINTR && res != -EAGAIN) {
+            io->eof = 1;
+        }
+    } else {
+        io->send_pending = 0;
+        if (res >= 0) {
+            io->out_sent += res;
+            if (io->out_sent == io->out_len)
+                io->out_sent = io->out_len = 0;
+        } else if (res != -EINTR && res != -EAGAIN) {
+            io->eof = 1;
+            io->out_sent = io->out_len = 0;
+        }
+    }
+    drive(conn);
+}
+
+/* Called by a worker that ran out of buffered requests, instead of
+ * rearming epoll: the connection goes on the hand-back list and the loop
+ * is woken through its eventfd. Its deadline is already armed.
+ */
+void uring_loop_wait(CONN *conn, int want) {
+    (void)want; // workers flush their output, only input is waited for
+    URING_LOOP *loop = conn->io->loop;
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&loop->lock);
+    conn->io->next = loop->handback;
+    loop->handback = conn;
+    pthread_mutex_unlock(&loop->lock);
+    if (write(loop->efd, &one, sizeof(one)) < 0)
+        perror("eventfd");
+}
+
+/* whether the kernel has everything the engine submits */
+int uring_available(void) {
+    static const int ops[] = {IORING_OP_ACCEPT, IORING_OP_RECV,
+                              IORING_OP_SEND,   IORING_OP_READ,
+                              IORING_OP_READ_FIXED};
+    pthread_once(&bio_once, create_bio_method);
+    return bio_method != NULL &&
+           uring_supports(ops, sizeof(ops) / sizeof(ops[0]));
+}
+
+/* sets up the shard's ring, NULL when io_uring cannot be used */
+URING_LOOP *uring_loop_new(SHARD *shard) {
+    pthread_once(&bio_once, create_bio_method);
+    URING_LOOP *loop = calloc(1, sizeof(URING_LOOP));
+    if (bio_method == NULL || loop == NULL) {
+        free(loop);
+        return NULL;
+    }
+    if (uring_init(&loop->ring, LOOP_ENTRIES) < 0) {
+        perror("io_uring_setup");
+        free(loop);
+        return NULL;
+    }
+    loop->efd = eventfd(0, EFD_CLOEXEC);
+    if (loop->efd < 0) {
+        perror("eventfd");
+        uring_destroy(&loop->ring);
+        free(loop);
+        return NULL;
+    }
+    loop->shard = shard;
+    pthread_mutex_init(&loop->lock, NULL);
+
+    int fds[] = {shard->sock, loop->efd};
+    loop->fixed = uring_register_files(&loop->ring, fds, 2) == 0;
+    return loop;
+}
+
+/* Runs the shard's accepts, handshakes and request reads on its ring.
+ * Every iteration submits all that was queued while handling the previous
+ * completions and waits for new ones in a single system call.
+ */
+int uring_loop_run(URING_LOOP *loop) {
+    current_loop = loop;
+    loop->shard->queue.wake_fd = loop->efd;
+    post_accept(loop);
+    post_event_read(loop);
+
+    while (1) {
+        if (uring_submit(&loop->ring, 1) < 0) {
+            perror("io_uring_enter");
+            break;
+        }
+        atomic_fetch_add(&loop_submits, 1);
+
+        struct io_uring_cqe *cqe;
+        while ((cqe = uring_peek(&loop->ring)) != NULL) {
+            uint64_t data = cqe->user_data;
+            int res = cqe->res;
+            uring_seen(&loop->ring);
+            atomic_fetch_add(&loop_completions, 1);
+            complete(loop, data, res);
+        }
+    }
+
+    return -1;
+}
+
+void uring_stats(FILE *fp) {
+    fprintf(fp,
+            "io_uring: %lu loop submissions, %lu completions, "
+            "worker %lu sends %lu receives, %lu fixed buffer reads\n",
+            atomic_load(&loop_submits), atomic_load(&loop_completions),
+            atomic_load(&worker_sends), atomic_load(&worker_recvs),
+            atomic_load(&fixed_reads));
+}
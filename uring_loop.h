@@ -0,0 +1,20 @@
+#ifndef URING_LOOP_H
+#define URING_LOOP_H
+
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "request_handler.h"
+
+struct uring_loop *uring_loop_new(SHARD *shard);
+int uring_loop_run(struct uring_loop *loop);
+int uring_available(void);
+void uring_loop_wait(CONN *conn, int want);
+int uring_wait(CONN *conn, int err);
+int uring_flush(CONN *conn);
+void uring_register_buffer(void *buf, size_t len);
+ssize_t uring_pread(int fd, void *buf, size_t len, off_t offset);
+void uring_conn_free(CONN *conn);
+void uring_stats(FILE *fp);
+
+#endif
@@ -0,0 +1,18 @@
+#include "validators.h"
+
+#include <stdio.h>
+
+#include "http_parser.h"
+
+/* The mtime goes in with nanoseconds, so rewriting a file within the same
+ * second still changes the tag and it can be strong.
+ */
+void validators_init(VALIDATORS *v, ino_t ino, off_t size,
+                     struct timespec mtime) {
+    v->mtime = mtime.tv_sec;
+    snprintf(v->etag, sizeof(v->etag), "\"%lx-%lx-%lx.%lx\"",
+             (unsigned long)ino, (unsigned long)size,
+             (unsigned long)mtime.tv_sec, (unsigned long)mtime.tv_nsec);
+    http_date_format(mtime.tv_sec, v->last_modified,
+                     sizeof(v->last_modified));
+}
@@ -0,0 +1,20 @@
+#ifndef VALIDATORS_H
+#define VALIDATORS_H
+
+#include <sys/types.h>
+#include <time.h>
+
+/* The validators of one version of a file, formatted once when the file
+ * is stat'ed and copied along with it into the caches, so conditional
+ * requests are evaluated without any formatting or file I/O.
+ */
+typedef struct {
+    time_t mtime;           // what Last-Modified and its conditions use
+    char etag[64];          // strong, quoted: "inode-size-mtime"
+    char last_modified[32]; // IMF-fixdate
+} VALIDATORS;
+
+void validators_init(VALIDATORS *v, ino_t ino, off_t size,
+                     struct timespec mtime);
+
+#endif
@@ -0,0 +1,206 @@
+#include "work_queue.h"
+#include "metrics.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+int work_queue_init(WORK_QUEUE *queue, int workers, int capacity) {
+    queue->workers = workers;
+    /* round the total capacity up so that every worker gets a slot */
+    queue->capacity = (capacity + workers - 1) / workers;
+    if (queue->capacity < 1)
+        queue->capacity = 1;
+
+    queue->deques = calloc(workers, sizeof(WORK_DEQUE));
+    if (queue->deques == NULL)
+        return -1;
+
+    for (int i = 0; i < workers; i++) {
+        WORK_DEQUE *deque = &queue->deques[i];
+        deque->items = malloc(sizeof(void *) * queue->capacity);
+        if (deque->items == NULL) {
+            while (i--)
+                free(queue->deques[i].items);
+            free(queue->deques);
+            return -1;
+        }
+        pthread_mutex_init(&deque->lock, NULL);
+        atomic_init(&deque->steals, 0);
+    }
+
+    atomic_init(&queue->depth, 0);
+    atomic_init(&queue->next, 0);
+    atomic_init(&queue->pushed, 0);
+    atomic_init(&queue->full_waits, 0);
+    queue->wake_fd = -1;
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->not_empty, NULL);
+    pthread_cond_init(&queue->not_full, NULL);
+    return 0;
+}
+
+void work_queue_destroy(WORK_QUEUE *queue) {
+    for (int i = 0; i < queue->workers; i++) {
+        pthread_mutex_destroy(&queue->deques[i].lock);
+        free(queue->deques[i].items);
+    }
+    free(queue->deques);
+    pthread_mutex_destroy(&queue->lock);
+    pthread_cond_destroy(&queue->not_empty);
+    pthread_cond_destroy(&queue->not_full);
+}
+
+static int deque_push(WORK_QUEUE *queue, WORK_DEQUE *deque, void *item) {
+    int pushed = 0;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count < queue->capacity) {
+        deque->items[(deque->head + deque->count) % queue->capacity] = item;
+        deque->count++;
+        pushed = 1;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return pushed;
+}
+
+static void *deque_pop(WORK_QUEUE *queue, WORK_DEQUE *deque) {
+    void *item = NULL;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count > 0) {
+        item = deque->items[deque->head];
+        deque->head = (deque->head + 1) % queue->capacity;
+        deque->count--;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return item;
+}
+
+/* Takes a slot before the item becomes visible, so depth never counts
+ * fewer items than the rings hold and a consumer that found one never
+ * drives it below zero. Returns 0 when every slot is taken.
+ */
+static int reserve(WORK_QUEUE *queue) {
+    int total = queue->workers * queue->capacity;
+    int depth = atomic_load(&queue->depth);
+    do {
+        if (depth >= total)
+            return 0;
+    } while (!atomic_compare_exchange_weak(&queue->depth, &depth, depth + 1));
+    return 1;
+}
+
+/* puts an item into the reserved slot, some ring always has room for it */
+static void publish(WORK_QUEUE *queue, void *item) {
+    unsigned start = atomic_fetch_add(&queue->next, 1);
+    for (unsigned i = 0;; i++) {
+        WORK_DEQUE *deque = &queue->deques[(start + i) % queue->workers];
+        if (deque_push(queue, deque, item))
+            break;
+    }
+    atomic_fetch_add(&queue->pushed, 1);
+
+    pthread_mutex_lock(&queue->lock);
+    pthread_cond_signal(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+/* Queues an item, blocking while every ring is full so that a burst of
+ * connections backs up into the listen backlog instead of into memory.
+ */
+void work_queue_push(WORK_QUEUE *queue, void *item) {
+    while (!reserve(queue)) {
+        atomic_fetch_add(&queue->full_waits, 1);
+        pthread_mutex_lock(&queue->lock);
+        while (atomic_load(&queue->depth) >=
+               queue->workers * queue->capacity)
+            pthread_cond_wait(&queue->not_full, &queue->lock);
+        pthread_mutex_unlock(&queue->lock);
+    }
+    publish(queue, item);
+}
+
+/* queues an item unless every ring is full, for the event loops which must
+ * not sleep; they are woken through wake_fd once a slot is free
+ */
+int work_queue_try_push(WORK_QUEUE *queue, void *item) {
+    if (!reserve(queue)) {
+        atomic_fetch_add(&queue->full_waits, 1);
+        return 0;
+    }
+    publish(queue, item);
+    return 1;
+}
+
+/* Takes the next item for a worker: its own ring first, then any other
+ * ring, and only sleeps when the whole queue is empty.
+ */
+void *work_queue_pop(WORK_QUEUE *queue, int worker) {
+    while (1) {
+        void *item = deque_pop(queue, &queue->deques[worker]);
+        for (int i = 1; item == NULL && i < queue->workers; i++) {
+            WORK_DEQUE *victim =
+                &queue->deques[(worker + i) % queue->workers];
+            if ((item = deque_pop(queue, victim)) != NULL)
+                atomic_fetch_add(&queue->deques[worker].steals, 1);
+        }
+
+        if (item != NULL) {
+            int full = atomic_fetch_sub(&queue->depth, 1) >=
+                       queue->workers * queue->capacity;
+            if (full) {
+                pthread_mutex_lock(&queue->lock);
+                pthread_cond_signal(&queue->not_full);
+                pthread_mutex_unlock(&queue->lock);
+                uint64_t one = 1;
+                if (queue->wake_fd >= 0 &&
+                    write(queue->wake_fd, &one, sizeof(one)) < 0)
+                    perror("eventfd");
+            }
+            return item;
+        }
+
+        pthread_mutex_lock(&queue->lock);
+        while (atomic_load(&queue->depth) == 0)
+            pthread_cond_wait(&queue->not_empty, &queue->lock);
+        pthread_mutex_unlock(&queue->lock);
+    }
+}
+
+void work_queue_stats(WORK_QUEUE *queue, FILE *fp) {
+    unsigned long steals = 0;
+    for (int i = 0; i < queue->workers; i++)
+        steals += atomic_load(&queue->deques[i].steals);
+
+    fprintf(fp, "queue: depth %d/%d, pushed %lu, steals %lu, full waits %lu\n",
+            atomic_load(&queue->depth), queue->workers * queue->capacity,
+            atomic_load(&queue->pushed), steals,
+            atomic_load(&queue->full_waits));
+    for (int i = 0; i < queue->workers; i++)
+        fprintf(fp, "  worker %d: steals %lu\n", i,
+                atomic_load(&queue->deques[i].steals));
+}
+
+static unsigned long read_depth(const void *source) {
+    return atomic_load(&((WORK_QUEUE *)source)->depth);
+}
+
+static unsigned long read_steals(const void *source) {
+    const WORK_QUEUE *queue = source;
+    unsigned long steals = 0;
+    for (int i = 0; i < queue->workers; i++)
+        steals += atomic_load(&queue->deques[i].steals);
+    return steals;
+}
+
+/* exports the queue on /metrics, labels tells it from other shards' */
+void work_queue_register_metrics(WORK_QUEUE *queue, const char *labels) {
+    metrics_register("https_queue_depth", "gauge",
+                     "Connections queued for a worker.", labels, read_depth,
+                     queue);
+    metrics_register("https_queue_steals_total", "counter",
+                     "Connections a worker took from another's ring.",
+                     labels, read_steals, queue);
+    metrics_register("https_queue_full_waits_total", "counter",
+                     "Dispatches that found every ring full.", labels,
+                     metrics_read_atomic, &queue->full_waits);
+}
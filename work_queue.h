@@ -0,0 +1,43 @@
+#ifndef WORK_QUEUE_H
+#define WORK_QUEUE_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+
+/* one bounded ring per worker, producers spread items across the rings and
+ * idle workers steal from their neighbours before going to sleep
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    void **items;
+    int head;
+    int count;
+    atomic_ulong steals; // items this worker took from other rings
+} WORK_DEQUE;
+
+typedef struct {
+    int workers;
+    int capacity; // per worker ring
+    WORK_DEQUE *deques;
+
+    atomic_int depth;  // slots taken over all rings, queued or being queued
+    atomic_uint next;  // round-robin producer cursor
+    pthread_mutex_t lock; // only used to sleep and wake up
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    int wake_fd; // eventfd written when a full queue frees a slot, or -1
+
+    atomic_ulong pushed;
+    atomic_ulong full_waits; // pushes that found every slot taken
+} WORK_QUEUE;
+
+int work_queue_init(WORK_QUEUE *queue, int workers, int capacity);
+void work_queue_destroy(WORK_QUEUE *queue);
+void work_queue_push(WORK_QUEUE *queue, void *item);
+int work_queue_try_push(WORK_QUEUE *queue, void *item);
+void *work_queue_pop(WORK_QUEUE *queue, int worker);
+void work_queue_stats(WORK_QUEUE *queue, FILE *fp);
+void work_queue_register_metrics(WORK_QUEUE *queue, const char *labels);
+
+#endif